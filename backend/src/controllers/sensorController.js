@@ -12,12 +12,28 @@ function handleUpdateRelayState(relayState) {
   console.log("Sent relay state to Raspberry Pi:", relayState);
 }
 
+// [{ cell, type: "relay" | "charge_mode" | "current_setpoint" | "voltage_setpoint", value }]
+function handleSendCommands(commands) {
+  return tcpServer.sendCommandsToRaspberryPi(commands);
+}
+
 // 설정한 핸들러를 tcpServer에 주입
 tcpServer.onSensorDataReceived = (sensorData) => {
   const io = require("../server").io;
   handleSensorData(sensorData, io);
 };
 
+tcpServer.onAckReceived = (acks) => {
+  const io = require("../server").io;
+  io.emit("command_ack", acks);
+};
+
+// 고속 샘플은 DB에 저장하지 않고 화면으로만 전달
+tcpServer.onSamplesReceived = (batch) => {
+  const io = require("../server").io;
+  io.emit("sensor_samples", batch.samples);
+};
+
 async function queryBatteryData(batteryNumber, startTime, endTime) {
   const connection = await getConnection();
   const query = `
@@ -42,4 +58,4 @@ async function queryBatteryData(batteryNumber, startTime, endTime) {
   return rows;
 }
 
-module.exports = { handleSensorData, handleUpdateRelayState, queryBatteryData };
+module.exports = { handleSensorData, handleUpdateRelayState, handleSendCommands, queryBatteryData };
@@ -23,6 +23,15 @@ io.on("connection", (socket) => {
     );
   });
 
+  // 셀별 명령 묶음 (릴레이, 충전 모드, 전류/전압 설정값), 응답은 command_ack 이벤트
+  socket.on("send_commands", (commands) => {
+    try {
+      require("./controllers/sensorController").handleSendCommands(commands);
+    } catch (error) {
+      console.error("Invalid commands from client:", error.message);
+    }
+  });
+
   socket.on("disconnect", () => {
     console.log("Client disconnected");
   });
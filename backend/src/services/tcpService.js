@@ -1,13 +1,59 @@
 const net = require("net");
+const {
+  FRAME_TELEMETRY,
+  FRAME_SAMPLES,
+  FRAME_ACK,
+  FRAME_RECORD,
+  isFrameStart,
+  decodeTelemetry,
+  decodeSamples,
+  encodeCommands,
+  decodeAcks,
+  decodeRecord,
+  encodeRecordAck,
+  FrameReader,
+} = require("./telemetryProtocol");
 let raspberryPiSocket = null;
+let raspberryPiBinary = false; // 바이너리 프레임으로 통신하는 장치면 명령도 프레임으로
+let commandSeq = 0;
 let isFirstDataPacket = true;
 
 const tcpServer = net.createServer((socket) => {
   console.log("Raspberry Pi connected");
   raspberryPiSocket = socket;
+  const frameReader = new FrameReader();
+  let binary = null; // 첫 데이터로 바이너리 프레임/JSON 형식을 판별
 
   socket.on("data", (data) => {
     try {
+      if (binary === null) {
+        binary = isFrameStart(data);
+        if (socket === raspberryPiSocket) raspberryPiBinary = binary;
+      }
+      if (binary) {
+        let lastRecord = null; // 이번에 받은 가장 큰 저널 seq, 처리 후 한 번만 ack
+        for (let frame of frameReader.feed(data)) {
+          if (frame.type === FRAME_RECORD) {
+            frame = decodeRecord(frame.payload);
+            lastRecord = frame.seq;
+          }
+          if (frame.type === FRAME_SAMPLES) {
+            tcpServer.onSamplesReceived(decodeSamples(frame.payload));
+            continue;
+          }
+          if (frame.type === FRAME_ACK) {
+            tcpServer.onAckReceived(decodeAcks(frame.payload));
+            continue;
+          }
+          if (frame.type !== FRAME_TELEMETRY) continue;
+          const sensorData = decodeTelemetry(frame.payload);
+          if (sensorData.no_data) continue; // 측정 전 프레임은 무시
+          tcpServer.onSensorDataReceived(sensorData);
+        }
+        if (lastRecord !== null) socket.write(encodeRecordAck(lastRecord));
+        return;
+      }
+
       if (isFirstDataPacket) {
         console.log("Ignoring first data packet");
         isFirstDataPacket = false;
@@ -26,24 +72,48 @@ const tcpServer = net.createServer((socket) => {
       tcpServer.onSensorDataReceived(sensorData);
     } catch (error) {
       console.error("Error parsing data from Raspberry Pi:", error.message);
+      if (binary) socket.destroy(); // 프레임 경계를 잃으면 재접속으로 복구
     }
   });
 
   socket.on("end", () => {
     console.log("Raspberry Pi disconnected");
+    if (socket !== raspberryPiSocket) return; // 재접속한 새 연결은 유지
     raspberryPiSocket = null;
+    raspberryPiBinary = false;
     isFirstDataPacket = true; // 연결이 끊어지면 플래그를 리셋
   });
 
   socket.on("error", (err) => {
     console.error("Socket error:", err);
+    if (socket !== raspberryPiSocket) return;
     raspberryPiSocket = null;
+    raspberryPiBinary = false;
     isFirstDataPacket = true; // 오류가 발생해도 플래그를 리셋
   });
 });
 
+// commands: [{ cell, type, value }], 한 번에 여러 셀/명령 전송, seq 목록 반환
+tcpServer.sendCommandsToRaspberryPi = (commands) => {
+  if (!raspberryPiSocket || !raspberryPiBinary) {
+    console.error("Raspberry Pi is not connected with framed commands");
+    return [];
+  }
+  const numbered = commands.map((c) => ({ ...c, seq: (commandSeq = (commandSeq + 1) >>> 0) }));
+  raspberryPiSocket.write(encodeCommands(numbered));
+  return numbered.map((c) => c.seq);
+};
+
 tcpServer.sendRelayStateToRaspberryPi = (relayState) => {
-  if (raspberryPiSocket) {
+  if (raspberryPiSocket && raspberryPiBinary) {
+    // "101" -> 셀별 릴레이 명령 묶음
+    const commands = [...String(relayState)]
+      .map((ch, i) => ({ cell: i + 1, type: "relay", value: ch === "1" ? 1 : 0, valid: ch === "0" || ch === "1" }))
+      .filter((c) => c.valid)
+      .map(({ valid, ...c }) => c);
+    tcpServer.sendCommandsToRaspberryPi(commands);
+    console.log("Relay state sent to Raspberry Pi:", relayState);
+  } else if (raspberryPiSocket) {
     raspberryPiSocket.write(relayState);
     console.log("Relay state sent to Raspberry Pi:", relayState);
   } else {
@@ -55,4 +125,10 @@ tcpServer.onSensorDataReceived = (sensorData) => {
   console.error("onSensorDataReceived handler is not set");
 };
 
+// 명령 응답 [{ seq, cell, type, status, value }]
+tcpServer.onAckReceived = (acks) => {};
+
+// 고속 샘플 묶음 (BMS_CAPTURE=1), 기본은 버림
+tcpServer.onSamplesReceived = (batch) => {};
+
 module.exports = tcpServer;
@@ -0,0 +1,236 @@
+// 라즈베리파이 바이너리 텔레메트리 프레임 디코더 (bms/protocol.h 와 같은 형식)
+//
+// frame     : 'B' 'M' | version u8 | type u8 | payload length u32 | payload
+// telemetry : seq u32 | timestamp_us u64 | cells u16 | record size u8 | resister fan pwm u8
+//             cell record: voltage mV u16 | current 0.01mA i32 | temperature 0.01'C i16 |
+//             resister temp 0.01'C i16 | soc u8 | duty u8 | charge mode u8 | fan pwm u8 | flags u8 | reserved u8
+// samples   : seq u32 | base timestamp_us u64 | count u32 | record size u8 | reserved 3
+//             sample record: offset us u32 | cell u16 | voltage mV u16 | current 0.01mA i32 |
+//             duty u8 | charge mode u8 | soc u8 | flags u8
+// command   : count u16 | record size u8 | reserved u8
+//             record: seq u32 | cell u16 (0xffff = 전체) | type u8 | status u8 (ack) | value i32
+// ack       : command 와 같은 형식, status 는 ACK_STATUS, value 는 실제 적용된 값
+// record    : journal seq u64 | 안쪽 프레임 (장치 저널에서 보낸 텔레메트리, bms/journal.h)
+// record ack: 받은 가장 큰 journal seq u64 (서버 -> 장치)
+
+const MAGIC0 = 0x42; // 'B'
+const MAGIC1 = 0x4d; // 'M'
+const VERSION = 1;
+const HEADER_SIZE = 8;
+const MAX_PAYLOAD = 1 << 20;
+
+const FRAME_TELEMETRY = 1;
+const FRAME_SAMPLES = 2;
+const FRAME_COMMAND = 3;
+const FRAME_ACK = 4;
+const FRAME_RECORD = 5;
+const FRAME_RECORD_ACK = 6;
+const RECORD_HEADER_SIZE = 8;
+const TELEMETRY_HEADER_SIZE = 16;
+const TELEMETRY_RECORD_SIZE = 16;
+const SAMPLES_HEADER_SIZE = 20;
+const SAMPLE_RECORD_SIZE = 16;
+const COMMAND_HEADER_SIZE = 4;
+const COMMAND_RECORD_SIZE = 12;
+const CELL_ALL = 0xffff;
+
+const COMMAND_TYPES = {
+  relay: 1, // 0 off, 1 on
+  charge_mode: 2, // -1 자동, 0 정지, 1 표준, 2 급속 (상한)
+  current_setpoint: 3, // mA, 0 = 기본값
+  voltage_setpoint: 4, // mV, 0 = 4200
+};
+const ACK_STATUS = ["ok", "bad_cell", "bad_type", "bad_value", "refused"]; // refused: 안전 감시가 릴레이를 열어 둔 동안
+
+const CELL_RELAY_ON = 0x01;
+const CELL_VOLTAGE_INVALID = 0x02;
+const CELL_CURRENT_INVALID = 0x04;
+const CELL_TEMP_INVALID = 0x08;
+const CELL_RESISTER_TEMP_INVALID = 0x10;
+const CELL_NO_DATA = 0x20;
+
+function isFrameStart(buffer) {
+  return buffer.length >= 2 && buffer[0] === MAGIC0 && buffer[1] === MAGIC1;
+}
+
+// 바이너리 텔레메트리를 기존 JSON 과 같은 키의 객체로 변환, 유효하지 않은 값은 null
+function decodeTelemetry(payload) {
+  if (payload.length < TELEMETRY_HEADER_SIZE) throw new Error("short telemetry payload");
+  const cells = payload.readUInt16LE(12);
+  const recordSize = payload[14];
+  if (recordSize < TELEMETRY_RECORD_SIZE || payload.length < TELEMETRY_HEADER_SIZE + cells * recordSize) {
+    throw new Error("truncated telemetry payload");
+  }
+
+  const data = {
+    seq: payload.readUInt32LE(0),
+    timestamp_us: Number(payload.readBigUInt64LE(4)),
+    cells,
+  };
+  let noData = true;
+  for (let i = 0; i < cells; i++) {
+    const p = TELEMETRY_HEADER_SIZE + i * recordSize;
+    const flags = payload[p + 14];
+    const n = i + 1;
+    if (!(flags & CELL_NO_DATA)) noData = false;
+    data[`voltage_${n}`] = flags & CELL_VOLTAGE_INVALID ? null : payload.readUInt16LE(p) / 1000;
+    data[`current_${n}`] = flags & CELL_CURRENT_INVALID ? null : payload.readInt32LE(p + 2) / 100;
+    data[`soc_${n}`] = payload[p + 10];
+    data[`temperature_${n}`] = flags & CELL_TEMP_INVALID ? null : payload.readInt16LE(p + 6) / 100;
+    data[`charge_mode_${n}`] = payload[p + 12];
+    data[`relay_state_${n}`] = flags & CELL_RELAY_ON ? 1 : 0;
+    data[`fan_pwm_${n}`] = payload[p + 13];
+    data[`duty_cycle${n}`] = payload[p + 11];
+    data[`resister_temp_${n}`] = flags & CELL_RESISTER_TEMP_INVALID ? null : payload.readInt16LE(p + 8) / 100;
+  }
+  data.resister_fan_pwm = payload[15];
+  data.no_data = cells > 0 && noData; // 충전 루프가 아직 값을 내지 않음
+  return data;
+}
+
+// 제어 루프 고속 샘플 묶음, cell 은 1부터
+function decodeSamples(payload) {
+  if (payload.length < SAMPLES_HEADER_SIZE) throw new Error("short samples payload");
+  const base = payload.readBigUInt64LE(4);
+  const count = payload.readUInt32LE(12);
+  const recordSize = payload[16];
+  if (recordSize < SAMPLE_RECORD_SIZE || payload.length < SAMPLES_HEADER_SIZE + count * recordSize) {
+    throw new Error("truncated samples payload");
+  }
+
+  const samples = new Array(count);
+  for (let i = 0; i < count; i++) {
+    const p = SAMPLES_HEADER_SIZE + i * recordSize;
+    const flags = payload[p + 15];
+    samples[i] = {
+      timestamp_us: Number(base + BigInt(payload.readUInt32LE(p))),
+      cell: payload.readUInt16LE(p + 4) + 1,
+      voltage: flags & CELL_VOLTAGE_INVALID ? null : payload.readUInt16LE(p + 6) / 1000,
+      current: flags & CELL_CURRENT_INVALID ? null : payload.readInt32LE(p + 8) / 100,
+      duty_cycle: payload[p + 12],
+      charge_mode: payload[p + 13],
+      soc: payload[p + 14],
+      relay_state: flags & CELL_RELAY_ON ? 1 : 0,
+    };
+  }
+  return { seq: payload.readUInt32LE(0), samples };
+}
+
+// commands: [{ seq, cell (1부터, "all" = 전체), type ("relay" ...), value }]
+function encodeCommands(commands) {
+  const length = COMMAND_HEADER_SIZE + commands.length * COMMAND_RECORD_SIZE;
+  const frame = Buffer.alloc(HEADER_SIZE + length);
+  frame[0] = MAGIC0;
+  frame[1] = MAGIC1;
+  frame[2] = VERSION;
+  frame[3] = FRAME_COMMAND;
+  frame.writeUInt32LE(length, 4);
+  frame.writeUInt16LE(commands.length, HEADER_SIZE);
+  frame[HEADER_SIZE + 2] = COMMAND_RECORD_SIZE;
+  commands.forEach((c, i) => {
+    const type = COMMAND_TYPES[c.type];
+    if (type === undefined) throw new Error(`unknown command type ${c.type}`);
+    const p = HEADER_SIZE + COMMAND_HEADER_SIZE + i * COMMAND_RECORD_SIZE;
+    frame.writeUInt32LE(c.seq >>> 0, p);
+    frame.writeUInt16LE(c.cell === "all" ? CELL_ALL : c.cell - 1, p + 4);
+    frame[p + 6] = type;
+    frame.writeInt32LE(c.value, p + 8);
+  });
+  return frame;
+}
+
+function decodeAcks(payload) {
+  if (payload.length < COMMAND_HEADER_SIZE) throw new Error("short ack payload");
+  const count = payload.readUInt16LE(0);
+  const recordSize = payload[2];
+  if (recordSize < COMMAND_RECORD_SIZE || payload.length < COMMAND_HEADER_SIZE + count * recordSize) {
+    throw new Error("truncated ack payload");
+  }
+  const typeNames = Object.keys(COMMAND_TYPES);
+  const acks = new Array(count);
+  for (let i = 0; i < count; i++) {
+    const p = COMMAND_HEADER_SIZE + i * recordSize;
+    const cell = payload.readUInt16LE(p + 4);
+    acks[i] = {
+      seq: payload.readUInt32LE(p),
+      cell: cell === CELL_ALL ? "all" : cell + 1,
+      type: typeNames.find((name) => COMMAND_TYPES[name] === payload[p + 6]) ?? payload[p + 6],
+      status: ACK_STATUS[payload[p + 7]] ?? payload[p + 7],
+      value: payload.readInt32LE(p + 8),
+    };
+  }
+  return acks;
+}
+
+// 저널 레코드 -> { seq, type, payload } (안쪽 프레임)
+function decodeRecord(payload) {
+  if (payload.length < RECORD_HEADER_SIZE + HEADER_SIZE) throw new Error("short record payload");
+  const inner = payload.subarray(RECORD_HEADER_SIZE);
+  if (inner[0] !== MAGIC0 || inner[1] !== MAGIC1 || inner[2] !== VERSION) throw new Error("bad record frame header");
+  const length = inner.readUInt32LE(4);
+  if (inner.length < HEADER_SIZE + length) throw new Error("truncated record frame");
+  return {
+    seq: payload.readBigUInt64LE(0),
+    type: inner[3],
+    payload: inner.subarray(HEADER_SIZE, HEADER_SIZE + length),
+  };
+}
+
+function encodeRecordAck(seq) {
+  const frame = Buffer.alloc(HEADER_SIZE + RECORD_HEADER_SIZE);
+  frame[0] = MAGIC0;
+  frame[1] = MAGIC1;
+  frame[2] = VERSION;
+  frame[3] = FRAME_RECORD_ACK;
+  frame.writeUInt32LE(RECORD_HEADER_SIZE, 4);
+  frame.writeBigUInt64LE(BigInt(seq), HEADER_SIZE);
+  return frame;
+}
+
+// TCP 스트림에서 프레임을 재조립 (read 경계와 무관)
+class FrameReader {
+  constructor() {
+    this.buffer = Buffer.alloc(0);
+  }
+
+  // 완성된 프레임 목록 [{ type, payload }], 스트림이 깨지면 예외
+  feed(chunk) {
+    this.buffer = this.buffer.length ? Buffer.concat([this.buffer, chunk]) : chunk;
+    const frames = [];
+    while (this.buffer.length >= HEADER_SIZE) {
+      const b = this.buffer;
+      if (b[0] !== MAGIC0 || b[1] !== MAGIC1 || b[2] !== VERSION) {
+        this.buffer = Buffer.alloc(0);
+        throw new Error("bad frame header");
+      }
+      const length = b.readUInt32LE(4);
+      if (length > MAX_PAYLOAD) {
+        this.buffer = Buffer.alloc(0);
+        throw new Error("frame too large");
+      }
+      if (b.length < HEADER_SIZE + length) break;
+      frames.push({ type: b[3], payload: b.subarray(HEADER_SIZE, HEADER_SIZE + length) });
+      this.buffer = b.subarray(HEADER_SIZE + length);
+    }
+    return frames;
+  }
+
+  reset() {
+    this.buffer = Buffer.alloc(0);
+  }
+}
+
+module.exports = {
+  FRAME_TELEMETRY,
+  FRAME_SAMPLES,
+  FRAME_ACK,
+  FRAME_RECORD,
+  isFrameStart,
+  decodeTelemetry,
+  decodeSamples,
+  encodeCommands,
+  decodeAcks,
+  decodeRecord,
+  encodeRecordAck,
+  FrameReader,
+};
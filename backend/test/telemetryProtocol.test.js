@@ -0,0 +1,120 @@
+// 장치 인코더가 만든 골든 프레임(tests/golden, tests/protocol_test.cpp 가 생성)을 디코딩
+// 실행: cd backend && npm test
+const test = require("node:test");
+const assert = require("node:assert");
+const fs = require("fs");
+const path = require("path");
+const {
+  FRAME_TELEMETRY,
+  FRAME_SAMPLES,
+  FRAME_ACK,
+  decodeTelemetry,
+  decodeSamples,
+  encodeCommands,
+  decodeAcks,
+  FrameReader,
+} = require("../src/services/telemetryProtocol");
+
+const golden = (name) => fs.readFileSync(path.join(__dirname, "../../tests/golden", name));
+const telemetry = golden("telemetry_3cell.bin");
+const samples = golden("samples.bin");
+const command = golden("command.bin");
+const ack = golden("ack.bin");
+const payload = (frame) => frame.subarray(8);
+
+test("telemetry: values, flags and invalid values as null", () => {
+  const data = decodeTelemetry(payload(telemetry));
+  assert.strictEqual(data.seq, 42);
+  assert.strictEqual(data.timestamp_us, 1234567890123);
+  assert.strictEqual(data.cells, 3);
+  assert.strictEqual(data.resister_fan_pwm, 55);
+  assert.strictEqual(data.no_data, false);
+
+  assert.strictEqual(data.voltage_1, 3.712);
+  assert.strictEqual(data.current_1, 1250.25);
+  assert.strictEqual(data.temperature_1, 27.5);
+  assert.strictEqual(data.resister_temp_1, 31.25);
+  assert.strictEqual(data.soc_1, 63);
+  assert.strictEqual(data.duty_cycle1, 40);
+  assert.strictEqual(data.charge_mode_1, 1);
+  assert.strictEqual(data.fan_pwm_1, 20);
+  assert.strictEqual(data.relay_state_1, 0);
+
+  // NaN 전압/온도, i32 를 넘는 전류, i16 을 넘는 저항 온도
+  assert.strictEqual(data.voltage_2, null);
+  assert.strictEqual(data.current_2, null);
+  assert.strictEqual(data.temperature_2, null);
+  assert.strictEqual(data.resister_temp_2, null);
+  assert.strictEqual(data.soc_2, 100);
+  assert.strictEqual(data.relay_state_2, 1);
+
+  assert.strictEqual(data.voltage_3, 4.2);
+  assert.strictEqual(data.current_3, -1500.5);
+  assert.strictEqual(data.temperature_3, -5.25);
+  assert.strictEqual(data.resister_temp_3, 45);
+  assert.strictEqual(data.duty_cycle3, 12);
+  assert.strictEqual(data.charge_mode_3, 2);
+
+  assert.throws(() => decodeTelemetry(payload(telemetry).subarray(0, 40)), /truncated/);
+});
+
+test("samples", () => {
+  const { seq, samples: s } = decodeSamples(payload(samples));
+  assert.strictEqual(seq, 7);
+  assert.strictEqual(s.length, 4);
+  assert.deepStrictEqual(s[0], {
+    timestamp_us: 5000000, cell: 1, voltage: 3.801, current: 500, duty_cycle: 40, charge_mode: 1, soc: 60, relay_state: 0,
+  });
+  assert.strictEqual(s[1].timestamp_us, 5000250);
+  assert.strictEqual(s[1].current, null);
+  assert.strictEqual(s[2].voltage, null);
+  assert.strictEqual(s[2].current, -250.75);
+  assert.strictEqual(s[3].current, 21474836);
+});
+
+test("commands are encoded byte for byte like the device encodes them", () => {
+  const frame = encodeCommands([
+    { seq: 7, cell: 1, type: "relay", value: 1 },
+    { seq: 8, cell: "all", type: "charge_mode", value: -1 },
+    { seq: 9, cell: 3, type: "current_setpoint", value: 1500 },
+  ]);
+  assert.deepStrictEqual(frame, command);
+});
+
+test("acks", () => {
+  assert.deepStrictEqual(decodeAcks(payload(ack)), [
+    { seq: 7, cell: 1, type: "relay", status: "refused", value: 0 },
+    { seq: 8, cell: 1, type: "charge_mode", status: "ok", value: -1 },
+    { seq: 9, cell: 6, type: "current_setpoint", status: "bad_cell", value: 1500 },
+  ]);
+});
+
+test("frame reader: every split of the stream gives the same frames", () => {
+  const stream = Buffer.concat([telemetry, samples, ack]);
+  const types = [FRAME_TELEMETRY, FRAME_SAMPLES, FRAME_ACK];
+  for (let split = 0; split <= stream.length; split++) {
+    const reader = new FrameReader();
+    const frames = [...reader.feed(stream.subarray(0, split)), ...reader.feed(stream.subarray(split))];
+    assert.deepStrictEqual(frames.map((f) => f.type), types);
+    assert.deepStrictEqual(frames[0].payload, payload(telemetry));
+  }
+  const reader = new FrameReader();
+  const frames = [];
+  for (const byte of stream) frames.push(...reader.feed(Buffer.from([byte])));
+  assert.deepStrictEqual(frames.map((f) => f.type), types);
+  assert.deepStrictEqual(decodeTelemetry(frames[0].payload), decodeTelemetry(payload(telemetry)));
+});
+
+test("frame reader: bad magic and oversized length", () => {
+  const badMagic = Buffer.from(telemetry);
+  badMagic[1] = 0x58;
+  assert.throws(() => new FrameReader().feed(badMagic), /bad frame header/);
+
+  const oversized = Buffer.from(telemetry.subarray(0, 8));
+  oversized.writeUInt32LE((1 << 20) + 1, 4);
+  assert.throws(() => new FrameReader().feed(oversized), /too large/);
+
+  const reader = new FrameReader();
+  assert.throws(() => reader.feed(badMagic));
+  assert.strictEqual(reader.feed(telemetry).length, 1); // 예외 후 버퍼를 비우고 다시 시작
+});
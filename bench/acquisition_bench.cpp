@@ -0,0 +1,54 @@
+/*
+* brief : pack sweep time against the number of i2c buses
+*
+* The simulated bus is given a fixed time per transaction (default 100 us, a
+* 16-bit register read at 400 kHz), so a sweep over one bus takes cells x
+* transactions x that; spread over more buses it should shrink with the bus
+* count.
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION bench/acquisition_bench.cpp -o acquisition_bench -lpthread
+* run   : ./acquisition_bench [cells] [sweeps] [transaction_us]
+*/
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../bms/sim_hal.h"
+#include "../bms/acquisition.h"
+
+static std::vector<CellPorts> bench_ports(int cells, int buses) {
+    std::vector<CellPorts> ports;
+    for (int i = 0; i < cells; i++) {
+        std::string id = std::to_string(i + 1);
+        int j = i / buses;
+        ports.push_back({ TCA_ADDR + (j / 8) % 8, j % 8, INA219_ADDR + j / 64,
+                          100 + i, 300 + i, 500 + i, "/sim/w1/cell-" + id, "/sim/w1/resister-" + id, I2C_BUS + i % buses });
+    }
+    return ports;
+}
+
+int main(int argc, char* argv[]) {
+    int cells = argc > 1 ? atoi(argv[1]) : 48;
+    int sweeps = argc > 2 ? atoi(argv[2]) : 50;
+    double transaction_us = argc > 3 ? atof(argv[3]) : 100.0;
+
+    printf("cells %d, sweeps %d, %.0f us per transaction\n", cells, sweeps, transaction_us);
+    double single = 0.0;
+    for (int buses : { 1, 2, 4, 8 }) {
+        std::vector<CellPorts> ports = bench_ports(cells, buses);
+        SimHal hal(ports, 13, 1.0);
+        hal.i2c_transaction_us = transaction_us;
+        Acquisition acquisition(hal, ports);
+        acquisition.sweep();    //warm up, starts the bus threads
+        auto start = std::chrono::steady_clock::now();
+        for (int s = 0; s < sweeps; s++) acquisition.sweep();
+        auto end = std::chrono::steady_clock::now();
+        double us = std::chrono::duration<double, std::micro>(end - start).count() / sweeps;
+        if (buses == 1) single = us;
+        printf("buses %d  sweep %8.0f us  pack rate %7.1f Hz  speedup %.2fx\n", buses, us, 1e6 / us, single / us);
+    }
+    return 0;
+}
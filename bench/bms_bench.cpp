@@ -0,0 +1,328 @@
+/*
+* brief : hot path benchmark suite - micro benchmarks of the control code and a whole pipeline macro benchmark
+*
+* Every result is one JSON object per line on stdout, so runs of different
+* builds can be diffed or collected by a script:
+*   {"bench": "soc.lookup", "case": "mid_charge", "cells": 0, "ns_per_op": 1.9, "hz": 5.2e+08}
+* ns_per_op is the best of BENCH_REPEATS timed runs of at least min_ms each;
+* hz is 1e9 / ns_per_op: operations per second, or for pipeline the
+* control loop rate one core could sustain.
+*
+* micro : soc.lookup              table lookup over three voltage distributions
+*         soc.estimator           SocEstimator::update, charging current
+*         filter.moving_average   the per-cell current and voltage RingFilters of a control step
+*         encode.json / .binary   send_data's telemetry formatting for a whole pack
+*         control.cell            Pack::controlStep per cell against the simulated sensors
+* macro : pipeline                one charging period of the whole pack: sweep, regulate, publish,
+*                                 and once a second temperatures, fans, balancing and a telemetry
+*                                 frame, for 1, 16 and 96 cells
+*
+* The simulated bus answers instantly (SimHal, free-running clock), so the
+* control and pipeline figures are CPU time: the control code plus the cell
+* model behind the registers. On the rig each INA219 register read adds
+* ~100 us of bus time.
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION bench/bms_bench.cpp -o bms_bench -lpthread
+* run   : ./bms_bench [group] [min_ms]      group: soc, filter, encode, control or pipeline; all when omitted
+*/
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+#include "../bms/sim_hal.h"
+#include "../bms/pack.h"
+#include "../bms/soc.h"
+#include "../bms/soc_estimator.h"
+#include "../bms/ring_filter.h"
+#include "../bms/temp_service.h"
+#include "../bms/thermal.h"
+#include "../bms/balancer.h"
+#include "../bms/telemetry.h"
+#include "../bms/protocol.h"
+
+#define BENCH_REPEATS 3
+#define BENCH_MIN_MS 200
+#define BENCH_PERIOD_US (CHARGE_PERIOD_MS * 1000ULL)   //virtual time per control step
+#define BENCH_SLOW_EVERY (1000 / CHARGE_PERIOD_MS)      //control steps per 1 s task period
+
+static const char* group = "";
+static int min_ms = BENCH_MIN_MS;
+static volatile float sink;     //keeps results alive
+
+static bool selected(const char* name) { return strncmp(name, group, strlen(group)) == 0; }
+
+static double now_ns() {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//ns per op of body(), which performs ops operations per call
+template <typename F>
+static double measure(size_t ops, F&& body) {
+    body();     //warm up
+    double best = INFINITY;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        size_t calls = 0;
+        double start = now_ns(), elapsed;
+        do {
+            body();
+            calls++;
+            elapsed = now_ns() - start;
+        } while (elapsed < min_ms * 1e6);
+        best = std::min(best, elapsed / (double(calls) * ops));
+    }
+    return best;
+}
+
+static void report(const char* bench, const char* variant, size_t cells, double ns_per_op) {
+    printf("{\"bench\": \"%s\", \"case\": \"%s\", \"cells\": %zu, \"ns_per_op\": %.2f, \"hz\": %.4g}\n",
+           bench, variant, cells, ns_per_op, 1e9 / ns_per_op);
+    fflush(stdout);
+}
+
+static std::vector<CellPorts> bench_ports(int cells) {
+    std::vector<CellPorts> ports;
+    for (int i = 0; i < cells; i++) {
+        std::string id = std::to_string(i + 1);
+        ports.push_back({ TCA_ADDR + (i / 8) % 8, i % 8, INA219_ADDR + i / 64,
+                          100 + i, 300 + i, 500 + i, "/sim/w1/cell-" + id, "/sim/w1/resister-" + id });
+    }
+    return ports;
+}
+
+static void bench_soc() {
+    const size_t n = 4096;
+    std::mt19937 rng(42);
+    struct Distribution {
+        const char* name;
+        std::function<float()> draw;
+    };
+    std::normal_distribution<float> mid(3.7f, 0.15f), full(4.15f, 0.04f);
+    std::uniform_real_distribution<float> range(2.9f, 4.25f);
+    Distribution distributions[] = {
+        { "mid_charge", [&] { return mid(rng); } },     //pack in mid charge, cells spread around 3.7 V
+        { "near_full", [&] { return full(rng); } },     //CV phase, top of the curve
+        { "full_range", [&] { return range(rng); } },   //anything from empty to over-voltage
+    };
+    std::vector<float> voltage(n);
+    for (const Distribution& d : distributions) {
+        for (size_t i = 0; i < n; i++) voltage[i] = d.draw();
+        report("soc.lookup", d.name, 0, measure(n, [&] {
+            float total = 0.0f;
+            for (size_t i = 0; i < n; i++) total += soc_lookup(ICR18650, voltage[i]);
+            sink = total;
+        }));
+    }
+
+    SocEstimator estimator;
+    uint64_t t = 0;
+    report("soc.estimator", "charging_1A", 0, measure(n, [&] {
+        for (size_t i = 0; i < n; i++) {
+            t += BENCH_PERIOD_US;
+            estimator.update(t, 1000.0f, voltage[i & (n - 1)]);
+        }
+        sink = estimator.percent();
+    }));
+}
+
+static void bench_filters() {
+    const size_t n = 4096;
+    std::mt19937 rng(7);
+    std::normal_distribution<float> amps(1000.0f, 5.0f), volts(3.9f, 0.002f);
+    std::vector<float> current(n), voltage(n);
+    for (size_t i = 0; i < n; i++) {
+        current[i] = amps(rng);
+        voltage[i] = volts(rng);
+    }
+    size_t windows[] = { CURRENT_WINDOW, 100 };
+    for (size_t window : windows) {
+        RingFilter<float> current_filter(window), voltage_filter(window);
+        std::string variant = "window_" + std::to_string(window);
+        report("filter.moving_average", variant.c_str(), 0, measure(n, [&] {   //one cell of a control step: both filters
+            float total = 0.0f;
+            for (size_t i = 0; i < n; i++) {
+                current_filter.push(current[i], std::abs(current[i]) >= 80.0f);
+                voltage_filter.push(voltage[i], voltage[i] >= 0.1f);
+                total += current_filter.average(0.0f) + voltage_filter.average(0.0f);
+            }
+            sink = total;
+        }));
+    }
+}
+
+static TelemetryFrame sample_frame(size_t cells) {
+    Telemetry telemetry(cells);
+    std::vector<float> bat_data(BAT_DATA_STRIDE * cells), temperature(2 * cells);
+    std::vector<int> fans(cells + 1);
+    for (size_t i = 0; i < cells; i++) {
+        float* cell = &bat_data[i * BAT_DATA_STRIDE];
+        cell[BAT_VOLTAGE] = 3.7f + 0.001f * i;
+        cell[BAT_CURRENT] = 987.65f;
+        cell[BAT_SOC] = 55;
+        cell[BAT_DUTY_CYCLE] = 86;
+        cell[BAT_CHARGE_MODE] = FAST_CHARGING;
+        temperature[i] = 31.25f;
+        temperature[cells + i] = 27.5f;
+        fans[i] = 55;
+        telemetry.setRelay(1, i, i % 8 == 0);
+    }
+    fans[cells] = 40;
+    telemetry.publishCells(1, bat_data.data());
+    telemetry.publishThermal(1, temperature.data(), fans.data());
+    TelemetryFrame frame;
+    telemetry.snapshot(frame);
+    return frame;
+}
+
+static void bench_encode() {
+    for (size_t cells : { 1, 16, 96 }) {
+        TelemetryFrame frame = sample_frame(cells);
+        std::vector<char> buffer(256 * (cells + 1));
+        report("encode.json", "frame", cells, measure(1, [&] {
+            sink = encode_json(frame, buffer.data(), buffer.size());
+        }));
+        uint32_t seq = 0;
+        report("encode.binary", "frame", cells, measure(1, [&] {
+            sink = encode_telemetry(frame, seq++, 1, reinterpret_cast<uint8_t*>(buffer.data()), buffer.size());
+        }));
+    }
+}
+
+static void bench_control() {
+    for (int cells : { 1, 16, 96 }) {
+        std::vector<CellPorts> ports = bench_ports(cells);
+        SimHal hal(ports, 13, 0.0);
+        Pack pack(hal, ports);
+        pack.verbose = false;
+        std::vector<float> temperature(cells, 25.0f), bat_data(BAT_DATA_STRIDE * cells);
+        std::vector<int> relay(cells, 0);
+        uint64_t t = 0;
+        report("control.cell", "step", cells, measure(cells, [&] {
+            hal.sleepUntilUs(t += BENCH_PERIOD_US);
+            pack.controlStep(temperature.data(), relay.data(), bat_data.data());
+        }));
+    }
+}
+
+//the main program's tasks run one after the other on one thread, at their own rates
+class Pipeline {
+public:
+    explicit Pipeline(int cells)
+        : ports(bench_ports(cells)), hal(ports, 13, 0.0), pack(hal, ports), temps(hal, paths(ports)), thermal(hal),
+          balancer(cells), telemetry(cells), cell_temp(cells), relay_state(cells), bat_data(BAT_DATA_STRIDE * cells),
+          temperature(2 * cells), fan_speed(cells + 1), soc(cells), voltage(cells), resistor(cells), relay_out(cells),
+          buffer(telemetry_frame_size(cells)) {
+        pack.verbose = false;
+        for (const CellPorts& port : ports) {
+            thermal.addFan(port.fan_pin, FanCurve());
+            hal.pwmCreate(port.pwm_pin, 0, PWM_RANGE, PWM_FREQUENCY_HZ);
+            hal.pwmCreate(port.fan_pin, 0, PWM_RANGE, PWM_FREQUENCY_HZ);
+        }
+        thermal.addFan(13, FanCurve());
+    }
+
+    //one charging period
+    void step() {
+        uint64_t now = (t += BENCH_PERIOD_US);
+        hal.sleepUntilUs(now);
+        size_t cells = ports.size();
+        bool slow = steps++ % BENCH_SLOW_EVERY == 0;
+        if (slow) {     //1-Wire sweep: the model's temperatures, as the DS18B20s would read them
+            for (size_t i = 0; i < cells; i++) {
+                SimCell cell = hal.cell(i);
+                temps.store(i, std::round(cell.temp * 16.0) / 16.0, now);
+                temps.store(cells + i, std::round(cell.resistor_temp * 16.0) / 16.0, now);
+            }
+        }
+
+        for (size_t i = 0; i < cells; i++) cell_temp[i] = temps.fresh(i);
+        telemetry.relays(relay_state);
+        pack.controlStep(cell_temp.data(), relay_state.data(), bat_data.data());
+        telemetry.publishCells(now, bat_data.data());
+        if (!slow) return;
+
+        for (size_t i = 0; i < 2 * cells; i++) temperature[i] = temps.fresh(i);
+        float max_temp = -INFINITY;
+        for (size_t i = 0; i < cells; i++) {
+            thermal.update(i, temperature[i], now);
+            fan_speed[i] = thermal.command(i);
+            max_temp = std::max(max_temp, temperature[cells + i]);
+        }
+        thermal.update(cells, max_temp, now);
+        fan_speed[cells] = thermal.command(cells);
+        telemetry.publishThermal(now, temperature.data(), fan_speed.data());
+
+        for (size_t i = 0; i < cells; i++) {
+            soc[i] = pack.estimator[i].valid() ? pack.estimator[i].percent() : NAN;
+            voltage[i] = bat_data[i * BAT_DATA_STRIDE + BAT_VOLTAGE];
+            resistor[i] = temperature[cells + i];
+        }
+        if (balancer.update(now, soc.data(), voltage.data(), resistor.data(), relay_state.data(), relay_out.data())) {
+            for (size_t i = 0; i < cells; i++) {
+                if (relay_out[i] == relay_state[i]) continue;
+                hal.digitalWrite(ports[i].relay_pin, relay_out[i] ? HIGH : LOW);
+                telemetry.setRelay(now, i, relay_out[i]);
+            }
+        }
+
+        telemetry.snapshot(frame);
+        sink = encode_telemetry(frame, seq++, now, buffer.data(), buffer.size());
+    }
+
+private:
+    std::vector<CellPorts> ports;
+    SimHal hal;
+    Pack pack;
+    TempService temps;
+    ThermalController thermal;
+    Balancer balancer;
+    Telemetry telemetry;
+    std::vector<float> cell_temp;
+    std::vector<int> relay_state;
+    std::vector<float> bat_data;
+    std::vector<float> temperature;
+    std::vector<int> fan_speed;
+    std::vector<float> soc, voltage, resistor;     //balancer inputs
+    std::vector<int> relay_out;
+    std::vector<uint8_t> buffer;
+    TelemetryFrame frame;
+    uint64_t t = 0;
+    uint64_t steps = 0;
+    uint32_t seq = 0;
+
+    static std::vector<std::string> paths(const std::vector<CellPorts>& ports) {
+        std::vector<std::string> out;
+        for (const CellPorts& port : ports) out.push_back(port.temp_path);
+        for (const CellPorts& port : ports) out.push_back(port.resistor_temp_path);
+        return out;
+    }
+};
+
+static void bench_pipeline() {
+    for (int cells : { 1, 16, 96 }) {
+        Pipeline pipeline(cells);
+        //whole seconds of control, so every rate of task takes its share
+        report("pipeline", "charging_period", cells, measure(BENCH_SLOW_EVERY, [&] {
+            for (int s = 0; s < BENCH_SLOW_EVERY; s++) pipeline.step();
+        }));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) group = argv[1];
+    if (argc > 2 && atoi(argv[2]) > 0) min_ms = atoi(argv[2]);
+    printf("{\"suite\": \"bms_bench\", \"compiler\": \"%s\", \"repeats\": %d, \"min_ms\": %d}\n", __VERSION__, BENCH_REPEATS, min_ms);
+    if (selected("soc")) bench_soc();
+    if (selected("filter")) bench_filters();
+    if (selected("encode")) bench_encode();
+    if (selected("control")) bench_control();
+    if (selected("pipeline")) bench_pipeline();
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+* brief : charge regulation on the simulated cell - former +/-1 duty stepping vs ChargeController
+*
+* One cell is charged from start_soc to full on the virtual clock (no sleeps)
+* at the control period, reading through the INA219 model with its noise.
+* Figures come from the model's true current and terminal voltage:
+*   rise      time for the current to go from 10 % to 90 % of the target
+*   overshoot peak current above the target during CC, % of the target
+*   mean      average current until CV, mA
+*   settle    time from 10 % until the current stays within +/-2 % of the target for 10 s
+*   cv        time until the terminal voltage first reaches the CV target
+*   v peak    highest terminal voltage after that (CV overshoot)
+*   over      time spent above the CV target + 10 mV
+*   full      time until the current, averaged over 5 s, tapers below C/20 in CV
+* The last row runs the controller against a model whose charge path is 50 %
+* more resistive than the feedforward assumes.
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION bench/charge_bench.cpp -o charge_bench -lpthread
+* run   : ./charge_bench [start_soc] [target_ma] [period_ms]
+*/
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#include "../bms/sim_hal.h"
+#include "../bms/acquisition.h"
+#include "../bms/ring_filter.h"
+#include "../bms/charge_controller.h"
+#include "../bms/pack.h"
+
+#define BENCH_PWM_RANGE 1000
+#define BENCH_MAX_HOURS 6
+#define BENCH_FULL_MA 130.0     //C/20 of 2600 mAh
+#define BENCH_BAND 0.02
+#define BENCH_SETTLED_S 10.0
+
+struct Stepping {   //reference: the former regulation, +/-1 % per sample on the moving averages
+    RingFilter<float> current{10}, voltage{10};
+    int duty = 0;
+
+    float update(uint64_t, float target_ma, float target_v, float current_ma, float voltage_v) {
+        current.push(current_ma, std::abs(current_ma) >= duty);
+        voltage.push(voltage_v, voltage_v >= 0.1f);
+        float avg_current = current.average(0.0f), avg_voltage = voltage.average(0.0f);
+        if (avg_voltage < target_v) duty = avg_current < target_ma ? std::min(100, duty + 1) : std::max(0, duty - 1);
+        else duty = std::max(0, duty - 1);
+        return duty;
+    }
+};
+
+struct Result {
+    double rise_s = NAN, overshoot = 0.0, mean_ma = 0.0, settle_s = NAN, cv_s = NAN, v_peak = 0.0, over_s = 0.0, full_s = NAN;
+};
+
+template <typename Regulator>
+static Result charge(Regulator& regulator, double start_soc, float target_ma, int period_ms, double path_ohm = CHARGE_PATH_OHM) {
+    std::vector<CellPorts> ports = { { TCA_ADDR, 0, INA219_ADDR, 100, 300, 500, "/sim/w1/cell-1", "/sim/w1/resister-1" } };
+    SimHal hal(ports, 13, 0.0);
+    hal.charge_path_r = path_ohm;
+    hal.setCellSoc(0, start_soc);
+    hal.pwmCreate(100, 0, BENCH_PWM_RANGE, PWM_FREQUENCY_HZ);
+    Acquisition acquisition(hal, ports);
+
+    Result r;
+    double t10 = NAN, in_band_since = NAN, charge_sum = 0.0;
+    uint64_t cc_samples = 0;
+    RingFilter<double> taper(5000 / period_ms);
+    uint64_t start = hal.nowUs(), next = start;
+    for (uint64_t now = start; now - start < BENCH_MAX_HOURS * 3600000000ULL; now = hal.nowUs()) {
+        double t = (now - start) / 1e6;
+        acquisition.sweep();
+        const CellSample& s = acquisition.sample(0);
+        float duty = regulator.update(s.timestamp_us, target_ma, TARGET_VOLTAGE, s.reading.current, s.reading.voltage);
+        hal.pwmWrite(100, static_cast<int>(std::lround(duty * BENCH_PWM_RANGE / 100.0f)));
+
+        SimCell cell = hal.cell(0);
+        double volts = SimHal::ocv(cell.soc) + cell.current_ma / 1000.0 * cell.r_int;
+        if (std::isnan(t10) && cell.current_ma >= 0.1 * target_ma) t10 = t;
+        if (std::isnan(r.rise_s) && cell.current_ma >= 0.9 * target_ma) r.rise_s = t - t10;
+        if (std::isnan(r.cv_s)) {
+            charge_sum += cell.current_ma;
+            r.mean_ma = charge_sum / ++cc_samples;
+            r.overshoot = std::max(r.overshoot, (cell.current_ma - target_ma) / target_ma * 100.0);
+            bool in_band = std::abs(cell.current_ma - target_ma) <= BENCH_BAND * target_ma;
+            if (!in_band) in_band_since = NAN;
+            else if (std::isnan(in_band_since)) in_band_since = t;
+            if (std::isnan(r.settle_s) && t - in_band_since >= BENCH_SETTLED_S) r.settle_s = in_band_since - t10;
+            if (volts >= TARGET_VOLTAGE) r.cv_s = t;
+        }
+        else {
+            r.v_peak = std::max(r.v_peak, volts);
+            if (volts > TARGET_VOLTAGE + 0.01) r.over_s += period_ms / 1000.0;
+            taper.push(cell.current_ma);
+            if (taper.size() == taper.capacity() && taper.average(0.0) < BENCH_FULL_MA) {
+                r.full_s = t;
+                break;
+            }
+        }
+        next += period_ms * 1000ULL;
+        hal.sleepUntilUs(next);
+    }
+    return r;
+}
+
+static void print(const char* name, const Result& r) {
+    printf("%-12s rise %5.2f s  overshoot %5.1f %%  mean %5.0f mA  settle %6.2f s  cv %5.0f s  v peak %.3f V  over %5.0f s  full %5.0f s\n",
+           name, r.rise_s, r.overshoot, r.mean_ma, r.settle_s, r.cv_s, r.v_peak, r.over_s, r.full_s);
+}
+
+int main(int argc, char* argv[]) {
+    double start_soc = argc > 1 ? atof(argv[1]) : 0.2;
+    float target_ma = argc > 2 ? atof(argv[2]) : FAST_CHARGE_CURRENT_MA;
+    int period_ms = argc > 3 ? atoi(argv[3]) : CHARGE_PERIOD_MS;
+
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    Stepping stepping;
+    ChargeController controller, mismatched;
+    Result old_result = charge(stepping, start_soc, target_ma, period_ms);
+    Result new_result = charge(controller, start_soc, target_ma, period_ms);
+    Result off_result = charge(mismatched, start_soc, target_ma, period_ms, CHARGE_PATH_OHM * 1.5);
+    std::cout.rdbuf(out);
+
+    printf("start soc %.2f, target %.0f mA / %.2f V, period %d ms\n", start_soc, target_ma, TARGET_VOLTAGE, period_ms);
+    print("stepping", old_result);
+    print("pi+ff", new_result);
+    print("pi+ff R+50%", off_result);
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+* brief : telemetry encoding micro-benchmark - legacy JSON vs binary frame, time and bytes per frame
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION bench/protocol_bench.cpp -o protocol_bench
+* run   : ./protocol_bench [cells] [frames]
+*/
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../bms/protocol.h"
+
+template <typename F>
+static double ns_per_frame(int frames, F&& body) {
+    body();     //warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < frames; r++) body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / frames;
+}
+
+int main(int argc, char* argv[]) {
+    size_t cells = argc > 1 ? strtoul(argv[1], nullptr, 10) : 3;
+    int frames = argc > 2 ? atoi(argv[2]) : 100000;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> volts(3.4f, 4.2f), amps(-500.0f, 1000.0f), temps(20.0f, 45.0f);
+    TelemetryFrame frame;
+    frame.bat_data.resize(BAT_DATA_STRIDE * cells);
+    frame.temperature.resize(2 * cells);
+    frame.fan_pwm.resize(cells + 1);
+    frame.relay_state.resize(cells);
+    frame.cells_version = 1;
+    for (size_t i = 0; i < cells; i++) {
+        float* bat = frame.bat_data.data() + i * BAT_DATA_STRIDE;
+        bat[BAT_VOLTAGE] = volts(rng);
+        bat[BAT_CURRENT] = amps(rng);
+        bat[BAT_SOC] = 57;
+        bat[BAT_DUTY_CYCLE] = 43;
+        bat[BAT_CHARGE_MODE] = FAST_CHARGING;
+        frame.temperature[i] = temps(rng);
+        frame.temperature[cells + i] = temps(rng);
+        frame.fan_pwm[i] = 25;
+    }
+    frame.temperature[0] = NAN;     //one stale sensor
+    frame.fan_pwm[cells] = 40;
+
+    std::vector<char> json(256 * (cells + 1));
+    std::vector<uint8_t> binary(telemetry_frame_size(cells));
+    size_t json_bytes = 0, binary_bytes = 0;
+    uint32_t seq = 0;
+
+    double json_ns = ns_per_frame(frames, [&] { json_bytes = encode_json(frame, json.data(), json.size()); });
+    double binary_ns = ns_per_frame(frames, [&] { binary_bytes = encode_telemetry(frame, seq++, 0, binary.data(), binary.size()); });
+
+    //round trip check
+    TelemetryMessage msg;
+    bool ok = decode_telemetry(binary.data() + PROTO_HEADER_SIZE, binary_bytes - PROTO_HEADER_SIZE, msg)
+              && msg.cells.size() == cells && (msg.cells[0].flags & CELL_TEMP_INVALID)
+              && std::fabs(msg.cells[1].voltage - frame.bat_data[BAT_DATA_STRIDE + BAT_VOLTAGE]) < 0.001f;
+    double decode_ns = ns_per_frame(frames, [&] { decode_telemetry(binary.data() + PROTO_HEADER_SIZE, binary_bytes - PROTO_HEADER_SIZE, msg); });
+
+    printf("cells %zu, frames %d\n", cells, frames);
+    printf("json          %9.1f ns/frame  %6zu bytes\n", json_ns, json_bytes);
+    printf("binary        %9.1f ns/frame  %6zu bytes  (x%.1f faster, x%.1f smaller)\n",
+           binary_ns, binary_bytes, json_ns / binary_ns, double(json_bytes) / binary_bytes);
+    printf("binary decode %9.1f ns/frame  round trip %s\n", decode_ns, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/*
+* brief : SoftPwm - duty accuracy, edge lateness, wake-ups and CPU for a set of software channels
+*
+* The pins are not real: every edge is timestamped and the measured duty of
+* each channel is compared with the commanded value. wiringPi softPwm would
+* run one thread per pin, each waking every 100 us (10000 wake-ups/s per pin).
+*
+* build : g++ -std=c++17 -O2 bench/pwm_bench.cpp -o pwm_bench -lpthread
+* run   : ./pwm_bench [channels] [seconds] [hz] [range]
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../bms/pwm.h"
+
+static uint64_t high_since[PWM_MAX_CHANNELS];
+static uint64_t high_us[PWM_MAX_CHANNELS];
+static uint64_t edges[PWM_MAX_CHANNELS];
+
+static uint64_t now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record_edge(int pin, int level) {   //pin = channel index
+    uint64_t now = now_us();
+    if (level) high_since[pin] = now;
+    else if (high_since[pin]) high_us[pin] += now - high_since[pin], high_since[pin] = 0;
+    edges[pin]++;
+}
+
+static double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    int channels = argc > 1 ? atoi(argv[1]) : 6;
+    double seconds = argc > 2 ? atof(argv[2]) : 3.0;
+    int hz = argc > 3 ? atoi(argv[3]) : PWM_FREQUENCY_HZ;
+    int range = argc > 4 ? atoi(argv[4]) : 1000;
+    channels = std::min(channels, PWM_MAX_CHANNELS);
+
+    SoftPwm pwm(record_edge);
+    std::vector<int> value(channels);
+    for (int c = 0; c < channels; c++) {
+        value[c] = range * (c + 1) / (channels + 1);    //spread over the range
+        pwm.add(c, hz, range, value[c]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));    //first periods
+    for (int c = 0; c < channels; c++) high_us[c] = 0, edges[c] = 0;
+    uint64_t wakeups = pwm.wakeups();
+    double cpu = cpu_seconds();
+    uint64_t start = now_us();
+    std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6)));
+    uint64_t elapsed = now_us() - start;
+    cpu = cpu_seconds() - cpu;
+    wakeups = pwm.wakeups() - wakeups;
+    pwm.stop();
+
+    printf("channels %d, %d Hz x %d steps, %.1f s, 1 thread\n", channels, hz, range, elapsed / 1e6);
+    for (int c = 0; c < channels; c++) {
+        double commanded = 100.0 * value[c] / range, measured = 100.0 * high_us[c] / elapsed;
+        printf("channel %2d  duty %6.2f%%  measured %6.2f%%  error %+5.2f%%  edges/s %.0f\n",
+               c, commanded, measured, measured - commanded, edges[c] * 1e6 / elapsed);
+    }
+    HistogramSnapshot h;
+    pwm.edgeLateness().snapshot(h);
+    printf("wake-ups/s %.0f (softPwm: %d)  cpu %.2f%% of one core\n", wakeups * 1e6 / elapsed, channels * 10000, cpu / (elapsed / 1e6) * 100.0);
+    printf("edge lateness us p50 %llu p99 %llu max %llu\n", (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99), (unsigned long long)h.max);
+    return 0;
+}
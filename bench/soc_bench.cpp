@@ -0,0 +1,133 @@
+/*
+* brief : SoC lookup micro-benchmark - former if/else ladder vs table lookup
+*
+* build : g++ -std=c++17 -O2 -march=native bench/soc_bench.cpp -o soc_bench
+* run   : ./soc_bench [cells] [rounds]
+*/
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include "../bms/soc.h"
+
+static float calculate_SoC_ladder(float voltage, int relay_state) {    //reference: the original branch ladder
+    if(relay_state == 1) voltage += (voltage - 2.9) * 1.3;
+    if (voltage >= 4.20) return 100.0;
+    else if (voltage >= 4.08) {
+        if (voltage >= 4.16) return 98.0;
+        else if (voltage >= 4.14) return 96.0;
+        else if (voltage >= 4.12) return 94.0;
+        else if (voltage >= 4.10) return 92.0;
+        else return 90.0;
+    }
+    else if (voltage >= 3.96) {
+        if (voltage >= 4.06) return 88.0;
+        else if (voltage >= 4.04) return 86.0;
+        else if (voltage >= 4.02) return 84.0;
+        else if (voltage >= 3.99) return 82.0;
+        else return 80.0;
+    }
+    else if (voltage >= 3.85) {
+        if (voltage >= 3.94) return 78.0;
+        else if (voltage >= 3.91) return 76.0;
+        else if (voltage >= 3.89) return 74.0;
+        else if (voltage >= 3.87) return 72.0;
+        else return 70.0;
+    }
+    else if (voltage >= 3.75) {
+        if (voltage >= 3.83) return 68.0;
+        else if (voltage >= 3.81) return 66.0;
+        else if (voltage >= 3.79) return 64.0;
+        else if (voltage >= 3.77) return 62.0;
+        else return 60.0;
+    }
+    else if (voltage >= 3.65) {
+        if (voltage >= 3.73) return 58.0;
+        else if (voltage >= 3.71) return 56.0;
+        else if (voltage >= 3.69) return 54.0;
+        else if (voltage >= 3.67) return 52.0;
+        else return 50.0;
+    }
+    else if (voltage >= 3.6) {
+        if (voltage >= 3.64) return 48.0;
+        else if (voltage >= 3.63) return 46.0;
+        else if (voltage >= 3.62) return 44.0;
+        else if (voltage >= 3.61) return 42.0;
+        else return 40.0;
+    }
+    else if (voltage >= 3.55) {
+        if (voltage >= 3.59) return 38.0;
+        else if (voltage >= 3.58) return 36.0;
+        else if (voltage >= 3.57) return 34.0;
+        else if (voltage >= 3.56) return 32.0;
+        else return 30.0;
+    }
+    else if (voltage >= 3.5) {
+        if (voltage >= 3.54) return 28.0;
+        else if (voltage >= 3.53) return 26.0;
+        else if (voltage >= 3.52) return 24.0;
+        else if (voltage >= 3.51) return 22.0;
+        else return 20.0;
+    }
+    else if (voltage >= 3.43) {
+        if (voltage >= 3.48) return 18.0;
+        else if (voltage >= 3.46) return 16.0;
+        else if (voltage >= 3.44) return 14.0;
+        else if (voltage >= 3.42) return 12.0;
+        else return 10.0;
+    }
+    else {
+        if (voltage >= 3.4) return 8.0;
+        else if (voltage >= 3.3) return 6.0;
+        else if (voltage >= 3.1) return 4.0;
+        else if (voltage >= 3.0) return 2.0;
+        else return 0.0;
+    }
+}
+
+template <typename F>
+static double ns_per_cell(size_t cells, int rounds, F&& body) {
+    body();     //warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (double(cells) * rounds);
+}
+
+int main(int argc, char* argv[]) {
+    size_t cells = argc > 1 ? strtoul(argv[1], nullptr, 10) : (1 << 20);
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+    //pack in mid charge: cells spread around 3.7 V, at rest (the table is OCV only, see soc.h)
+    std::mt19937 rng(42);
+    std::normal_distribution<float> volts(3.7f, 0.2f);
+    std::vector<float> voltage(cells), soc(cells);
+    for (size_t i = 0; i < cells; i++) voltage[i] = std::min(4.25f, std::max(2.8f, volts(rng)));
+
+    double ladder = ns_per_cell(cells, rounds, [&] {
+        for (size_t i = 0; i < cells; i++) soc[i] = calculate_SoC_ladder(voltage[i], 0);
+    });
+    float sink = soc[cells / 2];
+    double table = ns_per_cell(cells, rounds, [&] {
+        for (size_t i = 0; i < cells; i++) soc[i] = soc_lookup(ICR18650, voltage[i]);
+    });
+    sink += soc[cells / 2];
+
+    //the table interpolates between the ladder's steps, so it reads at most one
+    //step (2%, 4% between 3.40 and 3.43 V) above the ladder
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < cells; i++) {
+        max_diff = std::max(max_diff, std::fabs(soc_lookup(ICR18650, voltage[i]) - calculate_SoC_ladder(voltage[i], 0)));
+    }
+
+    printf("cells %zu, rounds %d\n", cells, rounds);
+    printf("ladder        %7.3f ns/cell\n", ladder);
+    printf("table         %7.3f ns/cell  (x%.1f)\n", table, ladder / table);
+    printf("max |table - ladder| %.2f %%  (checksum %.1f)\n", max_diff, sink);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+* brief : stage timer overhead - one timed call, and a full control step with and without InstrumentedHal
+*
+* The simulated bus answers in ~100 ns, so the relative overhead printed here is
+* a worst case; a real INA219 register read at 400 kHz takes ~100 us.
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION bench/stats_bench.cpp -o stats_bench -lpthread
+* run   : ./stats_bench [cells] [steps]
+*/
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include "../bms/sim_hal.h"
+#include "../bms/pack.h"
+#include "../bms/stats.h"
+
+static std::vector<CellPorts> bench_ports(int cells) {
+    std::vector<CellPorts> ports;
+    for (int i = 0; i < cells; i++) {
+        std::string id = std::to_string(i + 1);
+        ports.push_back({ TCA_ADDR + (i / 8) % 8, i % 8, INA219_ADDR + i / 64,
+                          100 + i, 300 + i, 500 + i, "/sim/w1/cell-" + id, "/sim/w1/resister-" + id });
+    }
+    return ports;
+}
+
+//ns per control step over the whole pack
+static double ns_per_step(Hal& hal, const std::vector<CellPorts>& ports, int steps) {
+    std::streambuf* out = std::cout.rdbuf(nullptr);     //publish() prints every cell
+    Pack pack(hal, ports);
+    std::vector<float> temperature(ports.size(), 25.0f), bat_data(BAT_DATA_STRIDE * ports.size());
+    std::vector<int> relay(ports.size(), 0);
+    pack.controlStep(temperature.data(), relay.data(), bat_data.data());     //warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) pack.controlStep(temperature.data(), relay.data(), bat_data.data());
+    auto end = std::chrono::steady_clock::now();
+    std::cout.rdbuf(out);
+    return std::chrono::duration<double, std::nano>(end - start).count() / steps;
+}
+
+int main(int argc, char* argv[]) {
+    int cells = argc > 1 ? atoi(argv[1]) : 16;
+    int steps = argc > 2 ? atoi(argv[2]) : 2000;
+    std::vector<CellPorts> ports = bench_ports(cells);
+
+    StageStats stats;
+    uint64_t timer_ns = stats.calibrate(1000000);
+
+    SimHal raw_hal(ports, 13, 0.0);
+    SimHal inner_hal(ports, 13, 0.0);
+    InstrumentedHal timed_hal(inner_hal, stats);
+    double raw = 1e18, timed = 1e18;
+    for (int round = 0; round < 5; round++) {   //best of 5, interleaved
+        raw = std::min(raw, ns_per_step(raw_hal, ports, steps));
+        timed = std::min(timed, ns_per_step(timed_hal, ports, steps));
+    }
+    HistogramSnapshot h;
+    uint64_t calls = 0;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        stats.stage(static_cast<Stage>(s)).snapshot(h);
+        calls += h.count;
+    }
+    double calls_per_step = double(calls) / (5.0 * (steps + 1));
+
+    printf("cells %d, steps %d\n", cells, steps);
+    printf("timed empty call   %6llu ns\n", (unsigned long long)timer_ns);
+    printf("control step raw   %9.0f ns\n", raw);
+    printf("control step timed %9.0f ns  (%+.0f ns, %.1f timed calls per step)\n", timed, timed - raw, calls_per_step);
+    printf("per timed call in a step %.0f ns; against ~100 us per real INA219 read that is %.3f%%\n",
+           (timed - raw) / calls_per_step, (timed - raw) / calls_per_step / 100000.0 * 100.0);
+    stats.report(stdout);
+    return 0;
+}
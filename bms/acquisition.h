@@ -0,0 +1,204 @@
+/*
+* brief : parallel INA219 acquisition, one worker per i2c bus
+*
+* Cells are grouped by CellPorts::i2c_bus. Each bus has its own MuxBank and
+* INA219 drivers and is only ever touched by its own worker, so transactions
+* on one bus stay serialized while separate buses run at the same time. A
+* sweep() reads every cell once and returns when all buses are done: the
+* calling thread reads the first bus itself and one thread per further bus
+* reads the rest, so a single-bus pack costs no thread handoff at all. The
+* samples land in one array indexed by cell, whichever bus they came from.
+*
+* The bus threads are started by the first sweep(), so they inherit the
+* calling task's CPU affinity and SCHED_FIFO priority. A bus transfer blocks
+* in the kernel, so the buses still overlap when that is a single CPU.
+*
+* sweepUs() is when the last sweep finished, the time of the control step
+* that follows it. With a TraceWriter set, every sweep is logged with that
+* time on the calling thread once all buses are done. In replay mode sweep()
+* leaves the buses alone and the samples are the ones inject() put in place
+* from a trace.
+*
+* With a Readiness set, the first sweep in which a cell's INA219 answers
+* raises that cell's signal.
+*/
+#ifndef BMS_ACQUISITION_H
+#define BMS_ACQUISITION_H
+
+#include "hal.h"
+#include "ina219.h"
+#include "trace.h"
+#include "readiness.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+struct CellSample {
+    Ina219Reading reading;      //NaN voltage/current when the bus did not answer
+    uint64_t timestamp_us = 0;  //when the reading was taken
+};
+
+class Acquisition {
+public:
+    Acquisition(Hal& hal, const std::vector<CellPorts>& ports, const Ina219Config& sensor_config = Ina219Config())
+        : hal(hal), samples(ports.size()) {
+        for (size_t i = 0; i < ports.size(); i++) {
+            Bus* bus = nullptr;
+            for (auto& b : buses) {
+                if (b->muxes.busNumber() == ports[i].i2c_bus) bus = b.get();
+            }
+            if (!bus) {
+                buses.emplace_back(new Bus(hal, ports[i].i2c_bus));
+                bus = buses.back().get();
+            }
+            bus->muxes.open(ports[i].mux_addr);
+            bus->cells.push_back(i);
+            bus->ports.push_back(ports[i]);
+        }
+        for (auto& bus : buses) {
+            for (size_t k = 0; k < bus->cells.size(); k++) {
+                select(*bus, k);    //each INA219 is configured through its own channel
+                bus->sensors.emplace_back(hal, bus->muxes.busNumber(), bus->ports[k].ina_addr, sensor_config);
+            }
+        }
+    }
+
+    ~Acquisition() { stop(); }
+
+    size_t size() const { return samples.size(); }
+    size_t busCount() const { return buses.size(); }
+
+    //latest sample of cell i; call from the thread that runs sweep()
+    const CellSample& sample(size_t i) const { return samples[i]; }
+
+    void setTrace(TraceWriter* writer) { trace = writer; }
+
+    //signals[i] goes up with the first valid sample of cell i
+    void setReadiness(Readiness* r, const std::vector<size_t>& signals) {
+        readiness = r;
+        ready_signals = signals;
+        unsignalled = r ? signals.size() : 0;
+        signalled.assign(signals.size(), 0);
+    }
+
+    //replay: sweep() no longer reads the buses
+    void replayMode() { replaying = true; }
+    void inject(size_t i, const CellSample& sample) { samples[i] = sample; }
+
+    //reads every cell once, buses in parallel
+    void sweep() {
+        if (!replaying) readAll();
+        swept_us = hal.nowUs();
+        if (trace) record();
+        if (unsignalled) signalReady();
+    }
+
+    uint64_t sweepUs() const { return swept_us; }  //when the last sweep finished
+
+    void stop() {
+        if (!running) return;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            running = false;
+            generation++;
+        }
+        wake_cv.notify_all();
+        for (std::thread& t : workers) t.join();
+        workers.clear();
+    }
+
+private:
+    struct Bus {
+        Bus(Hal& hal, int number) : muxes(hal, number) {}
+        MuxBank muxes;
+        std::vector<size_t> cells;      //pack index of each cell on this bus
+        std::vector<CellPorts> ports;
+        std::vector<Ina219> sensors;
+    };
+
+    Hal& hal;
+    std::vector<std::unique_ptr<Bus>> buses;
+    std::vector<CellSample> samples;    //each slot is written by its bus only
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable wake_cv, done_cv;
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool running = false;   //guarded by mtx once the workers run
+    TraceWriter* trace = nullptr;
+    bool replaying = false;
+    uint64_t swept_us = 0;
+    Readiness* readiness = nullptr;
+    std::vector<size_t> ready_signals;
+    std::vector<uint8_t> signalled;
+    size_t unsignalled = 0;     //cells without a valid sample yet
+
+    void readAll() {
+        if (buses.empty()) return;
+        if (buses.size() > 1 && !running) start();
+        if (buses.size() > 1) {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending = buses.size() - 1;
+            generation++;
+        }
+        wake_cv.notify_all();
+        readBus(*buses[0]);
+        if (buses.size() > 1) {
+            std::unique_lock<std::mutex> lock(mtx);
+            done_cv.wait(lock, [&] { return pending == 0; });
+        }
+    }
+
+    //other muxes on the bus are released so only one INA219 answers
+    bool select(Bus& bus, size_t k) { return bus.muxes.select(bus.ports[k].mux_addr, bus.ports[k].mux_channel); }
+
+    void readBus(Bus& bus) {
+        for (size_t k = 0; k < bus.cells.size(); k++) {
+            CellSample& s = samples[bus.cells[k]];
+            s.reading = Ina219Reading();
+            s.timestamp_us = hal.nowUs();
+            if (!select(bus, k) || !bus.sensors[k].read(s.reading)) bus.muxes.invalidate();   //NaN: counts as a dropout
+        }
+    }
+
+    void record() {
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Ina219Reading& r = samples[i].reading;
+            trace->cell(samples[i].timestamp_us, i, r.voltage, r.current, r.power, r.ready, r.overflow);
+        }
+        trace->sweep(swept_us, samples.size());
+    }
+
+    void signalReady() {
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (signalled[i] || !std::isfinite(samples[i].reading.voltage)) continue;
+            signalled[i] = 1;
+            unsignalled--;
+            readiness->signal(ready_signals[i]);
+        }
+    }
+
+    void start() {
+        running = true;
+        for (size_t b = 1; b < buses.size(); b++) workers.emplace_back(&Acquisition::worker, this, b, generation);
+    }
+
+    void worker(size_t b, uint64_t seen) {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake_cv.wait(lock, [&] { return generation != seen; });
+                seen = generation;
+                if (!running) return;
+            }
+            readBus(*buses[b]);
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--pending == 0) done_cv.notify_one();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+* brief : passive balancing - bleeds the cells above the pack's lowest through their discharge relays
+*
+* Each pass compares every cell against the lowest cell of the pack: by SoC
+* when every cell has an estimate, by voltage otherwise. A cell starts to bleed
+* when it is start_soc (or start_mv) above the lowest and stops once it is
+* back within stop_soc (stop_mv); the gap between the two thresholds and a
+* minimum time in each relay state (min_on_us, min_off_us) keep the relays
+* from chattering. A bleed only starts near the top of charge, once the lowest
+* cell is at top_soc (top_v without estimates): lower down the charger brings
+* every cell up anyway, and bleeding there only burns charge. Limits override
+* the dwell time and stop a bleed at once: the cell's discharge resistor at
+* resistor_max_c (or its sensor missing), resuming only below
+* resistor_resume_c, and the cell below min_cell_v.
+*
+* A relay switched on from outside (the operator) is left alone, and one the
+* balancer turned on but found switched off (by the operator, or refused while
+* the safety supervisor holds it open) counts as overridden: it stays off for
+* min_off_us like any other release. While a relay is on the cell
+* does not charge (Pack stops charging while discharging), so the lower cells
+* catch up.
+*/
+#ifndef BMS_BALANCER_H
+#define BMS_BALANCER_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#define BALANCE_PERIOD_MS 1000
+#define BALANCE_START_SOC 3.0f      //% above the lowest cell
+#define BALANCE_STOP_SOC 1.0f
+#define BALANCE_START_MV 30.0f      //without SoC estimates
+#define BALANCE_STOP_MV 10.0f
+#define BALANCE_TOP_SOC 80.0f       //lowest cell SoC before any bleed starts
+#define BALANCE_TOP_V 4.1f          //without SoC estimates, under the 4.2 V CV target
+#define BALANCE_MIN_CELL_V 3.6f
+#define BALANCE_RESISTOR_MAX_C 60.0f
+#define BALANCE_RESISTOR_RESUME_C 50.0f
+#define BALANCE_DWELL_MS 30000
+
+struct BalanceConfig {
+    float start_soc = BALANCE_START_SOC;
+    float stop_soc = BALANCE_STOP_SOC;
+    float start_mv = BALANCE_START_MV;
+    float stop_mv = BALANCE_STOP_MV;
+    float top_soc = BALANCE_TOP_SOC;
+    float top_v = BALANCE_TOP_V;
+    float min_cell_v = BALANCE_MIN_CELL_V;
+    float resistor_max_c = BALANCE_RESISTOR_MAX_C;
+    float resistor_resume_c = BALANCE_RESISTOR_RESUME_C;
+    uint64_t min_on_us = BALANCE_DWELL_MS * 1000ULL;
+    uint64_t min_off_us = BALANCE_DWELL_MS * 1000ULL;
+};
+
+class Balancer {
+public:
+    enum Reason { IDLE, BLEED_SOC, BLEED_VOLTAGE, BALANCED, RESISTOR_HOT, CELL_LOW, OVERRIDDEN, MANUAL };
+
+    explicit Balancer(size_t cells, const BalanceConfig& config = BalanceConfig())
+        : config(config), owned(cells, 0), hot(cells, 0), changed_us(cells, 0), reasons(cells, IDLE) {}
+
+    //soc (%, NaN = no estimate), voltage (V), resistor ('C, NaN = missing) and relay (in force) per cell;
+    //relay_out gets the state each relay should be in, returns how many differ from relay
+    size_t update(uint64_t now_us, const float soc[], const float voltage[], const float resistor[], const int relay[], int relay_out[]) {
+        size_t cells = owned.size();
+        bool by_soc = true;
+        float low_soc = INFINITY, low_v = INFINITY;
+        for (size_t i = 0; i < cells; i++) {
+            if (std::isnan(soc[i])) by_soc = false;
+            else low_soc = std::min(low_soc, soc[i]);
+            if (!std::isnan(voltage[i])) low_v = std::min(low_v, voltage[i]);
+        }
+
+        bool top = by_soc ? low_soc >= config.top_soc : low_v >= config.top_v;
+        size_t changes = 0;
+        for (size_t i = 0; i < cells; i++) {
+            relay_out[i] = relay[i];
+            if (relay[i] && !owned[i]) {
+                reasons[i] = MANUAL;
+                continue;
+            }
+            if (!relay[i] && owned[i]) {    //switched off under us
+                owned[i] = 0;
+                changed_us[i] = now_us;
+                reasons[i] = OVERRIDDEN;
+            }
+            if (!(resistor[i] < config.resistor_max_c)) hot[i] = 1;
+            else if (resistor[i] < config.resistor_resume_c) hot[i] = 0;
+            bool low = !(voltage[i] >= config.min_cell_v);
+            float above = by_soc ? soc[i] - low_soc : (voltage[i] - low_v) * 1000.0f;
+            float start = by_soc ? config.start_soc : config.start_mv;
+            float stop = by_soc ? config.stop_soc : config.stop_mv;
+            uint64_t held = now_us - changed_us[i];
+
+            if (owned[i]) {
+                Reason end = hot[i] ? RESISTOR_HOT : low ? CELL_LOW : (held >= config.min_on_us && !(above > stop)) ? BALANCED : IDLE;
+                if (end == IDLE) continue;
+                owned[i] = 0;
+                relay_out[i] = 0;
+                changed_us[i] = now_us;
+                reasons[i] = end;
+                changes++;
+            }
+            else if (top && !hot[i] && !low && above >= start && (changed_us[i] == 0 || held >= config.min_off_us)) {
+                owned[i] = 1;
+                relay_out[i] = 1;
+                changed_us[i] = now_us;
+                reasons[i] = by_soc ? BLEED_SOC : BLEED_VOLTAGE;
+                changes++;
+            }
+        }
+        return changes;
+    }
+
+    bool bleeding(size_t cell) const { return owned[cell]; }
+    Reason reason(size_t cell) const { return reasons[cell]; }   //of the last change
+
+    static const char* reasonName(Reason r) {
+        static const char* names[] = { "idle", "above the lowest cell (SoC)", "above the lowest cell (voltage)", "balanced",
+                                       "discharge resistor hot", "cell voltage low", "switched off from outside", "manual" };
+        return names[r];
+    }
+
+private:
+    BalanceConfig config;
+    std::vector<uint8_t> owned;     //relay on by the balancer
+    std::vector<uint8_t> hot;       //resistor over the limit, not cooled down yet
+    std::vector<uint64_t> changed_us;
+    std::vector<Reason> reasons;
+};
+
+#endif
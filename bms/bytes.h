@@ -0,0 +1,32 @@
+/*
+* brief : little-endian field packing for the wire formats and files
+*/
+#ifndef BMS_BYTES_H
+#define BMS_BYTES_H
+
+#include <cstdint>
+#include <cstring>
+
+static inline uint8_t* put_u8(uint8_t* p, uint8_t v) { *p = v; return p + 1; }
+static inline uint8_t* put_u16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; return p + 2; }
+static inline uint8_t* put_u32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (8 * i); return p + 4; }
+static inline uint8_t* put_u64(uint8_t* p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = v >> (8 * i); return p + 8; }
+
+static inline uint16_t get_u16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static inline uint32_t get_u32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+static inline uint64_t get_u64(const uint8_t* p) { return get_u32(p) | (static_cast<uint64_t>(get_u32(p + 4)) << 32); }
+
+static inline uint8_t* put_f32(uint8_t* p, float v) {   //bit exact, NaN included
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    return put_u32(p, bits);
+}
+
+static inline float get_f32(const uint8_t* p) {
+    uint32_t bits = get_u32(p);
+    float v;
+    memcpy(&v, &bits, 4);
+    return v;
+}
+
+#endif
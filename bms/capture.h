@@ -0,0 +1,121 @@
+/*
+* brief : high-rate sample capture - every control loop sample, buffered per cell
+*
+* The charging thread records one timestamped sample per cell per control step
+* into that cell's single-producer/single-consumer ring; the uploader drains all
+* rings every flush interval and ships them as FRAME_SAMPLES batches. Neither
+* side locks or allocates. When the uploader falls behind a ring fills up and
+* new samples are dropped and counted, the control loop never waits.
+*/
+#ifndef BMS_CAPTURE_H
+#define BMS_CAPTURE_H
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#define CAPTURE_BUFFER 1024     //samples per cell, ~20 s at CHARGE_PERIOD_MS
+#define CAPTURE_FLUSH_MS 200    //upload latency bound
+#define CAPTURE_BATCH 256       //max samples per frame
+
+struct Sample {
+    uint64_t timestamp_us;
+    float voltage;      //V, raw INA219 reading
+    float current;      //mA, raw INA219 reading
+    uint16_t cell;
+    uint8_t duty_cycle;
+    uint8_t charge_mode;
+    uint8_t soc;
+    uint8_t relay_state;
+};
+
+class SampleRing {  //single producer, single consumer
+public:
+    explicit SampleRing(size_t capacity) : mask(round_up(capacity) - 1), slots(new Sample[mask + 1]) {}
+
+    bool push(const Sample& s) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) > mask) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots[h & mask] = s;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t pop(Sample* out, size_t max) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t n = head.load(std::memory_order_acquire) - t;
+        if (n > max) n = max;
+        for (uint64_t k = 0; k < n; k++) out[k] = slots[(t + k) & mask];
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t pending() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+    uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    size_t mask;
+    std::unique_ptr<Sample[]> slots;
+    std::atomic<uint64_t> head{0}, tail{0};
+    std::atomic<uint64_t> dropped{0};
+
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+};
+
+class SampleCapture {
+public:
+    SampleCapture(size_t cells, size_t capacity = CAPTURE_BUFFER) {
+        for (size_t i = 0; i < cells; i++) rings.emplace_back(new SampleRing(capacity));
+    }
+
+    size_t cells() const { return rings.size(); }
+
+    //charging thread
+    void record(const Sample& s) { rings[s.cell]->push(s); }
+
+    //uploader: up to max samples, taken round robin so no cell starves a batch
+    size_t drain(Sample* out, size_t max) {
+        size_t n = 0;
+        bool more = !rings.empty();
+        while (n < max && more) {
+            more = false;
+            for (size_t k = 0; k < rings.size() && n < max; k++) {
+                size_t c = (next + k) % rings.size();
+                size_t take = rings[c]->pop(out + n, std::min<size_t>(max - n, DRAIN_CHUNK));
+                n += take;
+                more |= take == DRAIN_CHUNK;
+            }
+            next = (next + 1) % rings.size();
+        }
+        return n;
+    }
+
+    size_t pending() const {
+        size_t n = 0;
+        for (const auto& r : rings) n += r->pending();
+        return n;
+    }
+
+    uint64_t drops() const {
+        uint64_t n = 0;
+        for (const auto& r : rings) n += r->drops();
+        return n;
+    }
+
+private:
+    static constexpr size_t DRAIN_CHUNK = 16;
+    std::vector<std::unique_ptr<SampleRing>> rings;
+    size_t next = 0;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+* brief : per-cell CC-CV charge controller - PI(D) current and voltage loops with feedforward
+*
+* The charge path is a PWM-switched supply into the cell through the MOSFET,
+* the filter and the Schottky diode, so to a first approximation
+*   duty * supply_v = cell voltage + current * path_ohm
+* Each loop starts from that feedforward and corrects the rest with PI(D):
+*   CC: ff = (V_cell   + I_target * R) / Vs,  error = I_target - I_cell
+*   CV: ff = (V_target + I_cell   * R) / Vs,  error = V_target - V_cell
+* Both loops run every sample and the lower duty wins (min select). The loop
+* that is not driving keeps its integrator tracked to the applied duty
+* (back calculation), which is also the anti-windup when the output clamps at
+* 0 or 100 %; so when the cell voltage reaches the target the handover from
+* CC to CV starts from the duty already applied, without a bump, and back
+* again if the setpoint rises. The derivative acts on the measurement, low
+* pass filtered, and is off with the default gains.
+*
+* Gains are in % duty per mA (current loop) and per V (voltage loop); ki per
+* second, kd in seconds.
+*/
+#ifndef BMS_CHARGE_CONTROLLER_H
+#define BMS_CHARGE_CONTROLLER_H
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#define CHARGE_SUPPLY_V 5.0f        //charge supply at 100 % duty
+#define CHARGE_PATH_OHM 0.6f        //MOSFET + filter + diode + wiring
+#define CHARGE_MAX_DT_S 0.1f        //longer gaps (rest pause, dropout) integrate as this
+
+struct PidGains {
+    float kp;
+    float ki;
+    float kd;
+};
+
+struct ChargeControllerConfig {
+    PidGains current = { 0.002f, 0.06f, 0.0f };
+    PidGains voltage = { 40.0f, 150.0f, 0.0f };
+    float supply_v = CHARGE_SUPPLY_V;
+    float path_ohm = CHARGE_PATH_OHM;
+    float derivative_tau_s = 0.05f;     //derivative low pass
+};
+
+class ChargeController {
+public:
+    enum Loop { LOOP_OFF, LOOP_CC, LOOP_CV };
+
+    explicit ChargeController(const ChargeControllerConfig& config = ChargeControllerConfig()) : config(config) {}
+
+    //one sample; returns the duty to apply, %. A NaN sample holds the last duty.
+    float update(uint64_t now_us, float target_ma, float target_v, float current_ma, float voltage_v) {
+        if (!std::isfinite(current_ma) || !std::isfinite(voltage_v)) return output;
+        float dt = last_us ? std::min(CHARGE_MAX_DT_S, (now_us - last_us) / 1e6f) : 0.0f;
+        last_us = now_us;
+
+        float ff_cc = (voltage_v + target_ma / 1000.0f * config.path_ohm) / config.supply_v * 100.0f;
+        float ff_cv = (target_v + std::max(0.0f, current_ma) / 1000.0f * config.path_ohm) / config.supply_v * 100.0f;
+        float u_cc = cc.step(config.current, ff_cc, target_ma - current_ma, current_ma, dt, config.derivative_tau_s);
+        float u_cv = cv.step(config.voltage, ff_cv, target_v - voltage_v, voltage_v, dt, config.derivative_tau_s);
+
+        active = u_cv < u_cc ? LOOP_CV : LOOP_CC;
+        output = std::min(100.0f, std::max(0.0f, std::min(u_cc, u_cv)));
+        cc.track(output, u_cc);
+        cv.track(output, u_cv);
+        return output;
+    }
+
+    //charging stopped: the next update starts from the feedforward alone
+    void reset() {
+        cc = Term();
+        cv = Term();
+        output = 0.0f;
+        last_us = 0;
+        active = LOOP_OFF;
+    }
+
+    float duty() const { return output; }
+    Loop loop() const { return active; }
+    const ChargeControllerConfig& settings() const { return config; }
+
+private:
+    struct Term {   //PI(D) state of one loop
+        float integral = 0.0f;
+        float last_measure = NAN;
+        float derivative = 0.0f;
+
+        float step(const PidGains& g, float ff, float error, float measure, float dt, float tau) {
+            if (dt > 0.0f) {
+                integral += g.ki * error * dt;
+                if (g.kd != 0.0f && std::isfinite(last_measure)) {
+                    float raw = -(measure - last_measure) / dt;     //on the measurement: no kick on setpoint changes
+                    derivative += (raw - derivative) * dt / (tau + dt);
+                }
+            }
+            last_measure = measure;
+            return ff + g.kp * error + integral + g.kd * derivative;
+        }
+
+        //back calculation: whatever this loop asked beyond the applied duty comes out of its integrator
+        void track(float applied, float requested) {
+            if (requested != applied) integral += applied - requested;
+        }
+    };
+
+    ChargeControllerConfig config;
+    Term cc, cv;
+    float output = 0.0f;
+    uint64_t last_us = 0;
+    Loop active = LOOP_OFF;
+};
+
+#endif
@@ -0,0 +1,282 @@
+/*
+* brief : binary frame envelope and the codecs that need no control code - constants, commands and acks,
+*         captured samples, telemetry decoding, stream reassembly
+*
+* The formats are described in protocol.h. This part builds on its own (no Hal,
+* no Pack), so offline tools such as journal_dump and the tests can decode
+* frames without a wiringPi or a simulation build; protocol.h adds the
+* encoders of the live telemetry snapshot.
+*/
+#ifndef BMS_FRAME_H
+#define BMS_FRAME_H
+
+#include "capture.h"
+#include "bytes.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#define PROTO_MAGIC0 'B'
+#define PROTO_MAGIC1 'M'
+#define PROTO_VERSION 1
+#define PROTO_HEADER_SIZE 8
+#define PROTO_MAX_PAYLOAD (1 << 20)     //decoder sanity limit
+
+#define FRAME_TELEMETRY 1
+#define FRAME_SAMPLES 2
+#define FRAME_COMMAND 3
+#define FRAME_ACK 4
+
+#define TELEMETRY_HEADER_SIZE 16
+#define TELEMETRY_RECORD_SIZE 16
+#define SAMPLES_HEADER_SIZE 20
+#define SAMPLE_RECORD_SIZE 16
+#define COMMAND_HEADER_SIZE 4
+#define COMMAND_RECORD_SIZE 12
+#define CELL_ALL 0xFFFF
+
+//command types and their values
+#define CMD_RELAY 1             //0 off, 1 on (discharge)
+#define CMD_CHARGE_MODE 2       //-1 automatic, else a ChargingMode ceiling
+#define CMD_CURRENT_SETPOINT 3  //charge current mA, 0 = mode default
+#define CMD_VOLTAGE_SETPOINT 4  //CV voltage mV, 0 = TARGET_VOLTAGE
+
+//ack status
+#define ACK_OK 0
+#define ACK_BAD_CELL 1
+#define ACK_BAD_TYPE 2
+#define ACK_BAD_VALUE 3
+#define ACK_REFUSED 4       //valid, but a safety hold keeps the old state
+
+//per cell flags
+#define CELL_RELAY_ON 0x01
+#define CELL_VOLTAGE_INVALID 0x02
+#define CELL_CURRENT_INVALID 0x04
+#define CELL_TEMP_INVALID 0x08
+#define CELL_RESISTER_TEMP_INVALID 0x10
+#define CELL_NO_DATA 0x20               //charging loop has not published yet
+
+//round v * scale into [lo, hi]; false (and 0) when NaN or out of range. In double: float(INT32_MAX)
+//rounds up to 2^31, which would pass the check and wrap to INT32_MIN on the cast.
+static inline bool scale_fixed(float v, float scale, long lo, long hi, long& out) {
+    double x = std::round(static_cast<double>(v) * scale);
+    if (!(x >= lo && x <= hi)) {
+        out = 0;
+        return false;
+    }
+    out = static_cast<long>(x);
+    return true;
+}
+
+static inline uint8_t clamp_u8(float v) { return v > 0.0f ? (v < 255.0f ? static_cast<uint8_t>(v) : 255) : 0; }
+
+static inline size_t telemetry_frame_size(size_t cells) {
+    return PROTO_HEADER_SIZE + TELEMETRY_HEADER_SIZE + cells * TELEMETRY_RECORD_SIZE;
+}
+
+static inline uint8_t* put_frame_header(uint8_t* p, uint8_t type, uint32_t length) {
+    p = put_u8(p, PROTO_MAGIC0);
+    p = put_u8(p, PROTO_MAGIC1);
+    p = put_u8(p, PROTO_VERSION);
+    p = put_u8(p, type);
+    return put_u32(p, length);
+}
+
+static inline size_t samples_frame_size(size_t count) {
+    return PROTO_HEADER_SIZE + SAMPLES_HEADER_SIZE + count * SAMPLE_RECORD_SIZE;
+}
+
+//bytes written, 0 when cap is too small or the batch spans more than ~71 minutes
+inline size_t encode_samples(const Sample* samples, size_t count, uint32_t seq, uint8_t* out, size_t cap) {
+    size_t size = samples_frame_size(count);
+    if (size > cap) return 0;
+    uint64_t base = UINT64_MAX;
+    for (size_t i = 0; i < count; i++) base = std::min(base, samples[i].timestamp_us);
+    if (count == 0) base = 0;
+
+    uint8_t* p = put_frame_header(out, FRAME_SAMPLES, static_cast<uint32_t>(size - PROTO_HEADER_SIZE));
+    p = put_u32(p, seq);
+    p = put_u64(p, base);
+    p = put_u32(p, static_cast<uint32_t>(count));
+    p = put_u8(p, SAMPLE_RECORD_SIZE);
+    p = put_u8(p, 0);
+    p = put_u16(p, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        const Sample& s = samples[i];
+        uint64_t offset = s.timestamp_us - base;
+        if (offset > UINT32_MAX) return 0;
+        uint8_t flags = s.relay_state == 1 ? CELL_RELAY_ON : 0;
+        long voltage, current;
+        if (!scale_fixed(s.voltage, 1000.0f, 0, 0xFFFF, voltage)) flags |= CELL_VOLTAGE_INVALID;
+        if (!scale_fixed(s.current, 100.0f, INT32_MIN, INT32_MAX, current)) flags |= CELL_CURRENT_INVALID;
+
+        p = put_u32(p, static_cast<uint32_t>(offset));
+        p = put_u16(p, s.cell);
+        p = put_u16(p, static_cast<uint16_t>(voltage));
+        p = put_u32(p, static_cast<uint32_t>(static_cast<int32_t>(current)));
+        p = put_u8(p, s.duty_cycle);
+        p = put_u8(p, s.charge_mode);
+        p = put_u8(p, s.soc);
+        p = put_u8(p, flags);
+    }
+    return size;
+}
+
+//decoded samples, invalid values are NaN
+inline bool decode_samples(const uint8_t* payload, size_t length, uint32_t& seq, std::vector<Sample>& samples) {
+    if (length < SAMPLES_HEADER_SIZE) return false;
+    seq = get_u32(payload);
+    uint64_t base = get_u64(payload + 4);
+    size_t count = get_u32(payload + 12);
+    size_t record = payload[16];
+    if (record < SAMPLE_RECORD_SIZE || (length - SAMPLES_HEADER_SIZE) / record < count) return false;
+
+    samples.resize(count);
+    const uint8_t* p = payload + SAMPLES_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, p += record) {
+        Sample& s = samples[i];
+        uint8_t flags = p[15];
+        s.timestamp_us = base + get_u32(p);
+        s.cell = get_u16(p + 4);
+        s.voltage = (flags & CELL_VOLTAGE_INVALID) ? NAN : get_u16(p + 6) / 1000.0f;
+        s.current = (flags & CELL_CURRENT_INVALID) ? NAN : static_cast<int32_t>(get_u32(p + 8)) / 100.0f;
+        s.duty_cycle = p[12];
+        s.charge_mode = p[13];
+        s.soc = p[14];
+        s.relay_state = (flags & CELL_RELAY_ON) ? 1 : 0;
+    }
+    return true;
+}
+
+struct Command {    //a command, or its acknowledgement
+    uint32_t seq;
+    uint16_t cell;
+    uint8_t type;
+    uint8_t status;     //ack only
+    int32_t value;
+};
+
+static inline size_t command_frame_size(size_t count) {
+    return PROTO_HEADER_SIZE + COMMAND_HEADER_SIZE + count * COMMAND_RECORD_SIZE;
+}
+
+//FRAME_COMMAND or FRAME_ACK; bytes written, 0 when cap is too small
+inline size_t encode_commands(uint8_t type, const Command* commands, size_t count, uint8_t* out, size_t cap) {
+    size_t size = command_frame_size(count);
+    if (size > cap || count > 0xFFFF) return 0;
+    uint8_t* p = put_frame_header(out, type, static_cast<uint32_t>(size - PROTO_HEADER_SIZE));
+    p = put_u16(p, static_cast<uint16_t>(count));
+    p = put_u8(p, COMMAND_RECORD_SIZE);
+    p = put_u8(p, 0);
+    for (size_t i = 0; i < count; i++) {
+        p = put_u32(p, commands[i].seq);
+        p = put_u16(p, commands[i].cell);
+        p = put_u8(p, commands[i].type);
+        p = put_u8(p, type == FRAME_ACK ? commands[i].status : 0);
+        p = put_u32(p, static_cast<uint32_t>(commands[i].value));
+    }
+    return size;
+}
+
+inline bool decode_commands(const uint8_t* payload, size_t length, std::vector<Command>& commands) {
+    if (length < COMMAND_HEADER_SIZE) return false;
+    size_t count = get_u16(payload);
+    size_t record = payload[2];
+    if (record < COMMAND_RECORD_SIZE || length < COMMAND_HEADER_SIZE + count * record) return false;
+    commands.resize(count);
+    const uint8_t* p = payload + COMMAND_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, p += record) {
+        commands[i].seq = get_u32(p);
+        commands[i].cell = get_u16(p + 4);
+        commands[i].type = p[6];
+        commands[i].status = p[7];
+        commands[i].value = static_cast<int32_t>(get_u32(p + 8));
+    }
+    return true;
+}
+
+struct CellRecord {     //decoded cell, invalid values are NaN
+    float voltage, current, temperature, resister_temp;
+    int soc, duty_cycle, charge_mode, fan_pwm, relay_state;
+    uint8_t flags;
+};
+
+struct TelemetryMessage {
+    uint32_t seq = 0;
+    uint64_t timestamp_us = 0;
+    int resister_fan_pwm = 0;
+    std::vector<CellRecord> cells;
+};
+
+inline bool decode_telemetry(const uint8_t* payload, size_t length, TelemetryMessage& msg) {
+    if (length < TELEMETRY_HEADER_SIZE) return false;
+    msg.seq = get_u32(payload);
+    msg.timestamp_us = get_u64(payload + 4);
+    size_t cells = get_u16(payload + 12);
+    size_t record = payload[14];
+    msg.resister_fan_pwm = payload[15];
+    if (record < TELEMETRY_RECORD_SIZE || length < TELEMETRY_HEADER_SIZE + cells * record) return false;
+
+    msg.cells.resize(cells);
+    const uint8_t* p = payload + TELEMETRY_HEADER_SIZE;
+    for (size_t i = 0; i < cells; i++, p += record) {
+        CellRecord& c = msg.cells[i];
+        c.flags = p[14];
+        c.voltage = (c.flags & CELL_VOLTAGE_INVALID) ? NAN : get_u16(p) / 1000.0f;
+        c.current = (c.flags & CELL_CURRENT_INVALID) ? NAN : static_cast<int32_t>(get_u32(p + 2)) / 100.0f;
+        c.temperature = (c.flags & CELL_TEMP_INVALID) ? NAN : static_cast<int16_t>(get_u16(p + 6)) / 100.0f;
+        c.resister_temp = (c.flags & CELL_RESISTER_TEMP_INVALID) ? NAN : static_cast<int16_t>(get_u16(p + 8)) / 100.0f;
+        c.soc = p[10];
+        c.duty_cycle = p[11];
+        c.charge_mode = p[12];
+        c.fan_pwm = p[13];
+        c.relay_state = (c.flags & CELL_RELAY_ON) ? 1 : 0;
+    }
+    return true;
+}
+
+class FrameReader {     //reassembles frames from a byte stream, however the reads split it
+public:
+    void feed(const uint8_t* data, size_t length) { buffer.insert(buffer.end(), data, data + length); }
+
+    //next complete frame; false when more bytes are needed or the stream is corrupt (see bad())
+    bool next(uint8_t& type, std::vector<uint8_t>& payload) {
+        if (corrupt || buffer.size() - start < PROTO_HEADER_SIZE) return compact();
+        const uint8_t* h = buffer.data() + start;
+        if (h[0] != PROTO_MAGIC0 || h[1] != PROTO_MAGIC1 || h[2] != PROTO_VERSION) {
+            corrupt = true;
+            return false;
+        }
+        uint32_t length = get_u32(h + 4);
+        if (length > PROTO_MAX_PAYLOAD) {
+            corrupt = true;
+            return false;
+        }
+        if (buffer.size() - start < PROTO_HEADER_SIZE + length) return compact();
+        type = h[3];
+        payload.assign(h + PROTO_HEADER_SIZE, h + PROTO_HEADER_SIZE + length);
+        start += PROTO_HEADER_SIZE + length;
+        return true;
+    }
+
+    bool bad() const { return corrupt; }
+    void reset() { buffer.clear(); start = 0; corrupt = false; }
+
+private:
+    std::vector<uint8_t> buffer;
+    size_t start = 0;
+    bool corrupt = false;
+
+    bool compact() {
+        buffer.erase(buffer.begin(), buffer.begin() + start);
+        start = 0;
+        return false;
+    }
+};
+
+#endif
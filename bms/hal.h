@@ -0,0 +1,234 @@
+/*
+* brief : hardware abstraction layer (i2c, gpio, pwm, 1-wire, clock)
+*
+* Every access the controller makes to the Raspberry Pi goes through Hal so the
+* same control code runs on the real rig (WiringPiHal) or in-process against
+* the cell model in sim_hal.h (build with -DBMS_SIMULATION).
+*/
+#ifndef BMS_HAL_H
+#define BMS_HAL_H
+
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+
+#include "pwm.h"
+
+#ifndef BMS_SIMULATION
+#include <wiringPi.h>
+#include <wiringPiI2C.h>
+#else
+#ifndef OUTPUT
+#define OUTPUT 1
+#endif
+#ifndef HIGH
+#define HIGH 1
+#endif
+#ifndef LOW
+#define LOW 0
+#endif
+#endif
+
+#define I2C_BUS 1   //n of /dev/i2c-n; 1 is the Pi header bus
+
+struct CellPorts {  //where one cell is wired
+    int mux_addr;                   //TCA9548A i2c address
+    int mux_channel;                //0..7
+    int ina_addr;                   //INA219 i2c address behind the channel
+    int pwm_pin;                    //charge control
+    int fan_pin;
+    int relay_pin;                  //discharge relay
+    std::string temp_path;          //DS18B20 on the cell
+    std::string resistor_temp_path; //DS18B20 on the discharge resistor
+    int i2c_bus = I2C_BUS;          //bus the mux sits on
+};
+
+class Hal {
+public:
+    virtual ~Hal() {}
+
+    virtual int setup() = 0;                                    //-1 on failure
+
+    //i2c (same semantics as wiringPiI2C*); fds of different buses can be used from different threads
+    virtual int i2cSetup(int bus, int address) = 0;             //returns fd, -1 on failure
+    virtual int i2cWrite(int fd, int data) = 0;
+    virtual int i2cReadReg16(int fd, int reg) = 0;              //raw, little-endian as returned by the bus
+    virtual int i2cWriteReg16(int fd, int reg, int data) = 0;
+
+    //gpio, pwm; a pwm channel runs at frequency_hz with range steps, pwmWrite takes 0..range
+    virtual void pinMode(int pin, int mode) = 0;
+    virtual void digitalWrite(int pin, int value) = 0;
+    virtual int pwmCreate(int pin, int initial, int range, int frequency_hz) = 0;  //-1 on failure
+    virtual void pwmWrite(int pin, int value) = 0;
+
+    //1-wire DS18B20 (sysfs w1_slave path), degrees C
+    virtual double readTemperature(const std::string& sensorPath) = 0;
+    //same sensors through handles kept open; w1Read gives NaN on no answer or CRC error
+    virtual int w1Open(const std::string& sensorPath) = 0;      //-1 on failure
+    virtual double w1Read(int handle) = 0;
+    virtual void w1Close(int handle) = 0;                       //the handle reads NaN afterwards
+    virtual bool w1BulkConvert() = 0;                           //convert on every sensor at once and wait, false if unsupported
+
+    //clock
+    virtual void sleepMs(int ms) = 0;
+    virtual void sleepUntilUs(uint64_t deadline_us) = 0;        //absolute, on the nowUs() clock
+    virtual uint64_t nowUs() = 0;                               //monotonic
+};
+
+#define W1_BULK_PATH "/sys/bus/w1/devices/w1_bus_master1/therm_bulk_read"
+#define W1_CONVERSION_MS 750    //DS18B20 12-bit
+
+inline double parse_w1_slave(const char* text) {   //"... : crc=57 YES\n... t=23125\n" -> 23.125
+    if (!strstr(text, "YES")) return NAN;
+    const char* t = strstr(text, " t=");
+    if (!t) return NAN;
+    return strtol(t + 3, nullptr, 10) / 1000.0;
+}
+
+inline uint64_t monotonic_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifndef BMS_SIMULATION
+class WiringPiHal : public Hal {   //real rig
+public:
+    int setup() override { return wiringPiSetup(); }
+
+    int i2cSetup(int bus, int address) override {
+        return wiringPiI2CSetupInterface(("/dev/i2c-" + std::to_string(bus)).c_str(), address);
+    }
+    int i2cWrite(int fd, int data) override { return wiringPiI2CWrite(fd, data); }
+    int i2cReadReg16(int fd, int reg) override { return wiringPiI2CReadReg16(fd, reg); }
+    int i2cWriteReg16(int fd, int reg, int data) override { return wiringPiI2CWriteReg16(fd, reg, data); }
+
+    void pinMode(int pin, int mode) override { ::pinMode(pin, mode); }
+    void digitalWrite(int pin, int value) override { ::digitalWrite(pin, value); }
+    //hardware channel when the pin has one and the block can run this setting, else the shared software scheduler
+    int pwmCreate(int pin, int initial, int range, int frequency_hz) override {
+        int divisor = pwm_hardware_divisor(frequency_hz, range);
+        if (pwm_hardware_pin(pin) && divisor && (hw_pins.empty() || (divisor == hw_divisor && range == hw_range))) {
+            ::pinMode(pin, PWM_OUTPUT);     //resets mode, range and clock of the whole block
+            pwmSetMode(PWM_MODE_MS);
+            pwmSetRange(range);
+            pwmSetClock(divisor);
+            ::pwmWrite(pin, std::min(range, std::max(0, initial)));
+            hw_pins.push_back(pin);
+            hw_divisor = divisor;
+            hw_range = range;
+            std::cout << "PWM pin " << pin << ": hardware, " << PWM_CLOCK_HZ / (divisor * range) << " Hz x " << range << std::endl;
+            return 0;
+        }
+        if (!soft_pwm.add(pin, frequency_hz, range, initial)) {
+            std::cerr << "PWM pin " << pin << ": cannot run " << frequency_hz << " Hz x " << range << std::endl;
+            return -1;
+        }
+        std::cout << "PWM pin " << pin << ": software, " << frequency_hz << " Hz x " << range << std::endl;
+        return 0;
+    }
+    void pwmWrite(int pin, int value) override {
+        if (std::find(hw_pins.begin(), hw_pins.end(), pin) != hw_pins.end()) ::pwmWrite(pin, value);
+        else soft_pwm.write(pin, value);
+    }
+
+    double readTemperature(const std::string& sensorPath) override { //read temperature data from file
+        std::ifstream file(sensorPath);
+        std::string line;
+        double temperature = 0.0;
+
+        if (file.is_open()) {
+            while (std::getline(file, line)) {
+                if (line.find(" t=") != std::string::npos) {
+                    std::string tempStr = line.substr(line.find(" t=") + 3);
+                    temperature = std::stod(tempStr) / 1000.0;
+                    break;
+                }
+            }
+            file.close();
+        }
+        else {
+            std::cerr << "Could not open sensor file: " << sensorPath << "\n";
+        }
+
+        return temperature;
+    }
+
+    int w1Open(const std::string& sensorPath) override {
+        int fd = open(sensorPath.c_str(), O_RDONLY);
+        if (fd == -1) {
+            std::cerr << "Could not open sensor file: " << sensorPath << "\n";
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(w1_mtx);
+        w1_fds.push_back(fd);
+        return static_cast<int>(w1_fds.size() - 1);
+    }
+
+    double w1Read(int handle) override {    //sysfs attribute: every read from offset 0 is a fresh transaction
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(w1_mtx);
+            if (handle < 0 || handle >= static_cast<int>(w1_fds.size())) return NAN;
+            fd = w1_fds[handle];
+        }
+        if (fd == -1) return NAN;
+        char text[128];
+        ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+        if (length <= 0) return NAN;
+        text[length] = 0;
+        return parse_w1_slave(text);
+    }
+
+    void w1Close(int handle) override {    //handles are not reused, so a stale one never reads another sensor
+        std::lock_guard<std::mutex> lock(w1_mtx);
+        if (handle < 0 || handle >= static_cast<int>(w1_fds.size()) || w1_fds[handle] == -1) return;
+        close(w1_fds[handle]);
+        w1_fds[handle] = -1;
+    }
+
+    bool w1BulkConvert() override {
+        int fd = open(W1_BULK_PATH, O_RDWR);
+        if (fd == -1) return false;     //kernel without therm_bulk_read
+        bool ok = write(fd, "trigger\n", 8) == 8;
+        for (int waited = 0; ok && waited < 2 * W1_CONVERSION_MS; waited += 50) {
+            char state[8] = {0};
+            if (pread(fd, state, sizeof(state) - 1, 0) > 0 && atoi(state) != -1) break;  //-1: conversion running
+            sleepMs(50);
+        }
+        close(fd);
+        return ok;
+    }
+
+    void sleepMs(int ms) override { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+    void sleepUntilUs(uint64_t deadline_us) override {  //steady_clock is CLOCK_MONOTONIC
+        timespec ts;
+        ts.tv_sec = deadline_us / 1000000;
+        ts.tv_nsec = (deadline_us % 1000000) * 1000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+    }
+    uint64_t nowUs() override { return monotonic_us(); }
+
+private:
+    std::mutex w1_mtx;
+    std::vector<int> w1_fds;
+    std::vector<int> hw_pins;   //on the hardware block, set up before any pwmWrite
+    int hw_divisor = 0;
+    int hw_range = 0;
+    SoftPwm soft_pwm{ ::digitalWrite };
+};
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+/*
+* brief : lock-free log-linear histogram for latency and jitter statistics
+*
+* Values (any unit, typically ns or us) land in one of HIST_BUCKETS counters:
+* values below HIST_SUB are exact, above that every power of two is split in
+* HIST_SUB equal sub-buckets, so a percentile is off by at most 1/HIST_SUB
+* (12.5%). Recording is a handful of relaxed atomic adds, never blocks and
+* never allocates; readers may snapshot at any time from any thread and get
+* counts that are at worst a few samples behind.
+*/
+#ifndef BMS_HISTOGRAM_H
+#define BMS_HISTOGRAM_H
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct HistogramSnapshot {
+    std::array<uint64_t, HIST_BUCKETS> counts{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    //upper bound of the bucket holding the q-quantile (0..1), 0 when empty
+    uint64_t percentile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts.size(); b++) {
+            seen += counts[b];
+            if (seen >= rank) {
+                uint64_t upper = bucket_upper(b);
+                return upper < max ? upper : max;
+            }
+        }
+        return max;
+    }
+
+    double mean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+
+    static size_t bucket_index(uint64_t v) {
+        if (v < HIST_SUB) return static_cast<size_t>(v);
+        int e = 63 - __builtin_clzll(v);    //v >= HIST_SUB, so e >= HIST_SUB_BITS
+        size_t sub = static_cast<size_t>((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+        return (e - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+    }
+
+    static uint64_t bucket_upper(size_t b) {
+        if (b < HIST_SUB) return b;
+        int e = static_cast<int>(b / HIST_SUB) + HIST_SUB_BITS - 1;
+        uint64_t sub = b % HIST_SUB;
+        uint64_t width = 1ULL << (e - HIST_SUB_BITS);
+        return (1ULL << e) + (sub + 1) * width - 1;
+    }
+};
+
+class Histogram {
+public:
+    void record(uint64_t v) {
+        buckets[HistogramSnapshot::bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t m = peak.load(std::memory_order_relaxed);
+        while (v > m && !peak.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+    }
+
+    void snapshot(HistogramSnapshot& out) const {
+        out.count = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+            out.counts[b] = buckets[b].load(std::memory_order_relaxed);
+            out.count += out.counts[b];
+        }
+        out.sum = sum.load(std::memory_order_relaxed);
+        out.max = peak.load(std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    void reset() {
+        for (auto& b : buckets) b.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        peak.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, HIST_BUCKETS> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> peak{0};
+};
+
+#endif
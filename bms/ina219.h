@@ -0,0 +1,250 @@
+/*
+* brief : INA219 current/voltage sensor driver and TCA9548A i2c mux bank
+*
+* Bus time per cell is what limits how many cells one bus can serve, so the
+* drivers keep transactions to the minimum:
+*   - MuxBank remembers the channel mask it last wrote to every mux and skips
+*     writes that would not change it (a failed write forgets the mask)
+*   - Ina219::read() is two register reads, bus voltage and current; the
+*     shunt voltage register is never read, the current register already
+*     carries the same measurement scaled by the calibration
+*   - the ADC resolution / hardware averaging is configurable, so noise can be
+*     filtered in the chip instead of by reading it more often
+*   - with track_ready, a read() that finds the conversion ready flag (CNVR)
+*     set also reads the power register, which clears it; a read() that finds
+*     it clear reports the sample as not ready, so a slow averaged conversion
+*     is not fed to the filters twice
+*
+* Register values are big-endian on the wire; Hal::i2cReadReg16 returns them
+* as read (little-endian), hence the swaps.
+*/
+#ifndef BMS_INA219_H
+#define BMS_INA219_H
+
+#include "hal.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <iostream>
+
+#define TCA_ADDR 0x70   //TCA9548A default address
+#define INA219_ADDR 0x40
+
+//registers
+#define INA219_REG_CONFIG 0x00
+#define INA219_REG_SHUNT 0x01
+#define INA219_REG_BUS 0x02
+#define INA219_REG_POWER 0x03
+#define INA219_REG_CURRENT 0x04
+#define INA219_REG_CALIBRATION 0x05
+
+//config fields
+#define INA219_BRNG_32V 0x2000
+#define INA219_PG_320MV 0x1800
+#define INA219_MODE_CONTINUOUS 0x7    //shunt and bus, continuous
+#define INA219_MODE_TRIGGERED 0x3     //shunt and bus, one conversion per config write
+#define INA219_BUS_CNVR 0x2
+#define INA219_BUS_OVF 0x1
+
+//ADC setting (BADC / SADC): resolution or number of averaged 12-bit samples
+#define INA219_ADC_9BIT 0x0
+#define INA219_ADC_10BIT 0x1
+#define INA219_ADC_11BIT 0x2
+#define INA219_ADC_12BIT 0x3
+#define INA219_ADC_AVG(n) (0x8 | ina219_log2(n))   //n = 2, 4 ... 128
+
+#define INA219_SHUNT_OHM 0.1f
+#define INA219_CURRENT_LSB_MA 0.1f    //calibration 4096 at 0.1 ohm
+
+constexpr int ina219_log2(int n) { return n <= 1 ? 0 : 1 + ina219_log2(n / 2); }
+
+struct Ina219Config {
+    int adc = INA219_ADC_12BIT;     //bus and shunt ADC
+    int mode = INA219_MODE_CONTINUOUS;
+    bool track_ready = false;       //also read the power register, see above
+    float shunt_ohm = INA219_SHUNT_OHM;
+    float current_lsb_ma = INA219_CURRENT_LSB_MA;
+
+    uint16_t configRegister() const {   //0x399F with the defaults
+        return INA219_BRNG_32V | INA219_PG_320MV | (adc << 7) | (adc << 3) | mode;
+    }
+
+    uint16_t calibrationRegister() const {
+        return static_cast<uint16_t>(std::lround(0.04096 / (current_lsb_ma / 1000.0 * shunt_ohm)));
+    }
+
+    int conversionUs() const {  //one conversion of bus or shunt
+        static const int resolution_us[4] = { 84, 148, 276, 532 };
+        if (!(adc & 0x8)) return resolution_us[adc & 0x3];
+        return 532 << (adc & 0x7);
+    }
+};
+
+struct Ina219Reading {
+    float voltage = NAN;    //V, bus
+    float current = NAN;    //mA, + charging
+    float power = NAN;      //mW, only with track_ready
+    bool ready = true;      //a conversion finished since the last power read (track_ready), else always true
+    bool overflow = false;  //current/power calculation overflowed
+};
+
+class Ina219 {
+public:
+    Ina219(Hal& hal, int bus, int address, const Ina219Config& config = Ina219Config()) : hal(&hal), address(address) {
+        fd = hal.i2cSetup(bus, address);
+        if (fd == -1) {
+            std::cerr << "Failed to initialize I2C communication.\n";
+            exit(1);
+        }
+        configure(config);
+    }
+
+    //the caller selects the mux channel first
+    bool configure(const Ina219Config& c) {
+        config = c;
+        bool ok = writeRegister(INA219_REG_CONFIG, config.configRegister()) != -1;
+        return writeRegister(INA219_REG_CALIBRATION, config.calibrationRegister()) != -1 && ok;
+    }
+
+    const Ina219Config& settings() const { return config; }
+
+    //one sample: 2 transactions, a 3rd for a new conversion with track_ready, plus a config write in triggered mode
+    bool read(Ina219Reading& out) {
+        int bus = readRegister(INA219_REG_BUS);
+        int current = readRegister(INA219_REG_CURRENT);
+        if (bus < 0 || current < 0) {
+            out.voltage = out.current = NAN;
+            return false;
+        }
+        out.voltage = (bus >> 3) * 0.004f;
+        out.current = static_cast<int16_t>(current) * config.current_lsb_ma;
+        out.overflow = bus & INA219_BUS_OVF;
+        out.ready = !config.track_ready || (bus & INA219_BUS_CNVR);
+        out.power = NAN;
+        if (config.track_ready && out.ready) {
+            int power = readRegister(INA219_REG_POWER);  //clears CNVR
+            out.power = power < 0 ? NAN : power * 20.0f * config.current_lsb_ma;
+            if (config.mode == INA219_MODE_TRIGGERED) trigger();
+        }
+        else if (!config.track_ready && config.mode == INA219_MODE_TRIGGERED) {
+            trigger();
+        }
+        return true;
+    }
+
+    //a conversion has completed since CNVR was last cleared (power read or config write)
+    bool conversionReady() {
+        int bus = readRegister(INA219_REG_BUS);
+        return bus >= 0 && (bus & INA219_BUS_CNVR);
+    }
+
+    //polls CNVR every poll_ms until it is set or timeout_us passes
+    bool waitReady(uint64_t timeout_us, int poll_ms = 1) {
+        uint64_t deadline = hal->nowUs() + timeout_us;
+        while (!conversionReady()) {
+            if (hal->nowUs() >= deadline) return false;
+            hal->sleepMs(poll_ms);
+        }
+        return true;
+    }
+
+    bool trigger() { return writeRegister(INA219_REG_CONFIG, config.configRegister()) != -1; }
+
+    float readBusVoltage() {
+        int value = readRegister(INA219_REG_BUS);
+        return value < 0 ? NAN : (value >> 3) * 0.004f;
+    }
+
+    float readShuntVoltage() {  //mV
+        int value = readRegister(INA219_REG_SHUNT);
+        return value < 0 ? NAN : static_cast<int16_t>(value) * 0.01f;
+    }
+
+    float readCurrent() {
+        int value = readRegister(INA219_REG_CURRENT);
+        return value < 0 ? NAN : static_cast<int16_t>(value) * config.current_lsb_ma;
+    }
+
+    float readPower() {     //mW, clears CNVR
+        int value = readRegister(INA219_REG_POWER);
+        return value < 0 ? NAN : value * 20.0f * config.current_lsb_ma;
+    }
+
+private:
+    Hal* hal;
+    int fd;
+    int address;
+    Ina219Config config;
+
+    static int swap16(int value) { return ((value & 0xFF) << 8) | ((value >> 8) & 0xFF); }
+
+    int readRegister(uint8_t reg) {     //0..0xFFFF, -1 on a bus error
+        int value = hal->i2cReadReg16(fd, reg);
+        return value < 0 ? -1 : swap16(value);
+    }
+
+    int writeRegister(uint8_t reg, uint16_t value) {
+        return hal->i2cWriteReg16(fd, reg, swap16(value));
+    }
+};
+
+class MuxBank {     //every TCA9548A on one bus, with the channel mask each was last set to
+public:
+    explicit MuxBank(Hal& hal, int bus = I2C_BUS) : hal(hal), bus(bus) {}
+
+    //fd of the mux at address, opened on first use
+    int open(int address) {
+        for (const Mux& m : muxes) {
+            if (m.address == address) return m.fd;
+        }
+        int fd = hal.i2cSetup(bus, address);
+        if (fd == -1) {
+            std::cerr << "Failed to initialize I2C communication.\n";
+            exit(1);
+        }
+        muxes.push_back({ address, fd, -1 });
+        return fd;
+    }
+
+    //enables one channel of one mux and disables every other mux on the bus
+    bool select(int address, int channel) {
+        if (channel < 0 || channel > 7) {
+            std::cerr << "Invalid channel number.\n";
+            exit(1);
+        }
+        bool ok = true;
+        for (Mux& m : muxes) {
+            int mask = (m.address == address) ? (1 << channel) : 0;
+            if (m.mask == mask) continue;
+            if (hal.i2cWrite(m.fd, mask) < 0) {
+                m.mask = -1;    //state unknown, write again next time
+                ok = false;
+            }
+            else {
+                m.mask = mask;
+            }
+        }
+        return ok;
+    }
+
+    int busNumber() const { return bus; }
+
+    void invalidate() {
+        for (Mux& m : muxes) m.mask = -1;
+    }
+
+private:
+    struct Mux {
+        int address;
+        int fd;
+        int mask;   //last written, -1 = unknown
+    };
+
+    Hal& hal;
+    int bus;
+    std::vector<Mux> muxes;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+* brief : memory-mapped telemetry journal - fixed-size ring file, replayed after reconnect
+*
+* Every upstream frame is appended to a ring inside one mmap'ed file before it
+* is sent, wrapped in a FRAME_RECORD envelope that carries its journal
+* sequence number. The server acknowledges sequence numbers; after a reconnect
+* everything above the last acknowledged one is sent again. Appending only
+* copies into the mapping, it never allocates or writes to the file
+* descriptor, and evicts the oldest records when the ring is full.
+*
+* file   : header (JOURNAL_HEADER_SIZE bytes) | record area (capacity bytes)
+* record : size u32 (8-byte aligned, JOURNAL_PAD bit = filler up to the wrap) | crc32 u32 | envelope
+* A record is written before the head moves past it, so after a crash the
+* journal ends at the last record whose CRC and sequence number check out.
+*/
+#ifndef BMS_JOURNAL_H
+#define BMS_JOURNAL_H
+
+#include "frame.h"
+
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_BYTES (16 * 1024 * 1024)    //record area, ~2 days of 3-cell telemetry at 1 Hz
+#define JOURNAL_HEADER_SIZE 4096
+#define JOURNAL_MAGIC "BMSJRNL1"
+#define JOURNAL_PAD 0x80000000u
+#define JOURNAL_RECORD_HEADER 8
+#define JOURNAL_REPLAY_RATE 100             //frames per second while catching up
+#define JOURNAL_INFLIGHT_BYTES (64 * 1024)  //replay pauses while the send queue holds more
+#define JOURNAL_SYNC_MS 1000                //msync period
+
+#define FRAME_RECORD 5          //envelope: journal seq u64 | inner frame
+#define FRAME_RECORD_ACK 6      //server -> device: highest journal seq received, u64
+#define RECORD_HEADER_SIZE 8
+
+struct JournalHeader {
+    char magic[8];
+    uint64_t capacity;
+    std::atomic<uint64_t> head;         //logical offsets, physical = offset % capacity
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> next_seq;
+    std::atomic<uint64_t> acked;        //highest sequence number the server confirmed
+};
+
+static_assert(sizeof(JournalHeader) <= JOURNAL_HEADER_SIZE, "journal header does not fit");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "journal header needs lock-free 64-bit atomics");
+
+inline uint32_t crc32(const uint8_t* data, size_t length) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+class Journal {
+public:
+    ~Journal() { close(); }
+
+    //creates the file or recovers an existing one; read_only maps it for inspection only
+    bool open(const std::string& path, size_t capacity = JOURNAL_BYTES, bool read_only = false) {
+        close();
+        readonly = read_only;
+        fd = ::open(path.c_str(), read_only ? O_RDONLY : (O_RDWR | O_CREAT | O_CLOEXEC), 0644);
+        if (fd == -1) return false;
+
+        struct stat st;
+        fstat(fd, &st);
+        bool fresh = st.st_size < JOURNAL_HEADER_SIZE;
+        if (!fresh) {
+            struct { char magic[8]; uint64_t capacity; } existing;
+            if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing)) return fail();
+            fresh = memcmp(existing.magic, JOURNAL_MAGIC, 8) != 0;
+            if (!fresh || read_only) capacity = existing.capacity;
+        }
+        if (read_only && fresh) return fail();
+        capacity &= ~static_cast<size_t>(7);
+        map_size = JOURNAL_HEADER_SIZE + capacity;
+        if (!read_only && static_cast<size_t>(st.st_size) != map_size && ftruncate(fd, map_size) != 0) return fail();
+        if (read_only && static_cast<size_t>(st.st_size) < map_size) return fail();
+
+        void* p = mmap(nullptr, map_size, read_only ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return fail();
+        base = static_cast<uint8_t*>(p);
+        header = reinterpret_cast<JournalHeader*>(base);
+        area = base + JOURNAL_HEADER_SIZE;
+        cap = capacity;
+
+        if (fresh) {
+            memset(base, 0, JOURNAL_HEADER_SIZE);
+            memcpy(header->magic, JOURNAL_MAGIC, 8);
+            header->capacity = cap;
+            header->next_seq = 1;
+        }
+        uint64_t last_seq = 0;
+        valid_head = recover(last_seq);
+        if (!readonly) {
+            header->head = valid_head;
+            if (last_seq >= header->next_seq) header->next_seq = last_seq + 1;
+        }
+        return true;
+    }
+
+    void close() {
+        if (base) munmap(base, map_size);
+        if (fd != -1) ::close(fd);
+        base = nullptr;
+        fd = -1;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    size_t capacity() const { return cap; }
+    size_t maxFrame() const { return cap / 4 - JOURNAL_RECORD_HEADER - PROTO_HEADER_SIZE - RECORD_HEADER_SIZE; }
+
+    //copies one frame into the ring; returns its sequence number, 0 when it does not fit
+    uint64_t append(const uint8_t* frame, size_t length) {
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t envelope = PROTO_HEADER_SIZE + RECORD_HEADER_SIZE + length;
+        size_t need = align8(JOURNAL_RECORD_HEADER + envelope);
+        if (readonly || need > cap / 4) return 0;
+
+        uint64_t head = header->head.load(std::memory_order_relaxed);
+        size_t phys = head % cap;
+        if (phys + need > cap) {    //no room before the wrap: fill it with a pad record
+            size_t pad = cap - phys;
+            makeRoom(head, pad);
+            put_u32(area + phys, static_cast<uint32_t>(pad) | JOURNAL_PAD);
+            head += pad;
+            header->head.store(head, std::memory_order_release);
+            phys = 0;
+        }
+        makeRoom(head, need);
+
+        uint64_t seq = header->next_seq.load(std::memory_order_relaxed);
+        uint8_t* r = area + phys;
+        uint8_t* e = r + JOURNAL_RECORD_HEADER;
+        uint8_t* p = put_frame_header(e, FRAME_RECORD, static_cast<uint32_t>(RECORD_HEADER_SIZE + length));
+        p = put_u64(p, seq);
+        memcpy(p, frame, length);
+        put_u32(r + 4, crc32(e, envelope));
+        put_u32(r, static_cast<uint32_t>(need));
+        header->next_seq.store(seq + 1, std::memory_order_relaxed);
+        header->head.store(head + need, std::memory_order_release);
+        appended.notify_all();
+        return seq;
+    }
+
+    //copies the envelope at cursor into out and moves cursor past it; 0 when there is nothing
+    //newer. A cursor that fell behind the tail (evicted records) jumps to the oldest record.
+    size_t read(uint64_t& cursor, uint8_t* out, size_t out_cap) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return readLocked(cursor, out, out_cap, header->head.load(std::memory_order_acquire));
+    }
+
+    //blocks until a record past cursor exists or timeout_ms passes
+    bool waitFor(uint64_t cursor, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mtx);
+        return appended.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                                 [&] { return header->head.load(std::memory_order_acquire) > cursor; });
+    }
+
+    bool pending(uint64_t cursor) const { return header->head.load(std::memory_order_acquire) > cursor; }
+
+    //offset of the oldest record the server has not acknowledged
+    uint64_t firstUnacked() {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t acked = header->acked.load(std::memory_order_relaxed);
+        uint64_t pos = header->tail.load(std::memory_order_relaxed);
+        uint64_t head = header->head.load(std::memory_order_relaxed);
+        while (pos < head) {
+            const uint8_t* r = area + pos % cap;
+            uint32_t size = get_u32(r);
+            if (!(size & JOURNAL_PAD) && recordSeq(r) > acked) break;
+            pos += size & ~JOURNAL_PAD;
+        }
+        return pos;
+    }
+
+    void ack(uint64_t seq) {
+        if (readonly) return;
+        uint64_t current = header->acked.load(std::memory_order_relaxed);
+        while (seq > current && !header->acked.compare_exchange_weak(current, seq)) {}
+    }
+
+    void sync() {
+        if (base && !readonly) msync(base, map_size, MS_SYNC);
+    }
+
+    uint64_t head() const { return readonly ? valid_head : header->head.load(); }
+    uint64_t tail() const { return header->tail.load(); }
+    uint64_t acked() const { return header->acked.load(); }
+    uint64_t nextSeq() const { return header->next_seq.load(); }
+    uint64_t lost() const { return lost_unacked; }  //unacknowledged records overwritten since open
+
+    //offline iteration, oldest first: fn(seq, inner frame, length)
+    template <typename F>
+    void forEach(F&& fn) {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t pos = header->tail.load();
+        uint64_t end = head();
+        while (pos < end) {
+            const uint8_t* r = area + pos % cap;
+            uint32_t size = get_u32(r);
+            if (!(size & JOURNAL_PAD)) {
+                const uint8_t* e = r + JOURNAL_RECORD_HEADER;
+                fn(recordSeq(r), e + PROTO_HEADER_SIZE + RECORD_HEADER_SIZE, get_u32(e + 4) - RECORD_HEADER_SIZE);
+            }
+            pos += size & ~JOURNAL_PAD;
+        }
+    }
+
+private:
+    int fd = -1;
+    bool readonly = false;
+    uint8_t* base = nullptr;
+    size_t map_size = 0;
+    JournalHeader* header = nullptr;
+    uint8_t* area = nullptr;
+    size_t cap = 0;
+    uint64_t valid_head = 0;
+    uint64_t lost_unacked = 0;
+    std::mutex mtx;
+    std::condition_variable appended;
+
+    static size_t align8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+    static uint64_t recordSeq(const uint8_t* r) { return get_u64(r + JOURNAL_RECORD_HEADER + PROTO_HEADER_SIZE); }
+
+    bool fail() {
+        close();
+        return false;
+    }
+
+    //evict from the tail until need bytes after head are free
+    void makeRoom(uint64_t head, size_t need) {
+        uint64_t tail = header->tail.load(std::memory_order_relaxed);
+        while (head + need - tail > cap) {
+            const uint8_t* r = area + tail % cap;
+            uint32_t size = get_u32(r);
+            if (!(size & JOURNAL_PAD) && recordSeq(r) > header->acked.load(std::memory_order_relaxed)) lost_unacked++;
+            tail += size & ~JOURNAL_PAD;
+            header->tail.store(tail, std::memory_order_release);
+        }
+    }
+
+    size_t readLocked(uint64_t& cursor, uint8_t* out, size_t out_cap, uint64_t head) {
+        uint64_t tail = header->tail.load(std::memory_order_acquire);
+        if (cursor < tail) cursor = tail;
+        while (cursor < head) {
+            const uint8_t* r = area + cursor % cap;
+            uint32_t size = get_u32(r);
+            cursor += size & ~JOURNAL_PAD;
+            if (size & JOURNAL_PAD) continue;
+            const uint8_t* e = r + JOURNAL_RECORD_HEADER;
+            size_t length = PROTO_HEADER_SIZE + get_u32(e + 4);
+            if (length > out_cap) continue;
+            memcpy(out, e, length);
+            return length;
+        }
+        return 0;
+    }
+
+    //walk from the tail and stop at the first record that does not check out
+    uint64_t recover(uint64_t& last_seq) {
+        uint64_t pos = header->tail.load();
+        uint64_t head = header->head.load();
+        uint64_t expect = 0;
+        last_seq = 0;
+        if (head < pos || head - pos > cap) return pos;
+        while (pos < head) {
+            size_t phys = pos % cap;
+            const uint8_t* r = area + phys;
+            uint32_t raw = get_u32(r);
+            size_t size = raw & ~JOURNAL_PAD;
+            if (size < 8 || (size & 7) || phys + size > cap || pos + size > head) break;
+            if (raw & JOURNAL_PAD) {
+                pos += size;
+                continue;
+            }
+            const uint8_t* e = r + JOURNAL_RECORD_HEADER;
+            if (size < JOURNAL_RECORD_HEADER + PROTO_HEADER_SIZE + RECORD_HEADER_SIZE) break;
+            size_t envelope = PROTO_HEADER_SIZE + get_u32(e + 4);
+            if (envelope > size - JOURNAL_RECORD_HEADER || e[3] != FRAME_RECORD) break;
+            if (crc32(e, envelope) != get_u32(r + 4)) break;
+            uint64_t seq = recordSeq(r);
+            if (expect && seq != expect) break;
+            expect = seq + 1;
+            last_seq = seq;
+            pos += size;
+        }
+        return pos;
+    }
+};
+
+#endif
@@ -0,0 +1,366 @@
+/*
+* brief : single-threaded non-blocking TCP client - epoll, reconnect with backoff, bounded send queue
+*
+* One loop owns the socket. Producers post whole messages from any thread and
+* return immediately; the loop writes them out as the socket accepts data and
+* hands received bytes to the receive handler. When the connection drops or
+* cannot be made the loop retries with exponential backoff while the queue
+* keeps the newest data:
+*   NET_COALESCE  a newer message replaces a queued, unsent one of the same kind
+*                 (telemetry snapshots: only the latest matters)
+*   NET_QUEUE     messages are kept in order; when the queue is over its byte
+*                 budget the oldest unsent messages are dropped and counted
+* A message is always sent whole on one connection; one cut off by a disconnect
+* is resent from its start after reconnecting.
+*/
+#ifndef BMS_NET_ENGINE_H
+#define BMS_NET_ENGINE_H
+
+#include "histogram.h"
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define NET_QUEUE_BYTES (256 * 1024)    //outbound budget while the server is slow or away
+#define NET_BACKOFF_MIN_MS 100
+#define NET_BACKOFF_MAX_MS 30000
+#define NET_KEEPALIVE_IDLE_S 10
+#define NET_KEEPALIVE_INTERVAL_S 5
+#define NET_KEEPALIVE_COUNT 3           //dead peer noticed after idle + interval * count
+#define NET_RECV_BUFFER 4096
+
+enum NetPolicy {
+    NET_COALESCE,
+    NET_QUEUE
+};
+
+struct NetOptions {
+    bool nodelay = true;
+    bool keepalive = true;
+    size_t queue_bytes = NET_QUEUE_BYTES;
+    int backoff_min_ms = NET_BACKOFF_MIN_MS;
+    int backoff_max_ms = NET_BACKOFF_MAX_MS;
+};
+
+class NetEngine {
+public:
+    using ReceiveHandler = std::function<void(const uint8_t* data, size_t length)>;
+    using ConnectHandler = std::function<void()>;
+
+    NetEngine(const std::string& ip, int port, NetOptions options = NetOptions())
+        : options(options), backoff_ms(options.backoff_min_ms) {
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address_ok = inet_pton(AF_INET, ip.c_str(), &address.sin_addr) == 1;
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakefd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+
+    ~NetEngine() {
+        closeSocket();
+        close(wakefd);
+        close(epfd);
+    }
+
+    bool valid() const { return address_ok && epfd != -1 && wakefd != -1; }
+
+    void onReceive(ReceiveHandler handler) { receive_handler = handler; }
+    void onConnect(ConnectHandler handler) { connect_handler = handler; }   //runs on the loop thread
+    void timeSends(Histogram* histogram) { send_ns = histogram; }           //ns per send() call, null = off
+
+    //any thread; kind groups messages for NET_COALESCE
+    void post(const void* data, size_t length, NetPolicy policy, int kind = 0) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        {
+            std::lock_guard<std::mutex> lock(queue_mtx);
+            bool merged = false;
+            if (policy == NET_COALESCE) {
+                for (size_t i = (sending ? 1 : 0); i < queue.size(); i++) {
+                    Message& m = queue[i];
+                    if (m.policy == NET_COALESCE && m.kind == kind) {
+                        queued_bytes += length - m.data.size();
+                        m.data.assign(bytes, bytes + length);
+                        coalesced++;
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+            if (!merged) {
+                queue.push_back({ std::vector<uint8_t>(bytes, bytes + length), policy, kind });
+                queued_bytes += length;
+            }
+            //over budget: drop the oldest messages that are not on the wire
+            size_t i = sending ? 1 : 0;
+            while (queued_bytes > options.queue_bytes && i < queue.size() - 1) {
+                queued_bytes -= queue[i].data.size();
+                queue.erase(queue.begin() + i);
+                dropped++;
+            }
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wakefd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    //drops every queued message of kind that is not on the wire yet
+    void discard(int kind) {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        for (size_t i = (sending ? 1 : 0); i < queue.size();) {
+            if (queue[i].kind == kind) {
+                queued_bytes -= queue[i].data.size();
+                queue.erase(queue.begin() + i);
+            }
+            else i++;
+        }
+    }
+
+    size_t queuedBytes() {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        return queued_bytes;
+    }
+
+    //the I/O loop; returns after stop()
+    void run() {
+        running = true;
+        while (running) {
+            if (fd == -1 && nowMs() >= next_connect_ms) startConnect();
+
+            int timeout = -1;
+            if (fd == -1) timeout = static_cast<int>(std::max<int64_t>(0, next_connect_ms - nowMs()));
+            updateInterest();
+
+            epoll_event events[4];
+            int n = epoll_wait(epfd, events, 4, timeout);
+            if (n < 0 && errno != EINTR) {
+                std::cerr << "epoll_wait: " << strerror(errno) << std::endl;
+                return;
+            }
+            for (int k = 0; k < n; k++) {
+                if (events[k].data.fd == wakefd) {
+                    uint64_t count;
+                    while (read(wakefd, &count, sizeof(count)) > 0) {}
+                    continue;
+                }
+                handleSocket(events[k].events);
+            }
+        }
+    }
+
+    void stop() {
+        running = false;
+        uint64_t one = 1;
+        ssize_t ignored = write(wakefd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    bool connected() const { return state == CONNECTED; }
+    uint64_t drops() const { return dropped; }
+    uint64_t coalesces() const { return coalesced; }
+    uint64_t reconnects() const { return connects > 0 ? connects - 1 : 0; }
+
+private:
+    struct Message {
+        std::vector<uint8_t> data;
+        NetPolicy policy;
+        int kind;
+    };
+
+    enum State { DISCONNECTED, CONNECTING, CONNECTED };
+
+    NetOptions options;
+    sockaddr_in address;
+    bool address_ok = false;
+    int epfd = -1;
+    int wakefd = -1;
+    int fd = -1;
+    std::atomic<State> state{DISCONNECTED};
+    uint32_t interest = 0;
+    std::atomic<bool> running{false};
+
+    int backoff_ms;
+    int64_t next_connect_ms = 0;
+
+    std::mutex queue_mtx;
+    std::deque<Message> queue;
+    size_t queued_bytes = 0;
+    size_t sent_offset = 0;     //bytes of queue.front() already written
+    bool sending = false;       //queue.front() is partly on the wire
+    std::atomic<uint64_t> dropped{0}, coalesced{0}, connects{0};
+
+    ReceiveHandler receive_handler;
+    ConnectHandler connect_handler;
+    Histogram* send_ns = nullptr;
+
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void startConnect() {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            scheduleReconnect("socket");
+            return;
+        }
+        int one = 1;
+        if (options.nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (options.keepalive) {
+            int idle = NET_KEEPALIVE_IDLE_S, interval = NET_KEEPALIVE_INTERVAL_S, count = NET_KEEPALIVE_COUNT;
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        }
+        interest = 0;
+        epoll_event ev{};
+        ev.events = EPOLLOUT;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        interest = EPOLLOUT;
+
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            onConnected();
+        }
+        else if (errno == EINPROGRESS) {
+            state = CONNECTING;
+        }
+        else {
+            scheduleReconnect("connect");
+        }
+    }
+
+    void onConnected() {
+        state = CONNECTED;
+        connects++;
+        backoff_ms = options.backoff_min_ms;
+        std::cout << "Connected to the server" << std::endl;
+        if (connect_handler) connect_handler();
+    }
+
+    void scheduleReconnect(const char* why) {
+        if (state != DISCONNECTED || fd != -1) {
+            std::cerr << (state == CONNECTED ? "Connection lost (" : "Connection failed (") << why << (errno ? std::string(": ") + strerror(errno) : "") << "), retrying in " << backoff_ms << " ms" << std::endl;
+        }
+        closeSocket();
+        next_connect_ms = nowMs() + backoff_ms;
+        backoff_ms = std::min(backoff_ms * 2, options.backoff_max_ms);
+    }
+
+    void closeSocket() {
+        if (fd != -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            fd = -1;
+        }
+        state = DISCONNECTED;
+        interest = 0;
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        sent_offset = 0;    //a cut off message goes again from its start
+        sending = false;
+    }
+
+    void updateInterest() {
+        if (fd == -1) return;
+        uint32_t want = EPOLLIN | EPOLLRDHUP;
+        if (state == CONNECTING) want = EPOLLOUT;
+        else {
+            std::lock_guard<std::mutex> lock(queue_mtx);
+            if (!queue.empty()) want |= EPOLLOUT;
+        }
+        if (want != interest) {
+            epoll_event ev{};
+            ev.events = want;
+            ev.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+            interest = want;
+        }
+    }
+
+    void handleSocket(uint32_t events) {
+        if (state == CONNECTING) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                errno = error;
+                scheduleReconnect("connect");
+                return;
+            }
+            onConnected();
+            return;
+        }
+        if (events & EPOLLIN) {
+            uint8_t buffer[NET_RECV_BUFFER];
+            while (true) {
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    if (receive_handler) receive_handler(buffer, n);
+                    continue;
+                }
+                if (n == 0) {
+                    errno = 0;
+                    scheduleReconnect("closed by server");
+                    return;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                scheduleReconnect("recv");
+                return;
+            }
+        }
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            errno = 0;
+            scheduleReconnect("hangup");
+            return;
+        }
+        if (events & EPOLLOUT) flush();
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(queue_mtx);
+        while (!queue.empty()) {
+            Message& m = queue.front();
+            auto start = send_ns ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            ssize_t n = send(fd, m.data.data() + sent_offset, m.data.size() - sent_offset, MSG_NOSIGNAL);
+            if (send_ns) send_ns->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR) continue;
+                lock.unlock();
+                scheduleReconnect("send");
+                return;
+            }
+            sent_offset += n;
+            sending = sent_offset < m.data.size();
+            if (sending) return;
+            queued_bytes -= m.data.size();
+            queue.pop_front();
+            sent_offset = 0;
+        }
+    }
+};
+
+#endif
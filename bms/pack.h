@@ -0,0 +1,308 @@
+/*
+* brief : n-cell charge control engine
+*
+* Per-cell control state is kept as one array per field (structure of arrays),
+* sized at runtime from the cell topology, and a single control step walks the
+* cells in order. Telemetry goes to a flat bat_data array, BAT_DATA_STRIDE
+* floats per cell.
+*
+* SoC comes from a per-cell SocEstimator fed with every current/voltage sample,
+* so charging is not interrupted each tick; every rest_interval_us a cell pauses
+* charging just long enough for one open circuit reading.
+*
+* Sensors go through the INA219 driver and the mux bank in ina219.h: a cell
+* costs one mux write (skipped when the channel is already selected) and two
+* register reads. A control step first reads the whole pack through
+* Acquisition (acquisition.h), one worker per i2c bus, then regulates the
+* cells in order from those samples. When the driver tracks conversion ready,
+* a reading that is not a new conversion is not fed to the filters and the
+* SoC estimator again.
+*
+* The duty cycle of a charging cell comes from its ChargeController
+* (charge_controller.h), a CC-CV PI loop pair with feedforward fed with the raw
+* samples; the published duty_cycle is that duty rounded to whole percent,
+* the PWM channel gets it at its full resolution (pwm_range).
+*
+* setTrace() logs every sweep (trace.h); in replay mode the sweep takes the
+* samples inject() put in place instead of reading the buses, and everything
+* after it runs as it does on the rig.
+*
+* With a SafetySupervisor set (supervisor.h), every sweep's raw samples are
+* handed to it before the cells are regulated, and a cell it inhibits stops
+* charging and gets no duty written.
+*
+* Remote settings (mode ceiling, current and voltage setpoints) are atomics so
+* the command path can change them while the control step runs; a mode
+* override can only slow a cell down, the temperature and SoC stops still win.
+*/
+#ifndef BMS_PACK_H
+#define BMS_PACK_H
+
+#include "hal.h"
+#include "acquisition.h"
+#include "soc_estimator.h"
+#include "ring_filter.h"
+#include "charge_controller.h"
+#include "supervisor.h"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <atomic>
+
+#define MAX_CRITICAL_TEMPERATURE 60
+#define MAX_SAFE_TEMPERATURE 50
+#define TARGET_VOLTAGE 4.2
+#define MAX_CHARGE_CURRENT_MA 2000  //setpoint limit
+#define MIN_TARGET_VOLTAGE 3.6      //CV setpoint range
+#define FAST_CHARGE_CURRENT_MA 1000
+#define STANDARD_CHARGE_CURRENT_MA 500
+
+#define CHARGE_PERIOD_MS 20     //control_charging sweep period
+#define REST_INTERVAL_MS 60000  //open circuit reading per cell, 0 = never pause
+#define REST_TIMEOUT_MS 500     //give up waiting for the current to settle
+
+#define CURRENT_WINDOW 10   //moving average length, samples
+#define VOLTAGE_WINDOW 10
+
+//bat_data layout, per cell
+#define BAT_DATA_STRIDE 5
+#define BAT_VOLTAGE 0
+#define BAT_CURRENT 1
+#define BAT_SOC 2
+#define BAT_DUTY_CYCLE 3
+#define BAT_CHARGE_MODE 4
+
+//charging mode
+enum ChargingMode {
+    STOP_CHARGING,
+    STANDARD_CHARGING,
+    FAST_CHARGING
+};
+
+class Pack {
+public:
+    uint64_t rest_interval_us = REST_INTERVAL_MS * 1000ULL;
+    int pwm_range = PWM_RANGE;  //charge pwm channel steps; duty_cycle (%) is scaled to it
+    bool verbose = true;        //a console line per cell per step
+
+    Pack(Hal& hal, const std::vector<CellPorts>& ports,
+         size_t current_len = CURRENT_WINDOW, size_t voltage_len = VOLTAGE_WINDOW,
+         const Ina219Config& sensor_config = Ina219Config())
+        : duty_cycle(ports.size(), 0), soc(ports.size(), 0), charge_mode(ports.size(), STOP_CHARGING),
+          estimator(ports.size()), controller(ports.size()), sample_us(ports.size(), 0), sample_voltage(ports.size(), NAN), sample_current(ports.size(), NAN),
+          hal(hal), ports(ports), acquisition(hal, ports, sensor_config),
+          current(ports.size(), RingFilter<float>(current_len)),
+          voltage(ports.size(), RingFilter<float>(voltage_len)),
+          mode_override(ports.size()), current_setpoint(ports.size()), voltage_setpoint(ports.size()),
+          resting(ports.size(), 0), rest_start_us(ports.size(), 0), next_rest_us(ports.size(), 0) {
+        for (size_t i = 0; i < ports.size(); i++) {
+            mode_override[i] = MODE_AUTO;
+            current_setpoint[i] = 0.0f;
+            voltage_setpoint[i] = 0.0f;
+        }
+    }
+
+    static constexpr int MODE_AUTO = -1;
+
+    //remote settings, safe to call from any thread; false when the value is out of range
+    bool overrideMode(size_t i, int mode) {
+        if (mode != MODE_AUTO && (mode < STOP_CHARGING || mode > FAST_CHARGING)) return false;
+        mode_override[i] = mode;
+        return true;
+    }
+
+    bool setCurrentSetpoint(size_t i, float ma) {     //0 = mode default
+        if (!(ma >= 0.0f && ma <= MAX_CHARGE_CURRENT_MA)) return false;
+        current_setpoint[i] = ma;
+        return true;
+    }
+
+    bool setVoltageSetpoint(size_t i, float volts) {  //0 = TARGET_VOLTAGE
+        if (!(volts == 0.0f || (volts >= MIN_TARGET_VOLTAGE && volts <= TARGET_VOLTAGE))) return false;
+        voltage_setpoint[i] = volts;
+        return true;
+    }
+
+    int modeOverride(size_t i) const { return mode_override[i]; }
+    float currentSetpoint(size_t i) const { return current_setpoint[i]; }
+    float voltageSetpoint(size_t i) const { return voltage_setpoint[i]; }
+
+    void setChemistry(const SocCurve& curve) {
+        for (SocEstimator& e : estimator) e = SocEstimator(curve);
+    }
+
+    void setControllerConfig(const ChargeControllerConfig& config) {
+        for (ChargeController& c : controller) c = ChargeController(config);
+    }
+
+    size_t size() const { return ports.size(); }
+    size_t busCount() const { return acquisition.busCount(); }
+    uint64_t stepUs() const { return acquisition.sweepUs(); }  //time of the last control step
+
+    void setTrace(TraceWriter* writer) { acquisition.setTrace(writer); }
+    void setReadiness(Readiness* r, const std::vector<size_t>& signals) { acquisition.setReadiness(r, signals); }
+    void setSupervisor(SafetySupervisor* s) { supervisor = s; }
+    void replayMode() { acquisition.replayMode(); }
+    void inject(size_t i, const CellSample& sample) { acquisition.inject(i, sample); }
+
+    //one pass over every cell; temperature[i] and relay_state[i] belong to cell i
+    void controlStep(const float temperature[], const int relay_state[], float bat_data[]) {
+        acquisition.sweep();
+        if (supervisor) {
+            for (size_t i = 0; i < ports.size(); i++) {
+                const CellSample& s = acquisition.sample(i);
+                supervisor->sample(i, s.reading.voltage, s.reading.current, s.timestamp_us);
+            }
+        }
+        for (size_t i = 0; i < ports.size(); i++) {
+            chargeCell(i, temperature[i], relay_state[i], bat_data + i * BAT_DATA_STRIDE);
+        }
+    }
+
+    //regulates cell i from its sample of the last sweep; the step's time is the end of that sweep
+    void chargeCell(size_t i, float temperature, int relay, float out[]) {
+        int& duty = duty_cycle[i];
+        uint64_t now = acquisition.sweepUs();
+
+        const CellSample& sample = acquisition.sample(i);
+        const Ina219Reading& reading = sample.reading;
+        float amph = reading.current;
+        float volt = reading.voltage;
+        sample_us[i] = sample.timestamp_us;
+        sample_voltage[i] = volt;
+        sample_current[i] = amph;
+        if (reading.ready) {
+            estimator[i].update(sample.timestamp_us, amph, volt);
+            if (estimator[i].valid()) soc[i] = static_cast<int>(estimator[i].percent());
+        }
+
+        if (resting[i]) {   //charging paused for an open circuit reading
+            bool done = estimator[i].lastRestUs() >= rest_start_us[i] || now - rest_start_us[i] >= REST_TIMEOUT_MS * 1000ULL;
+            if (!done && relay != 1) return;
+            resting[i] = 0;
+            next_rest_us[i] = now + rest_interval_us;
+        }
+        else if (next_rest_us[i] == 0) {    //first visit: spread the pauses over the interval
+            next_rest_us[i] = now + rest_interval_us * (i + 1) / ports.size();
+        }
+
+        float avg_current = reading.ready ? averageCurrent(i, amph) : current[i].average(0.0f);
+        float avg_voltage = reading.ready ? averageVoltage(i, volt) : voltage[i].average(0.0f);
+
+        if (relay == 1) {    //stop charging while discharging
+            charge_mode[i] = STOP_CHARGING;
+            duty = 0;
+            controller[i].reset();
+            writeDuty(i, duty);
+            publish(i, avg_voltage, avg_current, out);
+            return;
+        }
+
+        //set charging mode by temperature
+        if (supervisor && supervisor->inhibited(i)) {  //hard limit tripped
+            charge_mode[i] = STOP_CHARGING;
+        }
+        else if (!(temperature <= MAX_CRITICAL_TEMPERATURE)) {   //over 60'C (or no fresh reading) stop charging
+            charge_mode[i] = STOP_CHARGING;
+        }
+        else if (soc[i] == 100) { charge_mode[i] = STOP_CHARGING; }
+        else if (!voltage[i].valid()) {     //no bus voltage in the whole window: sensor dropout
+            charge_mode[i] = STOP_CHARGING;
+        }
+        else if (temperature > MAX_SAFE_TEMPERATURE) {  //over 50'C slow down charging
+            charge_mode[i] = STANDARD_CHARGING;
+        }
+        else {
+            charge_mode[i] = FAST_CHARGING;
+        }
+        int ceiling = mode_override[i];
+        if (ceiling != MODE_AUTO && ceiling < charge_mode[i]) charge_mode[i] = ceiling;
+        out[BAT_CHARGE_MODE] = charge_mode[i];
+
+        if (charge_mode[i] == STOP_CHARGING) {
+            duty = 0;
+            controller[i].reset();
+            writeDuty(i, duty);
+            publish(i, avg_voltage, avg_current, out);
+            return;
+        }
+
+        publish(i, avg_voltage, avg_current, out);
+
+        if (rest_interval_us && now >= next_rest_us[i]) {
+            writeDuty(i, 0);    //pause charging for an open circuit reading; the controller resumes where it was
+            resting[i] = 1;
+            rest_start_us[i] = now;
+            return;
+        }
+
+        if (!reading.ready) return;     //no new conversion: hold the duty cycle
+
+        float setpoint = current_setpoint[i];
+        float target_current = (charge_mode[i] == FAST_CHARGING) ? FAST_CHARGE_CURRENT_MA : STANDARD_CHARGE_CURRENT_MA;
+        if (setpoint > 0.0f) target_current = (charge_mode[i] == FAST_CHARGING) ? setpoint : std::min<float>(setpoint, STANDARD_CHARGE_CURRENT_MA);
+        float cv_setpoint = voltage_setpoint[i];
+        float target_voltage = cv_setpoint > 0.0f ? cv_setpoint : TARGET_VOLTAGE;
+        float percent = controller[i].update(sample.timestamp_us, target_current, target_voltage, amph, volt);
+        duty = static_cast<int>(std::lround(percent));
+        writeDuty(i, percent);
+    }
+
+    //per-cell state
+    std::vector<int> duty_cycle;
+    std::vector<int> soc;
+    std::vector<int> charge_mode;
+    std::vector<SocEstimator> estimator;
+    std::vector<ChargeController> controller;
+    std::vector<uint64_t> sample_us;        //last raw reading, before filtering
+    std::vector<float> sample_voltage;
+    std::vector<float> sample_current;
+
+private:
+    Hal& hal;
+    std::vector<CellPorts> ports;
+    Acquisition acquisition;
+    std::vector<RingFilter<float>> current;
+    std::vector<RingFilter<float>> voltage;
+    std::vector<std::atomic<int>> mode_override;
+    std::vector<std::atomic<float>> current_setpoint;
+    std::vector<std::atomic<float>> voltage_setpoint;
+    std::vector<uint8_t> resting;
+    std::vector<uint64_t> rest_start_us;
+    std::vector<uint64_t> next_rest_us;
+    SafetySupervisor* supervisor = nullptr;
+
+    //samples below threshold keep their slot but stay out of the average;
+    //an empty average reads 0 instead of NaN
+    float averageCurrent(size_t i, float sample) {
+        current[i].push(sample, std::abs(sample) >= duty_cycle[i]);
+        return current[i].average(0.0f);
+    }
+
+    float averageVoltage(size_t i, float sample) {
+        voltage[i].push(sample, sample >= 0.1);
+        return voltage[i].average(0.0f);
+    }
+
+    void writeDuty(size_t i, float percent) {
+        if (supervisor && supervisor->inhibited(i)) percent = 0.0f;
+        hal.pwmWrite(ports[i].pwm_pin, static_cast<int>(std::lround(percent * pwm_range / 100.0f)));
+    }
+
+    void publish(size_t i, float avg_voltage, float avg_current, float out[]) {
+        if (verbose) {
+            std::cout << std::fixed;
+            std::cout.precision(2);
+            std::cout << "Battery(" << i + 1 << ") Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc[i] << "%, duty cycle: " << duty_cycle[i] << "%" << std::endl;
+        }
+        out[BAT_VOLTAGE] = avg_voltage;
+        out[BAT_CURRENT] = avg_current;
+        out[BAT_SOC] = soc[i];
+        out[BAT_DUTY_CYCLE] = duty_cycle[i];
+        out[BAT_CHARGE_MODE] = charge_mode[i];
+    }
+};
+
+#endif
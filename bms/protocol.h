@@ -0,0 +1,121 @@
+/*
+* brief : telemetry wire formats - binary frames and the legacy JSON object
+*
+* Binary frames are length prefixed, versioned and little-endian:
+*
+*   frame     : magic 'B' 'M' | version u8 | type u8 | payload length u32 | payload
+*   telemetry : seq u32 | timestamp_us u64 | cells u16 | record size u8 | resister fan pwm u8
+*               then one record per cell:
+*               voltage mV u16 | current 0.01mA i32 | temperature 0.01'C i16 | resister temp 0.01'C i16 |
+*               soc u8 | duty cycle u8 | charge mode u8 | fan pwm u8 | flags u8 | reserved u8
+*
+*   samples   : seq u32 | base timestamp_us u64 | count u32 | record size u8 | reserved 3
+*               then one record per captured sample (bms/capture.h):
+*               offset from base us u32 | cell u16 | voltage mV u16 | current 0.01mA i32 |
+*               duty cycle u8 | charge mode u8 | soc u8 | flags u8
+*
+*   command   : count u16 | record size u8 | reserved u8, then per command (server -> device):
+*               seq u32 | cell u16 (CELL_ALL = every cell) | type u8 | reserved u8 | value i32
+*   ack       : same layout (device -> server), one per command and cell, the
+*               reserved byte carries the status and value the state actually applied
+*               status: 0 ok, 1 bad cell, 2 bad type, 3 bad value, 4 refused (a relay
+*               on while the safety supervisor holds it open)
+*
+* A value that is NaN or out of range is sent as 0 with its CELL_*_INVALID flag
+* set. Decoders skip record bytes they do not know, so later versions can append
+* fields by growing the record size. A 3-cell telemetry frame is 72 bytes against
+* ~560 bytes of JSON.
+*
+* The constants, the command, sample and decoding codecs and FrameReader live
+* in frame.h, which needs no control code; this header adds the encoders of
+* the live TelemetryFrame.
+*/
+#ifndef BMS_PROTOCOL_H
+#define BMS_PROTOCOL_H
+
+#include "frame.h"
+#include "telemetry.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cmath>
+
+enum TelemetryFormat {
+    TELEMETRY_JSON,     //legacy object, one per send, no framing
+    TELEMETRY_BINARY
+};
+
+//bytes written, 0 when cap is too small
+inline size_t encode_telemetry(const TelemetryFrame& frame, uint32_t seq, uint64_t now_us, uint8_t* out, size_t cap) {
+    size_t cells = frame.cells();
+    size_t size = telemetry_frame_size(cells);
+    if (size > cap || cells > 0xFFFF) return 0;
+
+    uint8_t* p = put_frame_header(out, FRAME_TELEMETRY, static_cast<uint32_t>(size - PROTO_HEADER_SIZE));
+    p = put_u32(p, seq);
+    p = put_u64(p, now_us);
+    p = put_u16(p, static_cast<uint16_t>(cells));
+    p = put_u8(p, TELEMETRY_RECORD_SIZE);
+    p = put_u8(p, clamp_u8(frame.fan_pwm[cells]));
+
+    for (size_t i = 0; i < cells; i++) {
+        const float* bat = frame.bat_data.data() + i * BAT_DATA_STRIDE;
+        uint8_t flags = frame.relay_state[i] == 1 ? CELL_RELAY_ON : 0;
+        long voltage, current, temp, resister_temp;
+        if (!scale_fixed(bat[BAT_VOLTAGE], 1000.0f, 0, 0xFFFF, voltage)) flags |= CELL_VOLTAGE_INVALID;
+        if (!scale_fixed(bat[BAT_CURRENT], 100.0f, INT32_MIN, INT32_MAX, current)) flags |= CELL_CURRENT_INVALID;
+        if (!scale_fixed(frame.temperature[i], 100.0f, INT16_MIN, INT16_MAX, temp)) flags |= CELL_TEMP_INVALID;
+        if (!scale_fixed(frame.temperature[cells + i], 100.0f, INT16_MIN, INT16_MAX, resister_temp)) flags |= CELL_RESISTER_TEMP_INVALID;
+        if (frame.cells_version == 0) flags |= CELL_NO_DATA;
+
+        p = put_u16(p, static_cast<uint16_t>(voltage));
+        p = put_u32(p, static_cast<uint32_t>(static_cast<int32_t>(current)));
+        p = put_u16(p, static_cast<uint16_t>(static_cast<int16_t>(temp)));
+        p = put_u16(p, static_cast<uint16_t>(static_cast<int16_t>(resister_temp)));
+        p = put_u8(p, clamp_u8(bat[BAT_SOC]));
+        p = put_u8(p, clamp_u8(bat[BAT_DUTY_CYCLE]));
+        p = put_u8(p, clamp_u8(bat[BAT_CHARGE_MODE]));
+        p = put_u8(p, clamp_u8(frame.fan_pwm[i]));
+        p = put_u8(p, flags);
+        p = put_u8(p, 0);
+    }
+    return size;
+}
+
+//legacy JSON: "nan" is sent as null so the object always parses
+static inline int json_number(char* out, size_t cap, float v) {
+    return std::isnan(v) ? snprintf(out, cap, "null") : snprintf(out, cap, "%.2f", v);
+}
+
+//bytes written (without the terminator), 0 when cap is too small
+inline size_t encode_json(const TelemetryFrame& frame, char* out, size_t cap) {
+    size_t cells = frame.cells();
+    size_t length = 0;
+    char voltage[16], current[16], temp[16];
+    auto append = [&](int written) {
+        if (written < 0 || static_cast<size_t>(written) >= cap - length) return false;
+        length += written;
+        return true;
+    };
+
+    for (size_t i = 0; i < cells; i++) {
+        const float* bat = frame.bat_data.data() + i * BAT_DATA_STRIDE;
+        int n = (int)i + 1;
+        json_number(voltage, sizeof(voltage), bat[BAT_VOLTAGE]);
+        json_number(current, sizeof(current), bat[BAT_CURRENT]);
+        json_number(temp, sizeof(temp), frame.temperature[i]);
+        if (!append(snprintf(out + length, cap - length,
+            "%s\"voltage_%d\": %s, \"current_%d\": %s, \"soc_%d\": %d, \"temperature_%d\": %s, \"charge_mode_%d\": %d, \"relay_state_%d\": %d, \"fan_pwm_%d\": %d, \"duty_cycle%d\": %d, ",
+            i == 0 ? "{" : "",
+            n, voltage, n, current, n, (int)bat[BAT_SOC], n, temp, n, (int)bat[BAT_CHARGE_MODE], n, frame.relay_state[i], n, frame.fan_pwm[i], n, (int)bat[BAT_DUTY_CYCLE]))) return 0;
+    }
+    for (size_t i = 0; i < cells; i++) {
+        json_number(temp, sizeof(temp), frame.temperature[cells + i]);
+        if (!append(snprintf(out + length, cap - length, "\"resister_temp_%d\": %s, ", (int)i + 1, temp))) return 0;
+    }
+    if (!append(snprintf(out + length, cap - length, "\"resister_fan_pwm\": %d}", frame.fan_pwm[cells]))) return 0;
+    return length;
+}
+
+#endif
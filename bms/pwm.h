@@ -0,0 +1,181 @@
+/*
+* brief : PWM outputs - Pi hardware PWM where the pin has a channel, one software scheduler for the rest
+*
+* wiringPi's softPwm starts a thread per pin that wakes every 100 us, and is
+* fixed at 100 steps per period. SoftPwm drives every software pin from one
+* thread that sleeps until the next edge of any channel (clock_nanosleep
+* TIMER_ABSTIME): a channel costs a wake-up at the start of its period and
+* one at its falling edge, and fully on or off channels cost no edges at all.
+* Periods are aligned to one timeline, so channels of the same frequency
+* share their period wake-up. Each channel has its own frequency and range;
+* a new value takes effect at the start of the channel's next period, so no
+* period is cut short.
+*
+* The BCM2835 PWM block has two channels, on wiringPi pins 1 and 26 (PWM0)
+* and 23 and 24 (PWM1), fed from 19.2 MHz through one shared divisor; through
+* wiringPi both channels also share one range. WiringPiHal gives a pin the
+* hardware channel when its frequency and range can be reached and match
+* what the block is already set to, and hands it to SoftPwm otherwise.
+*/
+#ifndef BMS_PWM_H
+#define BMS_PWM_H
+
+#include "histogram.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <cerrno>
+
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define PWM_FREQUENCY_HZ 100    //default channel, as softPwm at range 100
+#define PWM_RANGE 100
+#define PWM_MAX_CHANNELS 32     //software channels
+#define PWM_SOFT_PRIORITY 90    //SCHED_FIFO when permitted, as softPwm
+#define PWM_CLOCK_HZ 19200000   //hardware PWM clock before the divisor
+#define PWM_DIVISOR_MIN 2
+#define PWM_DIVISOR_MAX 4095
+
+struct PwmConfig {  //one channel
+    int frequency_hz = PWM_FREQUENCY_HZ;
+    int range = PWM_RANGE;      //steps per period, value 0..range
+};
+
+inline bool pwm_hardware_pin(int pin) { return pin == 1 || pin == 23 || pin == 24 || pin == 26; }  //wiringPi numbering
+
+//clock divisor for frequency_hz at range steps, 0 when it is out of reach
+inline int pwm_hardware_divisor(int frequency_hz, int range) {
+    if (frequency_hz <= 0 || range < 2) return 0;
+    long divisor = std::lround(static_cast<double>(PWM_CLOCK_HZ) / (static_cast<double>(frequency_hz) * range));
+    return divisor >= PWM_DIVISOR_MIN && divisor <= PWM_DIVISOR_MAX ? static_cast<int>(divisor) : 0;
+}
+
+class SoftPwm {
+public:
+    using PinWriter = void (*)(int pin, int level);
+
+    explicit SoftPwm(PinWriter writer) : writer(writer) {}
+    ~SoftPwm() { stop(); }
+
+    //starts the scheduler on the first channel; false when full or the setting is invalid
+    bool add(int pin, int frequency_hz, int range, int initial) {
+        std::lock_guard<std::mutex> lock(add_mtx);
+        int n = count.load(std::memory_order_relaxed);
+        if (n == PWM_MAX_CHANNELS || frequency_hz <= 0 || frequency_hz > 10000 || range < 1) return false;
+        Channel& ch = channels[n];
+        ch.pin = pin;
+        ch.range = range;
+        ch.period_us = 1000000 / frequency_hz;
+        ch.value.store(clamp(initial, range), std::memory_order_relaxed);
+        count.store(n + 1, std::memory_order_release);
+        if (!running.exchange(true)) thread = std::thread(&SoftPwm::run, this);
+        return true;
+    }
+
+    //0..range, from any thread; false for a pin that was not added
+    bool write(int pin, int value) {
+        int n = count.load(std::memory_order_acquire);
+        for (int c = 0; c < n; c++) {
+            if (channels[c].pin != pin) continue;
+            channels[c].value.store(clamp(value, channels[c].range), std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    bool has(int pin) const {
+        int n = count.load(std::memory_order_acquire);
+        for (int c = 0; c < n; c++) {
+            if (channels[c].pin == pin) return true;
+        }
+        return false;
+    }
+
+    int size() const { return count.load(std::memory_order_acquire); }
+
+    //every pin is left low
+    void stop() {
+        if (!running.exchange(false)) return;
+        thread.join();
+        int n = count.load(std::memory_order_acquire);
+        for (int c = 0; c < n; c++) writer(channels[c].pin, 0);
+    }
+
+    uint64_t wakeups() const { return wakeup_count.load(std::memory_order_relaxed); }
+    const Histogram& edgeLateness() const { return lateness; }     //us behind the scheduled edge
+
+private:
+    struct Channel {
+        int pin = -1;
+        int range = PWM_RANGE;
+        uint64_t period_us = 10000;
+        std::atomic<int> value{0};
+        //scheduler thread only
+        uint64_t period_end = 0;
+        uint64_t off_at = 0;
+        int level = -1;     //-1 = not driven yet
+    };
+
+    PinWriter writer;
+    Channel channels[PWM_MAX_CHANNELS];
+    std::atomic<int> count{0};
+    std::mutex add_mtx;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::atomic<uint64_t> wakeup_count{0};
+    Histogram lateness;
+
+    static int clamp(int value, int range) { return value < 0 ? 0 : value > range ? range : value; }
+
+    static uint64_t now_us() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    void drive(Channel& ch, int level) {
+        if (ch.level == level) return;
+        writer(ch.pin, level);
+        ch.level = level;
+    }
+
+    void run() {
+        sched_param param{};
+        param.sched_priority = PWM_SOFT_PRIORITY;
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);     //needs root, like softPwm; best effort
+        while (running.load(std::memory_order_relaxed)) {
+            uint64_t now = now_us();
+            uint64_t next = now + 100000;
+            int n = count.load(std::memory_order_acquire);
+            for (int c = 0; c < n; c++) {
+                Channel& ch = channels[c];
+                if (now >= ch.period_end) {     //next period on the shared timeline, missed ones skipped
+                    ch.period_end = (now / ch.period_us + 1) * ch.period_us;
+                    uint64_t start = ch.period_end - ch.period_us;
+                    int value = ch.value.load(std::memory_order_relaxed);
+                    ch.off_at = start + ch.period_us * value / ch.range;
+                    if (ch.level >= 0) lateness.record(now - start);
+                    drive(ch, value > 0);
+                }
+                if (ch.level == 1 && ch.off_at < ch.period_end && now >= ch.off_at) {
+                    lateness.record(now - ch.off_at);
+                    drive(ch, 0);
+                }
+                uint64_t edge = (ch.level == 1 && ch.off_at < ch.period_end) ? ch.off_at : ch.period_end;
+                if (edge < next) next = edge;
+            }
+            timespec ts;
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+            wakeup_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif
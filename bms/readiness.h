@@ -0,0 +1,94 @@
+/*
+* brief : startup readiness - subsystems signal their first valid sample, dependent tasks wait for their inputs
+*
+* A signal goes up once, raised by whatever produces the input (the first good
+* reading of a DS18B20, the first INA219 answer of a cell, the first published
+* telemetry section), and stays up. wait() holds a starting task until every
+* signal it needs is up or a deadline on the Hal clock has passed, so a task
+* starts one conversion cycle after boot instead of after a fixed sleep. On a
+* timeout missing() names the inputs still down, so a dead sensor is reported
+* by name at startup instead of showing up later as a NaN.
+*/
+#ifndef BMS_READINESS_H
+#define BMS_READINESS_H
+
+#include "hal.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+#define READY_TIMEOUT_MS 10000  //longest a task waits for its inputs
+#define READY_POLL_MS 10        //wait() rechecks the Hal clock, which may run faster than real time (simulation)
+
+class Readiness {   //any thread
+public:
+    explicit Readiness(Hal& hal) : hal(hal) {}
+
+    //a new signal, down; returns its index
+    size_t add(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        names.push_back(name);
+        up_us.push_back(0);
+        return names.size() - 1;
+    }
+
+    //the input exists; later calls do nothing
+    void signal(size_t i) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (up_us[i]) return;
+            up_us[i] = std::max<uint64_t>(1, hal.nowUs());
+        }
+        cv.notify_all();
+    }
+
+    //true once every signal of which is up, false when the Hal clock reaches deadline_us first
+    bool wait(const std::vector<size_t>& which, uint64_t deadline_us) {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!allUp(which)) {
+            if (hal.nowUs() >= deadline_us) return false;
+            cv.wait_for(lock, std::chrono::milliseconds(READY_POLL_MS));
+        }
+        return true;
+    }
+
+    std::vector<std::string> missing(const std::vector<size_t>& which) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<std::string> out;
+        for (size_t i : which) {
+            if (!up_us[i]) out.push_back(names[i]);
+        }
+        return out;
+    }
+
+    //when the last signal of which went up, 0 if one is still down
+    uint64_t upUs(const std::vector<size_t>& which) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t last = 0;
+        for (size_t i : which) {
+            if (!up_us[i]) return 0;
+            last = std::max(last, up_us[i]);
+        }
+        return last;
+    }
+
+private:
+    Hal& hal;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::string> names;
+    std::vector<uint64_t> up_us;    //0 = down
+
+    bool allUp(const std::vector<size_t>& which) const {
+        for (size_t i : which) {
+            if (!up_us[i]) return false;
+        }
+        return true;
+    }
+};
+
+#endif
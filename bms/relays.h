@@ -0,0 +1,62 @@
+/*
+* brief : discharge relays - one lock around the safety hold check, the pin write and the relay telemetry
+*
+* Three threads switch the relays: the command handler (the operator), the
+* charging task (the balancer) and the safety supervisor. Each switch takes
+* relay_mtx for the whole of it, so the telemetry relay state, which the
+* supervisor reads to decide whether a cell is discharging, never disagrees
+* with the pin once a switch is done.
+*
+* set() refuses to switch a relay on while the supervisor holds it open.
+* open() is the supervisor's path: it writes the pin low on every call and
+* reports whether the relay was on. The supervisor raises its hold before it
+* calls open(), so an on that passed the hold check just before is undone
+* under the same lock, and every later one is refused.
+*/
+#ifndef BMS_RELAYS_H
+#define BMS_RELAYS_H
+
+#include "hal.h"
+#include "telemetry.h"
+#include "supervisor.h"
+
+#include <vector>
+#include <mutex>
+
+class RelayBank {   //any thread
+public:
+    RelayBank(Hal& hal, const std::vector<CellPorts>& ports, Telemetry& telemetry) : hal(hal), ports(ports), telemetry(telemetry) {}
+
+    //refuses every relay it holds open; set before the supervisor task starts
+    void setSupervisor(const SafetySupervisor* s) { supervisor = s; }
+
+    size_t size() const { return ports.size(); }
+    int state(size_t cell) const { return telemetry.relay(cell); }
+
+    //false when the relay was left off: on while the supervisor holds it open
+    bool set(size_t cell, bool on) {
+        std::lock_guard<std::mutex> lock(relay_mtx);
+        if (on && supervisor && supervisor->relayInhibited(cell)) return false;
+        hal.digitalWrite(ports[cell].relay_pin, on ? HIGH : LOW);
+        telemetry.setRelay(hal.nowUs(), cell, on ? 1 : 0);
+        return true;
+    }
+
+    //writes the relay off; true when it was on
+    bool open(size_t cell) {
+        std::lock_guard<std::mutex> lock(relay_mtx);
+        bool was_on = telemetry.relay(cell) == 1;
+        hal.digitalWrite(ports[cell].relay_pin, LOW);
+        if (was_on) telemetry.setRelay(hal.nowUs(), cell, 0);
+        return was_on;
+    }
+
+private:
+    Hal& hal;
+    std::vector<CellPorts> ports;
+    Telemetry& telemetry;
+    const SafetySupervisor* supervisor = nullptr;
+    std::mutex relay_mtx;
+};
+
+#endif
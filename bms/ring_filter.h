@@ -0,0 +1,79 @@
+/*
+* brief : fixed-capacity moving average with O(1) update
+*
+* Holds the last `capacity` samples in a ring and keeps a running sum and count
+* of the samples that take part in the average. A sample pushed with
+* counted == false still occupies its slot (it ages out like the others) but is
+* left out of the average, which is how the controller skips sensor readings
+* below threshold. Storage is allocated once in the constructor; push() never
+* allocates. The running sum is rebuilt each time the ring wraps so rounding
+* error cannot accumulate.
+*/
+#ifndef BMS_RING_FILTER_H
+#define BMS_RING_FILTER_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+template <typename T, typename Sum = double>
+class RingFilter {
+public:
+    explicit RingFilter(size_t capacity = 1)
+        : samples(capacity ? capacity : 1), counted(samples.size(), 0) {}
+
+    void push(T sample, bool use = true) {
+        if (filled == samples.size()) {    //evict oldest
+            if (counted[head]) {
+                total -= samples[head];
+                used--;
+            }
+        }
+        else {
+            filled++;
+        }
+        samples[head] = sample;
+        counted[head] = use;
+        if (use) {
+            total += sample;
+            used++;
+        }
+        if (++head == samples.size()) {
+            head = 0;
+            resum();
+        }
+    }
+
+    void clear() {
+        head = filled = used = 0;
+        total = 0;
+    }
+
+    bool valid() const { return used > 0; }         //at least one sample in the average
+    size_t count() const { return used; }
+    size_t size() const { return filled; }
+    size_t capacity() const { return samples.size(); }
+    Sum sum() const { return total; }
+
+    T average(T empty = T()) const {                 //empty: value for a window without counted samples
+        if (!used) return empty;
+        return static_cast<T>(total / static_cast<Sum>(used));
+    }
+
+private:
+    std::vector<T> samples;
+    std::vector<uint8_t> counted;
+    size_t head = 0;
+    size_t filled = 0;
+    size_t used = 0;
+    Sum total = 0;
+
+    void resum() {
+        total = 0;
+        for (size_t i = 0; i < filled; i++) {
+            if (counted[i]) total += samples[i];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+/*
+* brief : fixed-rate periodic tasks - absolute release times, CPU pinning, SCHED_FIFO, jitter statistics
+*
+* A task owns one thread. The thread calls enter() once, which applies the
+* task's CPU affinity and real-time priority, then wait() after every pass.
+* wait() sleeps until the next release time on an absolute timeline
+* (clock_nanosleep TIMER_ABSTIME through Hal::sleepUntilUs), so the time spent
+* in the body does not stretch the period and errors do not accumulate. A pass
+* that ends after its next release is an overrun: the missed releases are
+* skipped instead of run back to back, and counted.
+*
+* Per task two histograms (us) are kept: wake-up latency (actual wake-up minus
+* release time) and period jitter (|wake-up to wake-up time - period|).
+*/
+#ifndef BMS_SCHEDULER_H
+#define BMS_SCHEDULER_H
+
+#include "hal.h"
+#include "histogram.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define SCHED_REPORT_MS 10000   //scheduler statistics period in main
+
+struct TaskOptions {
+    int cpu = -1;           //pin to this CPU, -1 = any
+    int priority = 0;       //SCHED_FIFO 1..99, 0 = normal time sharing
+};
+
+class PeriodicTask {
+public:
+    PeriodicTask(Hal& hal, const std::string& name, uint64_t period_us, TaskOptions options = TaskOptions())
+        : hal(hal), task_name(name), period(period_us), options(options) {}
+
+    //on the task thread, before the first pass
+    void enter() {
+        if (options.cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(options.cpu, &set);
+            int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (error) std::cerr << task_name << ": cannot pin to CPU " << options.cpu << ": " << strerror(error) << std::endl;
+        }
+        if (options.priority > 0) {
+            sched_param param{};
+            param.sched_priority = options.priority;
+            int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (error) std::cerr << task_name << ": cannot set SCHED_FIFO " << options.priority << ": " << strerror(error) << std::endl;
+        }
+        release = hal.nowUs();
+        last_wake = release;
+    }
+
+    //sleep until the next release
+    void wait() {
+        uint64_t now = hal.nowUs();
+        release += period;
+        if (now >= release) {   //overran: skip to the next release still ahead
+            uint64_t missed = (now - release) / period + 1;
+            release += missed * period;
+            overrun_count.fetch_add(1, std::memory_order_relaxed);
+            skipped_count.fetch_add(missed, std::memory_order_relaxed);
+        }
+        hal.sleepUntilUs(release);
+        uint64_t wake = hal.nowUs();
+        latency.record(wake > release ? wake - release : 0);
+        uint64_t interval = wake - last_wake;
+        jitter.record(interval > period ? interval - period : period - interval);
+        last_wake = wake;
+        run_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const std::string& name() const { return task_name; }
+    uint64_t periodUs() const { return period; }
+    uint64_t runs() const { return run_count.load(std::memory_order_relaxed); }
+    uint64_t overruns() const { return overrun_count.load(std::memory_order_relaxed); }
+    uint64_t skipped() const { return skipped_count.load(std::memory_order_relaxed); }
+    const Histogram& wakeLatency() const { return latency; }
+    const Histogram& periodJitter() const { return jitter; }
+
+    //one line: runs, overruns and p50/p99/p99.9/max of both histograms
+    void report(FILE* out) const {
+        HistogramSnapshot l, j;
+        latency.snapshot(l);
+        jitter.snapshot(j);
+        fprintf(out, "sched %-9s period %6.1f ms  runs %8llu  overruns %llu (skipped %llu)  "
+                     "latency us p50 %llu p99 %llu p99.9 %llu max %llu  jitter us p50 %llu p99 %llu p99.9 %llu max %llu\n",
+                task_name.c_str(), period / 1000.0, (unsigned long long)runs(), (unsigned long long)overruns(), (unsigned long long)skipped(),
+                (unsigned long long)l.percentile(0.5), (unsigned long long)l.percentile(0.99), (unsigned long long)l.percentile(0.999), (unsigned long long)l.max,
+                (unsigned long long)j.percentile(0.5), (unsigned long long)j.percentile(0.99), (unsigned long long)j.percentile(0.999), (unsigned long long)j.max);
+    }
+
+    //"name": {...} member, us
+    void json(std::string& out) const {
+        HistogramSnapshot l, j;
+        latency.snapshot(l);
+        jitter.snapshot(j);
+        char text[512];
+        snprintf(text, sizeof(text), "\"%s\": {\"period_us\": %llu, \"runs\": %llu, \"overruns\": %llu, \"skipped\": %llu, "
+                 "\"latency_p50_us\": %llu, \"latency_p99_us\": %llu, \"latency_max_us\": %llu, "
+                 "\"jitter_p50_us\": %llu, \"jitter_p99_us\": %llu, \"jitter_max_us\": %llu}",
+                 task_name.c_str(), (unsigned long long)period, (unsigned long long)runs(), (unsigned long long)overruns(), (unsigned long long)skipped(),
+                 (unsigned long long)l.percentile(0.5), (unsigned long long)l.percentile(0.99), (unsigned long long)l.max,
+                 (unsigned long long)j.percentile(0.5), (unsigned long long)j.percentile(0.99), (unsigned long long)j.max);
+        out += text;
+    }
+
+private:
+    Hal& hal;
+    std::string task_name;
+    uint64_t period;
+    TaskOptions options;
+    uint64_t release = 0;
+    uint64_t last_wake = 0;
+    Histogram latency;
+    Histogram jitter;
+    std::atomic<uint64_t> run_count{0}, overrun_count{0}, skipped_count{0};
+};
+
+//keeps the real-time tasks from page faulting; call once before they start
+inline void lock_memory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) std::cerr << "mlockall: " << strerror(errno) << std::endl;
+}
+
+#endif
@@ -0,0 +1,424 @@
+/*
+* brief : simulated Hal backend - cell electrical/thermal model behind register-level
+*         TCA9548A / INA219 / DS18B20 / gpio emulation
+*
+* Each cell (CellPorts) sits behind one mux channel with its own INA219 and owns
+* a charge PWM pin, a fan pin, a discharge relay pin, a DS18B20 on the cell and
+* one on its discharge resistor. Up to 8 muxes (0x70..0x77) share a bus; cells
+* can be spread over several buses (CellPorts::i2c_bus), each with its own mux
+* state. With i2c_transaction_us set, every transaction occupies its bus for
+* that long (real time, scaled by speedup), so acquisition on one bus is
+* serialized and separate buses overlap, as on the rig.
+* Model time is virtual: speedup > 0 runs that many times faster than the wall
+* clock, speedup == 0 never sleeps and advances the clock by the requested
+* sleep instead (free-running, for throughput measurements; every sleeping
+* thread advances the same clock, so timing across threads is not realistic).
+*/
+#ifndef BMS_SIM_HAL_H
+#define BMS_SIM_HAL_H
+
+#include "hal.h"
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <cmath>
+
+#define SIM_TCA_ADDR_MIN 0x70
+#define SIM_TCA_ADDR_MAX 0x77
+#define SIM_INA219_ADDR_MIN 0x40
+#define SIM_INA219_ADDR_MAX 0x4F
+#define SIM_FD_BASE 1000
+
+struct SimCell {    //ICR18650-26 equivalent circuit + lumped thermal mass
+    double capacity_mah = 2600.0;
+    double soc = 0.5;               //0..1
+    double r_int = 0.08;            //ohm
+    double current_ma = 0.0;        //+ charging, - discharging
+    double temp = 25.0;             //'C
+    double resistor_temp = 25.0;
+    double duty = 0.0;              //charge pwm %
+    double fan = 0.0;               //%
+    bool relay = false;
+    uint16_t config_reg = 0x399F;   //INA219 power-on default
+    uint16_t calibration_reg = 0;   //0: the current and power registers read 0, as on the chip
+    uint64_t cnvr_clear_us = 0;     //last power read or config write
+    uint64_t config_us = 0;         //last config write: conversions (re)start here
+    uint64_t model_us = 0;          //model integrated up to here
+};
+
+class SimHal : public Hal {
+public:
+    //pack supply / charge path / discharge path
+    double supply_voltage = 5.0;
+    double charge_path_r = 0.6;
+    double max_charge_ma = 2000.0;
+    double load_r = 8.2;
+    //thermal
+    double ambient = 25.0;
+    double cell_heat_capacity = 40.0;      //J/K
+    double cell_h = 0.05;                   //W/K natural convection
+    double cell_h_fan = 0.25;               //W/K at 100% fan
+    double resistor_heat_capacity = 10.0;
+    double resistor_h = 0.04;
+    double resistor_h_fan = 0.3;
+    //sensors
+    double voltage_noise = 0.002;           //V rms
+    double current_noise = 2.0;             //mA rms
+    int w1_conversion_ms = W1_CONVERSION_MS;
+    bool w1_bulk = true;                    //bus master supports therm_bulk_read
+    double i2c_transaction_us = 0.0;        //bus time per i2c transaction, 0 = instant
+
+    SimHal(const std::vector<CellPorts>& ports, int resistor_fan_pin, double speedup = 1.0, unsigned seed = 1)
+        : ports(ports), cells(ports.size()), resistor_fan_pin(resistor_fan_pin), speedup(speedup), rng(seed) {
+        std::uniform_real_distribution<double> initial_soc(0.3, 0.6);
+        for (size_t i = 0; i < ports.size(); i++) {
+            cells[i].soc = initial_soc(rng);
+            int cell = static_cast<int>(i);
+            bus_count = std::max(bus_count, ports[i].i2c_bus + 1);
+            slots[slotKey(ports[i].i2c_bus, ports[i].mux_addr, ports[i].mux_channel, ports[i].ina_addr)] = cell;
+            pins[ports[i].pwm_pin] = { cell, PIN_CHARGE };
+            pins[ports[i].fan_pin] = { cell, PIN_FAN };
+            pins[ports[i].relay_pin] = { cell, PIN_RELAY };
+            sensors[ports[i].temp_path] = { cell, false };
+            sensors[ports[i].resistor_temp_path] = { cell, true };
+        }
+        mux_mask.assign(bus_count, {});
+        bus_mtx.reset(new std::mutex[bus_count]);
+        start_real_us = monotonic_us();
+    }
+
+    int setup() override { return 0; }
+
+    int i2cSetup(int bus, int address) override {
+        if (bus < 0 || bus >= bus_count || (!isMux(address) && !isIna(address))) return -1;
+        return SIM_FD_BASE + (bus << 8) + address;
+    }
+
+    int i2cWrite(int fd, int data) override {
+        int line = fdBus(fd);
+        if (line < 0 || !isMux(fdAddress(fd))) return -1;
+        std::unique_lock<std::mutex> hold = transaction(line);
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        mux_mask[line][fdAddress(fd) - SIM_TCA_ADDR_MIN] = data & 0xFF;
+        return 0;
+    }
+
+    int i2cReadReg16(int fd, int reg) override {
+        int line = fdBus(fd);
+        if (line < 0 || !isIna(fdAddress(fd))) return -1;
+        std::unique_lock<std::mutex> hold = transaction(line);
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        int index = selectedCell(line, fdAddress(fd));
+        if (index < 0) return -1;  //no ack: nothing selected, or two chips answering
+        SimCell& cell = cells[index];
+        advance(cell, nowUsLocked());
+        uint64_t now = nowUsLocked();
+        double averaging = std::sqrt(static_cast<double>(adcSamples(cell.config_reg)));  //hardware averaging
+        std::normal_distribution<double> vnoise(0.0, voltage_noise / averaging), inoise(0.0, current_noise / averaging);
+        long shunt = std::lround((cell.current_ma + inoise(rng)) * 0.1 / 0.01);    //0.1 ohm shunt, 10uV/LSB
+        long bus = std::lround(std::max(0.0, terminalVoltage(cell) + vnoise(rng)) / 0.004);   //4mV/LSB
+        long current = shunt * cell.calibration_reg / 4096;
+        uint64_t conversion = conversionUs(cell.config_reg);
+        bool ready = ((cell.config_reg & 0x7) == 0x7)   //continuous: a conversion ended since the flag was cleared
+            ? (now - cell.config_us) / conversion > (cell.cnvr_clear_us - cell.config_us) / conversion
+            : now - cell.config_us >= conversion;       //triggered: the one conversion is done
+        uint16_t value = 0;
+        switch (reg) {
+        case 0x00: value = cell.config_reg; break;
+        case 0x01: value = static_cast<uint16_t>(static_cast<int16_t>(shunt)); break;
+        case 0x02: value = static_cast<uint16_t>((bus << 3) | (ready ? 0x2 : 0)); break;
+        case 0x03:
+            value = static_cast<uint16_t>(std::min(0xFFFFL, std::labs(current) * bus / 5000));
+            cell.cnvr_clear_us = now;
+            break;
+        case 0x04: value = static_cast<uint16_t>(static_cast<int16_t>(current)); break;
+        case 0x05: value = cell.calibration_reg; break;
+        default: return -1;
+        }
+        return swap16(value);
+    }
+
+    int i2cWriteReg16(int fd, int reg, int data) override {
+        int line = fdBus(fd);
+        if (line < 0 || !isIna(fdAddress(fd))) return -1;
+        std::unique_lock<std::mutex> hold = transaction(line);
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        int index = selectedCell(line, fdAddress(fd));
+        if (index < 0) return -1;
+        if (reg == 0x00) {
+            cells[index].config_reg = swap16(data);
+            cells[index].cnvr_clear_us = cells[index].config_us = nowUsLocked();
+        }
+        else if (reg == 0x05) cells[index].calibration_reg = swap16(data);
+        else return -1;
+        return 0;
+    }
+
+    void pinMode(int /*pin*/, int /*mode*/) override {}
+
+    void digitalWrite(int pin, int value) override {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        auto it = pins.find(pin);
+        if (it == pins.end() || it->second.role != PIN_RELAY) return;
+        SimCell& cell = cells[it->second.cell];
+        advance(cell, nowUsLocked());
+        cell.relay = (value == HIGH);
+        updateCurrent(cell);
+    }
+
+    int pwmCreate(int pin, int initial, int range, int frequency_hz) override {    //the model sees the average, any frequency goes
+        if (range < 1 || frequency_hz <= 0) return -1;
+        {
+            std::lock_guard<std::mutex> lock(sim_mtx);
+            pwm_range[pin] = range;
+        }
+        pwmWrite(pin, initial);
+        return 0;
+    }
+
+    void pwmWrite(int pin, int value) override {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        auto range_it = pwm_range.find(pin);
+        int range = range_it == pwm_range.end() ? PWM_RANGE : range_it->second;
+        double percent = std::min(range, std::max(0, value)) * 100.0 / range;
+        if (pin == resistor_fan_pin) {
+            advanceAll(nowUsLocked());
+            resistor_fan = percent;
+        }
+        auto it = pins.find(pin);
+        if (it == pins.end()) return;
+        SimCell& cell = cells[it->second.cell];
+        advance(cell, nowUsLocked());
+        if (it->second.role == PIN_CHARGE) cell.duty = percent;
+        else if (it->second.role == PIN_FAN) cell.fan = percent;
+        updateCurrent(cell);
+    }
+
+    double readTemperature(const std::string& sensorPath) override {
+        sleepMs(w1_conversion_ms);  //DS18B20 12-bit conversion
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        auto it = sensors.find(sensorPath);
+        if (it == sensors.end()) {
+            std::cerr << "Could not open sensor file: " << sensorPath << "\n";
+            return 0.0;
+        }
+        SimCell& cell = cells[it->second.cell];
+        advance(cell, nowUsLocked());
+        double temp = it->second.resistor ? cell.resistor_temp : cell.temp;
+        return std::round(temp * 16.0) / 16.0;  //sensor resolution 1/16 'C
+    }
+
+    int w1Open(const std::string& sensorPath) override {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        auto it = sensors.find(sensorPath);
+        if (it == sensors.end()) {
+            std::cerr << "Could not open sensor file: " << sensorPath << "\n";
+            return -1;
+        }
+        w1_handles.push_back(it->second);
+        w1_converted.push_back(0);
+        return static_cast<int>(w1_handles.size() - 1);
+    }
+
+    double w1Read(int handle) override {
+        bool converted;
+        {
+            std::lock_guard<std::mutex> lock(sim_mtx);
+            if (handle < 0 || handle >= static_cast<int>(w1_handles.size())) return NAN;
+            converted = w1_converted[handle];
+            w1_converted[handle] = 0;
+        }
+        if (!converted) sleepMs(w1_conversion_ms);
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        SensorSlot slot = w1_handles[handle];
+        if (slot.cell < 0) return NAN;
+        SimCell& cell = cells[slot.cell];
+        advance(cell, nowUsLocked());
+        double temp = slot.resistor ? cell.resistor_temp : cell.temp;
+        return std::round(temp * 16.0) / 16.0;
+    }
+
+    void w1Close(int handle) override {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        if (handle >= 0 && handle < static_cast<int>(w1_handles.size())) w1_handles[handle].cell = -1;
+    }
+
+    bool w1BulkConvert() override {
+        if (!w1_bulk) return false;
+        sleepMs(w1_conversion_ms);
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        std::fill(w1_converted.begin(), w1_converted.end(), 1);
+        return true;
+    }
+
+    void sleepMs(int ms) override {
+        if (ms <= 0) return;
+        if (speedup > 0.0) std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(ms * 1000.0 / speedup)));
+        else virtual_us += static_cast<uint64_t>(ms) * 1000;
+    }
+
+    void sleepUntilUs(uint64_t deadline_us) override {
+        if (speedup > 0.0) {
+            uint64_t now = nowUs();
+            if (deadline_us > now) std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>((deadline_us - now) / speedup)));
+            return;
+        }
+        uint64_t now = virtual_us.load();   //free-running: jump the clock forward to the deadline
+        while (deadline_us > now && !virtual_us.compare_exchange_weak(now, deadline_us)) {}
+    }
+
+    uint64_t nowUs() override {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        return nowUsLocked();
+    }
+
+    //model inspection, for benchmarks
+    size_t cellCount() const { return cells.size(); }
+    SimCell cell(size_t index) {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        advance(cells[index], nowUsLocked());
+        return cells[index];
+    }
+    void setCellSoc(size_t index, double soc) {
+        std::lock_guard<std::mutex> lock(sim_mtx);
+        advance(cells[index], nowUsLocked());
+        cells[index].soc = std::min(1.0, std::max(0.0, soc));
+        updateCurrent(cells[index]);
+    }
+
+    static double ocv(double soc) {   //ICR18650 open circuit voltage curve
+        static const double volts[] = { 3.00, 3.30, 3.42, 3.50, 3.55, 3.60, 3.65, 3.75, 3.85, 3.96, 4.08, 4.20 };
+        static const double socs[]  = { 0.00, 0.04, 0.10, 0.20, 0.30, 0.40, 0.50, 0.60, 0.70, 0.80, 0.90, 1.00 };
+        soc = std::min(1.0, std::max(0.0, soc));
+        int i = 1;
+        while (i < 11 && soc > socs[i]) i++;
+        double t = (soc - socs[i - 1]) / (socs[i] - socs[i - 1]);
+        return volts[i - 1] + t * (volts[i] - volts[i - 1]);
+    }
+
+private:
+    enum PinRole { PIN_CHARGE, PIN_FAN, PIN_RELAY };
+    struct PinSlot { int cell; PinRole role; };
+    struct SensorSlot { int cell; bool resistor; };     //cell -1: closed
+
+    std::vector<CellPorts> ports;
+    std::vector<SimCell> cells;
+    int resistor_fan_pin;
+    double resistor_fan = 0.0;
+    double speedup;
+    std::mt19937 rng;
+    std::mutex sim_mtx;
+    uint64_t start_real_us = 0;
+    std::atomic<uint64_t> virtual_us{0};
+    int bus_count = 1;
+    std::vector<std::array<int, SIM_TCA_ADDR_MAX - SIM_TCA_ADDR_MIN + 1>> mux_mask;    //per bus
+    std::unique_ptr<std::mutex[]> bus_mtx;  //held for a transaction's bus time
+    std::unordered_map<int, int> slots;     //(bus, mux, channel, ina) -> cell
+    std::unordered_map<int, PinSlot> pins;
+    std::unordered_map<int, int> pwm_range;     //pin -> pwmCreate range
+    std::unordered_map<std::string, SensorSlot> sensors;
+    std::vector<SensorSlot> w1_handles;
+    std::vector<uint8_t> w1_converted;      //bulk conversion result not read yet
+
+    static bool isMux(int address) { return address >= SIM_TCA_ADDR_MIN && address <= SIM_TCA_ADDR_MAX; }
+    static bool isIna(int address) { return address >= SIM_INA219_ADDR_MIN && address <= SIM_INA219_ADDR_MAX; }
+    static int slotKey(int bus, int mux_addr, int channel, int ina_addr) { return (bus << 24) | (mux_addr << 16) | (channel << 8) | ina_addr; }
+    static int fdAddress(int fd) { return (fd - SIM_FD_BASE) & 0xFF; }
+    int fdBus(int fd) const {   //-1 for an fd i2cSetup did not return
+        int bus = (fd - SIM_FD_BASE) >> 8;
+        return fd >= SIM_FD_BASE && bus < bus_count ? bus : -1;
+    }
+
+    //occupies the bus for one transaction; the caller keeps the lock until it is done
+    std::unique_lock<std::mutex> transaction(int bus) {
+        std::unique_lock<std::mutex> hold(bus_mtx[bus]);
+        if (i2c_transaction_us > 0.0 && speedup > 0.0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(i2c_transaction_us / speedup)));
+        }
+        return hold;
+    }
+
+    static int swap16(int value) { return ((value & 0xFF) << 8) | ((value >> 8) & 0xFF); }
+
+    static int adcSamples(uint16_t config) {    //BADC field
+        int adc = (config >> 7) & 0xF;
+        return (adc & 0x8) ? 1 << (adc & 0x7) : 1;
+    }
+
+    static uint64_t conversionUs(uint16_t config) {     //shunt + bus conversion
+        static const int resolution_us[4] = { 84, 148, 276, 532 };
+        int badc = (config >> 7) & 0xF, sadc = (config >> 3) & 0xF;
+        auto one = [&](int adc) { return (adc & 0x8) ? 532 << (adc & 0x7) : resolution_us[adc & 0x3]; };
+        return one(badc) + one(sadc);
+    }
+
+    uint64_t nowUsLocked() {
+        if (speedup > 0.0) return static_cast<uint64_t>((monotonic_us() - start_real_us) * speedup);
+        return virtual_us.load();
+    }
+
+    int selectedCell(int bus, int ina_addr) const {   //chip answering at ina_addr through the enabled mux channels
+        int found = -1;
+        const auto& masks = mux_mask[bus];
+        for (int m = 0; m <= SIM_TCA_ADDR_MAX - SIM_TCA_ADDR_MIN; m++) {
+            for (int channel = 0; masks[m] >> channel; channel++) {
+                if (!(masks[m] & (1 << channel))) continue;
+                auto it = slots.find(slotKey(bus, SIM_TCA_ADDR_MIN + m, channel, ina_addr));
+                if (it == slots.end()) continue;
+                if (found >= 0) return -1;  //bus conflict
+                found = it->second;
+            }
+        }
+        return found;
+    }
+
+    double terminalVoltage(const SimCell& cell) const {
+        return ocv(cell.soc) + cell.current_ma / 1000.0 * cell.r_int;
+    }
+
+    double chargeAmps(const SimCell& cell) const {
+        double open = ocv(cell.soc);
+        double charge = (cell.duty / 100.0 * supply_voltage - open) / (cell.r_int + charge_path_r);
+        charge = std::min(max_charge_ma / 1000.0, std::max(0.0, charge));   //schottky blocks reverse current
+        if (cell.soc >= 1.0) charge = 0.0;
+        return charge;
+    }
+
+    double dischargeAmps(const SimCell& cell) const {
+        if (!cell.relay || cell.soc <= 0.0) return 0.0;
+        return ocv(cell.soc) / (cell.r_int + load_r);
+    }
+
+    void updateCurrent(SimCell& cell) {
+        cell.current_ma = (chargeAmps(cell) - dischargeAmps(cell)) * 1000.0;
+    }
+
+    void advance(SimCell& cell, uint64_t now) {    //integrate one cell up to now; cells are independent
+        while (cell.model_us < now) {
+            uint64_t step = std::min<uint64_t>(now - cell.model_us, 100000);  //100ms max step
+            double dt = step / 1e6;
+            double discharge = dischargeAmps(cell);
+            double amps = chargeAmps(cell) - discharge;
+            cell.soc = std::min(1.0, std::max(0.0, cell.soc + amps * 1000.0 * dt / 3600.0 / cell.capacity_mah));
+
+            double cell_heat = amps * amps * cell.r_int;
+            cell.temp += (cell_heat - (cell.temp - ambient) * (cell_h + cell_h_fan * cell.fan / 100.0)) * dt / cell_heat_capacity;
+            double load_heat = discharge * discharge * load_r;
+            cell.resistor_temp += (load_heat - (cell.resistor_temp - ambient) * (resistor_h + resistor_h_fan * resistor_fan / 100.0)) * dt / resistor_heat_capacity;
+            cell.model_us += step;
+        }
+        updateCurrent(cell);
+    }
+
+    void advanceAll(uint64_t now) {
+        for (SimCell& cell : cells) advance(cell, now);
+    }
+};
+
+#endif
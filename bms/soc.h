@@ -0,0 +1,83 @@
+/*
+* brief : state of charge estimation from cell voltage
+*
+* Each chemistry is an OCV->SoC curve given as (voltage, soc) points. At compile
+* time the points are resampled onto a uniform voltage grid (SOC_GRID_STEP),
+* so a lookup is one multiply, one clamp and one linear interpolation with no
+* data-dependent branches, and a loop over many cells vectorizes. The ICR18650
+* points are the thresholds of the former if/else ladder; since they all fall
+* on the 10 mV grid the resampling is exact.
+*
+* The curve is open circuit voltage only. The terminal voltage under load is
+* modelled by SocEstimator (soc_estimator.h) as OCV + I * R0 with the measured
+* current, which replaces the ladder's fixed (v - 2.9) * 1.3 boost while the
+* discharge relay was on.
+*/
+#ifndef BMS_SOC_H
+#define BMS_SOC_H
+
+#include <array>
+#include <cstddef>
+
+#define SOC_GRID_STEP 0.01f     //V
+#define SOC_GRID_SIZE 256       //max grid points per curve
+
+struct OcvPoint {
+    float voltage;
+    float soc;      //%
+};
+
+struct SocCurve {   //OCV->SoC resampled on a uniform voltage grid
+    float v_min;
+    float inv_step;
+    int last;                           //index of the last grid point
+    std::array<float, SOC_GRID_SIZE> soc;
+};
+
+template <size_t N>
+constexpr SocCurve make_soc_curve(const OcvPoint (&points)[N]) {
+    static_assert(N >= 2, "an OCV curve needs at least two points");
+    SocCurve curve{};
+    curve.v_min = points[0].voltage;
+    curve.inv_step = 1.0f / SOC_GRID_STEP;
+    curve.last = static_cast<int>((points[N - 1].voltage - points[0].voltage) / SOC_GRID_STEP + 0.5f);
+    size_t seg = 0;
+    for (int g = 0; g <= curve.last && g < SOC_GRID_SIZE; g++) {
+        float v = points[0].voltage + g * SOC_GRID_STEP;
+        while (seg + 2 < N && v >= points[seg + 1].voltage - SOC_GRID_STEP / 2) seg++;
+        float t = (v - points[seg].voltage) / (points[seg + 1].voltage - points[seg].voltage);
+        t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+        curve.soc[g] = points[seg].soc + t * (points[seg + 1].soc - points[seg].soc);
+    }
+    return curve;
+}
+
+//Samsung ICR18650 (open circuit voltage, 2% steps)
+constexpr OcvPoint ICR18650_OCV[] = {
+    { 2.90f,  0.0f }, { 3.00f,  2.0f }, { 3.10f,  4.0f }, { 3.30f,  6.0f }, { 3.40f,  8.0f },
+    { 3.43f, 12.0f }, { 3.44f, 14.0f }, { 3.46f, 16.0f }, { 3.48f, 18.0f },
+    { 3.50f, 20.0f }, { 3.51f, 22.0f }, { 3.52f, 24.0f }, { 3.53f, 26.0f }, { 3.54f, 28.0f },
+    { 3.55f, 30.0f }, { 3.56f, 32.0f }, { 3.57f, 34.0f }, { 3.58f, 36.0f }, { 3.59f, 38.0f },
+    { 3.60f, 40.0f }, { 3.61f, 42.0f }, { 3.62f, 44.0f }, { 3.63f, 46.0f }, { 3.64f, 48.0f },
+    { 3.65f, 50.0f }, { 3.67f, 52.0f }, { 3.69f, 54.0f }, { 3.71f, 56.0f }, { 3.73f, 58.0f },
+    { 3.75f, 60.0f }, { 3.77f, 62.0f }, { 3.79f, 64.0f }, { 3.81f, 66.0f }, { 3.83f, 68.0f },
+    { 3.85f, 70.0f }, { 3.87f, 72.0f }, { 3.89f, 74.0f }, { 3.91f, 76.0f }, { 3.94f, 78.0f },
+    { 3.96f, 80.0f }, { 3.99f, 82.0f }, { 4.02f, 84.0f }, { 4.04f, 86.0f }, { 4.06f, 88.0f },
+    { 4.08f, 90.0f }, { 4.10f, 92.0f }, { 4.12f, 94.0f }, { 4.14f, 96.0f }, { 4.16f, 98.0f },
+    { 4.20f, 100.0f },
+};
+
+constexpr SocCurve ICR18650 = make_soc_curve(ICR18650_OCV);
+
+//soc % at an open circuit voltage
+inline float soc_lookup(const SocCurve& curve, float voltage) {
+    float x = (voltage - curve.v_min) * curve.inv_step;
+    x = x > 0.0f ? x : 0.0f;                                    //also maps NaN to empty
+    x = x < curve.last ? x : static_cast<float>(curve.last);
+    int k = static_cast<int>(x);
+    k = k < curve.last ? k : curve.last - 1;
+    float t = x - k;
+    return curve.soc[k] + t * (curve.soc[k + 1] - curve.soc[k]);
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+* brief : continuous SoC estimation - coulomb counting corrected by an extended Kalman filter
+*
+* State is the cell SoC (0..1). Every sample integrates the current measured at
+* the previous sample over the monotonic time since then (predict), then
+* compares the measured terminal voltage with OCV(soc) + I * R0 (correct).
+* Under load the voltage model is rough (polarization is not modelled), so
+* loaded samples get a large measurement variance and mostly just bound the
+* drift; once the current has been near zero for rest_settle_us the sample is
+* an open circuit reading and gets a small variance. The controller therefore
+* only needs an occasional short charging pause rather than one every tick.
+*
+* OCV(soc) and its inverse come from the chemistry's SocCurve (soc.h), the same
+* uniform grid the plain voltage lookup uses, so swapping the curve swaps both.
+*/
+#ifndef BMS_SOC_ESTIMATOR_H
+#define BMS_SOC_ESTIMATOR_H
+
+#include "soc.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+#define EKF_CAPACITY_MAH 2600.0f    //ICR18650-26
+#define EKF_R0 0.08f                //ohm, cell + wiring seen by the INA219
+#define EKF_Q 1e-8f                 //process noise, soc^2 per second (current offset, capacity error)
+#define EKF_R_LOADED 9e-4f          //(30mV)^2
+#define EKF_R_REST 2.5e-5f          //(5mV)^2
+#define EKF_P0 2.5e-3f              //(5% soc)^2
+#define REST_CURRENT_MA 20.0f       //below this the cell counts as resting
+#define REST_SETTLE_MS 100          //relaxation before a resting sample is trusted as OCV
+
+class SocEstimator {
+public:
+    float capacity_mah = EKF_CAPACITY_MAH;
+    float r0 = EKF_R0;
+    float q = EKF_Q;
+    float r_loaded = EKF_R_LOADED;
+    float r_rest = EKF_R_REST;
+    uint64_t rest_settle_us = REST_SETTLE_MS * 1000ULL;
+
+    explicit SocEstimator(const SocCurve& curve = ICR18650) : curve(&curve) {}     //curve must outlive the estimator
+
+    //one sample: current in mA (+ charging), terminal voltage in V, monotonic timestamp in us
+    void update(uint64_t now_us, float current_ma, float voltage) {
+        if (!(voltage >= 0.1f) || std::isnan(current_ma)) return;  //dropout, keep the last estimate
+
+        bool resting = std::fabs(current_ma) < REST_CURRENT_MA;
+        if (!resting) rest_since_us = 0;
+        else if (rest_since_us == 0) rest_since_us = now_us;
+        bool settled = resting && now_us - rest_since_us >= rest_settle_us;
+
+        if (!initialized) {
+            soc = ocvToSoc(voltage - current_ma / 1000.0f * r0);
+            p = EKF_P0;
+            initialized = true;
+        }
+        else {
+            //predict: coulomb counting with the current held since the last sample
+            float dt = (now_us - last_us) / 1e6f;
+            soc += last_current_ma * dt / 3600.0f / capacity_mah;
+            soc = clamp01(soc);
+            p += q * dt;
+
+            //correct against the OCV model
+            float slope = 0.0f;
+            float predicted = socToOcv(soc, slope) + current_ma / 1000.0f * r0;
+            float s = slope * slope * p + (settled ? r_rest : r_loaded);
+            float k = p * slope / s;
+            soc = clamp01(soc + k * (voltage - predicted));
+            p = (1.0f - k * slope) * p;
+        }
+        last_us = now_us;
+        last_current_ma = current_ma;
+        if (settled) last_rest_us = now_us;
+    }
+
+    bool valid() const { return initialized; }
+    float percent() const { return soc * 100.0f; }
+    float variance() const { return p; }
+    uint64_t lastRestUs() const { return last_rest_us; }   //time of the last open circuit correction, 0 = never
+
+private:
+    const SocCurve* curve;
+    bool initialized = false;
+    float soc = 0.0f;
+    float p = EKF_P0;
+    uint64_t last_us = 0;
+    float last_current_ma = 0.0f;
+    uint64_t rest_since_us = 0;
+    uint64_t last_rest_us = 0;
+
+    static float clamp01(float x) { return x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x); }
+
+    float ocvToSoc(float voltage) const { return soc_lookup(*curve, voltage) / 100.0f; }
+
+    //the grid segment that holds x, found by bisection; slope: dOCV/dsoc in V per unit soc
+    float socToOcv(float x, float& slope) const {
+        float pct = x * 100.0f;
+        const float* soc_grid = curve->soc.data();
+        int k = static_cast<int>(std::upper_bound(soc_grid, soc_grid + curve->last + 1, pct) - soc_grid) - 1;
+        k = k < 0 ? 0 : (k < curve->last ? k : curve->last - 1);
+        float ds = (soc_grid[k + 1] - soc_grid[k]) / 100.0f;
+        slope = SOC_GRID_STEP / ds;
+        return curve->v_min + k * SOC_GRID_STEP + (x - soc_grid[k] / 100.0f) * slope;
+    }
+};
+
+#endif
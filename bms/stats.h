@@ -0,0 +1,227 @@
+/*
+* brief : hot path latency instrumentation - per-stage histograms, instrumenting Hal, local stats endpoint
+*
+* Each stage owns a lock-free Histogram of durations in ns. InstrumentedHal
+* wraps the real (or simulated) Hal and times the bus and pin calls, so the
+* control code is measured without being touched; the telemetry encoder and
+* the socket send are timed where they run. A timed call costs two
+* clock_gettime(CLOCK_MONOTONIC) reads (vDSO, no syscall) and a few relaxed
+* atomic adds; calibrate() measures that and the reports print it.
+*
+* StatsServer answers every connection on a Unix socket with one JSON object
+* and closes it:  socat - UNIX-CONNECT:/tmp/bms_stats.sock
+*/
+#ifndef BMS_STATS_H
+#define BMS_STATS_H
+
+#include "hal.h"
+#include "histogram.h"
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <iostream>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+#define STATS_SOCKET "/tmp/bms_stats.sock"
+
+enum Stage {
+    STAGE_MUX_SELECT,   //TCA9548A channel write
+    STAGE_INA219_READ,  //one INA219 register read
+    STAGE_W1_READ,      //one DS18B20 read
+    STAGE_PWM_WRITE,
+    STAGE_ENCODE,       //telemetry frame / JSON formatting
+    STAGE_SEND,         //one send() on the server socket
+    STAGE_COUNT
+};
+
+inline const char* stage_name(int stage) {
+    static const char* names[STAGE_COUNT] = { "mux_select", "ina219_read", "w1_read", "pwm_write", "encode", "send" };
+    return stage >= 0 && stage < STAGE_COUNT ? names[stage] : "?";
+}
+
+inline uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+class StageStats {
+public:
+    Histogram& stage(Stage s) { return stages[s]; }
+    void record(Stage s, uint64_t ns) { stages[s].record(ns); }
+
+    //cost of one timed, empty section, ns; recorded into a scratch histogram
+    uint64_t calibrate(int rounds = 100000) {
+        Histogram scratch;
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < rounds; i++) {
+            uint64_t t0 = monotonic_ns();
+            scratch.record(monotonic_ns() - t0);
+        }
+        overhead = (monotonic_ns() - start) / rounds;
+        return overhead;
+    }
+
+    uint64_t overheadNs() const { return overhead; }
+
+    //one line per stage that has samples
+    void report(FILE* out) const {
+        HistogramSnapshot h;
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            stages[s].snapshot(h);
+            if (h.count == 0) continue;
+            fprintf(out, "stage %-11s count %10llu  us p50 %8.1f p99 %8.1f max %8.1f  mean %8.1f\n", stage_name(s),
+                    (unsigned long long)h.count, h.percentile(0.5) / 1000.0, h.percentile(0.99) / 1000.0, h.max / 1000.0, h.mean() / 1000.0);
+        }
+        fprintf(out, "stage timer overhead %llu ns per timed call\n", (unsigned long long)overhead);
+    }
+
+    //"stages": {...} members, ns
+    void json(std::string& out) const {
+        char line[256];
+        HistogramSnapshot h;
+        out += "\"timer_overhead_ns\": " + std::to_string(overhead) + ", \"stages\": {";
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            stages[s].snapshot(h);
+            snprintf(line, sizeof(line), "%s\"%s\": {\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"mean_ns\": %.0f}",
+                     s ? ", " : "", stage_name(s), (unsigned long long)h.count, (unsigned long long)h.percentile(0.5),
+                     (unsigned long long)h.percentile(0.99), (unsigned long long)h.max, h.mean());
+            out += line;
+        }
+        out += "}";
+    }
+
+private:
+    Histogram stages[STAGE_COUNT];
+    uint64_t overhead = 0;
+};
+
+class StageTimer {  //times its scope into one stage; no-op when stats is null
+public:
+    StageTimer(StageStats* stats, Stage stage) : stats(stats), stage(stage), start(stats ? monotonic_ns() : 0) {}
+    ~StageTimer() {
+        if (stats) stats->record(stage, monotonic_ns() - start);
+    }
+
+private:
+    StageStats* stats;
+    Stage stage;
+    uint64_t start;
+};
+
+class InstrumentedHal : public Hal {    //forwards everything, timing the hot path calls
+public:
+    InstrumentedHal(Hal& inner, StageStats& stats) : inner(inner), stats(stats) {}
+
+    int setup() override { return inner.setup(); }
+
+    int i2cSetup(int bus, int address) override { return inner.i2cSetup(bus, address); }
+    int i2cWrite(int fd, int data) override {   //only the mux is written without a register
+        StageTimer t(&stats, STAGE_MUX_SELECT);
+        return inner.i2cWrite(fd, data);
+    }
+    int i2cReadReg16(int fd, int reg) override {
+        StageTimer t(&stats, STAGE_INA219_READ);
+        return inner.i2cReadReg16(fd, reg);
+    }
+    int i2cWriteReg16(int fd, int reg, int data) override { return inner.i2cWriteReg16(fd, reg, data); }
+
+    void pinMode(int pin, int mode) override { inner.pinMode(pin, mode); }
+    void digitalWrite(int pin, int value) override { inner.digitalWrite(pin, value); }
+    int pwmCreate(int pin, int initial, int range, int frequency_hz) override { return inner.pwmCreate(pin, initial, range, frequency_hz); }
+    void pwmWrite(int pin, int value) override {
+        StageTimer t(&stats, STAGE_PWM_WRITE);
+        inner.pwmWrite(pin, value);
+    }
+
+    double readTemperature(const std::string& sensorPath) override {
+        StageTimer t(&stats, STAGE_W1_READ);
+        return inner.readTemperature(sensorPath);
+    }
+    int w1Open(const std::string& sensorPath) override { return inner.w1Open(sensorPath); }
+    double w1Read(int handle) override {
+        StageTimer t(&stats, STAGE_W1_READ);
+        return inner.w1Read(handle);
+    }
+    void w1Close(int handle) override { inner.w1Close(handle); }
+    bool w1BulkConvert() override { return inner.w1BulkConvert(); }
+
+    void sleepMs(int ms) override { inner.sleepMs(ms); }
+    void sleepUntilUs(uint64_t deadline_us) override { inner.sleepUntilUs(deadline_us); }
+    uint64_t nowUs() override { return inner.nowUs(); }
+
+private:
+    Hal& inner;
+    StageStats& stats;
+};
+
+class StatsServer {     //one JSON object per connection, served from its own thread
+public:
+    using Render = std::function<std::string()>;
+
+    ~StatsServer() { stop(); }
+
+    bool start(const std::string& socket_path, Render render_fn) {
+        path = socket_path;
+        render = render_fn;
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) return false;
+        strcpy(address.sun_path, path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return false;
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 4) != 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        running = true;
+        thread = std::thread(&StatsServer::run, this);
+        return true;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        thread.join();
+        close(fd);
+        unlink(path.c_str());
+        fd = -1;
+    }
+
+private:
+    std::string path;
+    Render render;
+    int fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    void run() {
+        while (running) {
+            pollfd p{ fd, POLLIN, 0 };
+            if (poll(&p, 1, 200) <= 0) continue;    //wakes up to notice stop()
+            int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client == -1) continue;
+            std::string body = render() + "\n";
+            for (size_t sent = 0; sent < body.size();) {
+                ssize_t n = send(client, body.data() + sent, body.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0 && errno != EINTR) break;
+                if (n > 0) sent += n;
+            }
+            close(client);
+        }
+    }
+};
+
+#endif
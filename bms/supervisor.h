@@ -0,0 +1,269 @@
+/*
+* brief : safety supervisor - hard limits on every cell at a fixed rate, independent of the charging loop
+*
+* The charging task checks its soft limits (MAX_SAFE / MAX_CRITICAL
+* temperature, SoC, the CV target) once per pass, against whatever it was
+* last given. The supervisor runs on its own task at SAFETY_PERIOD_MS, above
+* the charging task's priority, and checks hard limits on the newest inputs:
+*   - the raw INA219 sample of each cell, handed over lock-free by the
+*     charging task right after each sweep (sample()), before any filtering
+*   - the DS18B20 readings of each cell and discharge resistor, from TempService
+* A NaN is never compared against a limit: a NaN sample is dropped, and a cell
+* whose last good sample (or reading) is older than its max age counts as a
+* dropout, which trips like an exceeded limit. A stalled charging task
+* therefore trips its cells too.
+*
+* A charge fault (over voltage, over current, cell over temperature, dropout)
+* writes the cell's charge PWM to 0 on the supervisor's own thread and keeps
+* the cell inhibited: Pack stops it and writes no duty while inhibited() holds.
+* A discharge fault (cell under voltage or over temperature, resistor hot or
+* its sensor lost, dropout) keeps the cell's relay inhibited: the relay must
+* not be switched on again while relayInhibited() holds, and the open callback
+* writes it off on every pass of the hold, like the charge PWM, whatever the
+* relay state says. Under voltage and a hot resistor are only seen while the
+* relay is on, so the hold is what keeps the relay open once they have tripped
+* it. A trip is held for hold_us after its last violation.
+*
+* Reaction latency, from the time a violation exists (the sample or reading
+* that crossed the limit, or the moment the last good one became too old) to
+* the output being written, goes into a Histogram (us). Reactions slower than
+* deadline_us are counted as late.
+*/
+#ifndef BMS_SUPERVISOR_H
+#define BMS_SUPERVISOR_H
+
+#include "hal.h"
+#include "histogram.h"
+#include "temp_service.h"
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+
+#define SAFETY_PERIOD_MS 10
+#define SAFETY_MAX_CELL_V 4.25f         //over the 4.2 V CV target
+#define SAFETY_MIN_CELL_V 3.0f          //while discharging
+#define SAFETY_MAX_CURRENT_MA 2500.0f   //over MAX_CHARGE_CURRENT_MA
+#define SAFETY_MAX_CELL_C 60.0f
+#define SAFETY_MAX_RESISTOR_C 70.0f     //over the balancer's 60 'C
+#define SAFETY_SAMPLE_MAX_AGE_MS 200    //10 charging periods without a good INA219 sample
+#define SAFETY_TEMP_MAX_AGE_MS 3000     //3 DS18B20 sweeps
+#define SAFETY_HOLD_MS 10000
+#define SAFETY_DEADLINE_MS 50
+
+enum SafetyFault {
+    FAULT_OVER_VOLTAGE = 0x01,
+    FAULT_UNDER_VOLTAGE = 0x02,
+    FAULT_OVER_CURRENT = 0x04,
+    FAULT_CELL_HOT = 0x08,
+    FAULT_RESISTOR_HOT = 0x10,
+    FAULT_SAMPLE_LOST = 0x20,       //no good INA219 sample within sample_max_age_us
+    FAULT_TEMP_LOST = 0x40,         //cell sensor
+    FAULT_RESISTOR_LOST = 0x80      //resistor sensor, checked while discharging
+};
+
+#define SAFETY_CHARGE_FAULTS (FAULT_OVER_VOLTAGE | FAULT_OVER_CURRENT | FAULT_CELL_HOT | FAULT_SAMPLE_LOST | FAULT_TEMP_LOST)
+#define SAFETY_DISCHARGE_FAULTS (FAULT_UNDER_VOLTAGE | FAULT_OVER_CURRENT | FAULT_CELL_HOT | FAULT_RESISTOR_HOT | FAULT_SAMPLE_LOST | FAULT_RESISTOR_LOST)
+
+struct SafetyLimits {
+    float max_cell_v = SAFETY_MAX_CELL_V;
+    float min_cell_v = SAFETY_MIN_CELL_V;
+    float max_current_ma = SAFETY_MAX_CURRENT_MA;
+    float max_cell_c = SAFETY_MAX_CELL_C;
+    float max_resistor_c = SAFETY_MAX_RESISTOR_C;
+    uint64_t sample_max_age_us = SAFETY_SAMPLE_MAX_AGE_MS * 1000ULL;
+    uint64_t temp_max_age_us = SAFETY_TEMP_MAX_AGE_MS * 1000ULL;
+    uint64_t hold_us = SAFETY_HOLD_MS * 1000ULL;
+    uint64_t deadline_us = SAFETY_DEADLINE_MS * 1000ULL;
+};
+
+class SafetySupervisor {
+public:
+    SafetySupervisor(Hal& hal, const std::vector<CellPorts>& ports, TempService& temps, const SafetyLimits& limits = SafetyLimits())
+        : hal(hal), ports(ports), temps(temps), limits(limits), cells(ports.size()) {}
+
+    //relay state of a cell (1 = on) and the way to open it (true when it was on, see RelayBank::open());
+    //without them discharge faults are only reported
+    void setRelays(std::function<int(size_t)> state, std::function<bool(size_t)> open) {
+        relay_state = state;
+        open_relay = open;
+    }
+
+    //the dropout clocks start here; call before the first check()
+    void arm() { armed_us = hal.nowUs(); }
+
+    //charging task: raw sample of a cell; voltage and current may be of two consecutive samples, each one good
+    void sample(size_t cell, float voltage, float current, uint64_t timestamp_us) {
+        if (!std::isfinite(voltage) || !std::isfinite(current)) return;     //the last good one ages instead
+        Cell& c = cells[cell];
+        c.voltage.store(voltage, std::memory_order_relaxed);
+        c.current.store(current, std::memory_order_relaxed);
+        c.sample_us.store(timestamp_us, std::memory_order_release);
+    }
+
+    //charging must stay off
+    bool inhibited(size_t cell) const { return cells[cell].inhibit.load(std::memory_order_acquire); }
+
+    //the discharge relay must stay open
+    bool relayInhibited(size_t cell) const { return cells[cell].relay_inhibit.load(std::memory_order_acquire); }
+
+    //one pass over every cell
+    void check() {
+        uint64_t now = hal.nowUs();
+        size_t n = cells.size();
+        for (size_t i = 0; i < n; i++) {
+            Cell& c = cells[i];
+            bool discharging = relay_state && relay_state(i) == 1;
+            uint32_t faults = 0;
+            uint64_t onset = now;
+            auto raise = [&](uint32_t fault, uint64_t since_us) {
+                faults |= fault;
+                onset = std::min(onset, since_us);
+            };
+
+            uint64_t sample_us = std::max(c.sample_us.load(std::memory_order_acquire), armed_us);
+            float voltage = c.voltage.load(std::memory_order_relaxed);
+            float current = c.current.load(std::memory_order_relaxed);
+            if (now - sample_us > limits.sample_max_age_us) {
+                raise(FAULT_SAMPLE_LOST, sample_us + limits.sample_max_age_us);
+            }
+            else if (c.sample_us.load(std::memory_order_relaxed)) {
+                if (voltage > limits.max_cell_v) raise(FAULT_OVER_VOLTAGE, sample_us);
+                if (std::abs(current) > limits.max_current_ma) raise(FAULT_OVER_CURRENT, sample_us);
+                if (discharging && voltage < limits.min_cell_v) raise(FAULT_UNDER_VOLTAGE, sample_us);
+            }
+
+            TempReading cell_t = temps.reading(i);
+            uint64_t cell_us = std::max(cell_t.timestamp_us, armed_us);
+            if (now - cell_us > limits.temp_max_age_us) raise(FAULT_TEMP_LOST, cell_us + limits.temp_max_age_us);
+            else if (cell_t.timestamp_us && std::isnan(cell_t.value)) raise(FAULT_TEMP_LOST, now);     //remapped, new sensor not read yet
+            else if (cell_t.timestamp_us && !(cell_t.value < limits.max_cell_c)) raise(FAULT_CELL_HOT, cell_t.timestamp_us);
+
+            if (discharging) {
+                TempReading resistor_t = temps.reading(n + i);
+                uint64_t resistor_us = std::max(resistor_t.timestamp_us, armed_us);
+                if (now - resistor_us > limits.temp_max_age_us) raise(FAULT_RESISTOR_LOST, resistor_us + limits.temp_max_age_us);
+                else if (resistor_t.timestamp_us && std::isnan(resistor_t.value)) raise(FAULT_RESISTOR_LOST, now);
+                else if (resistor_t.timestamp_us && !(resistor_t.value < limits.max_resistor_c)) raise(FAULT_RESISTOR_HOT, resistor_t.timestamp_us);
+            }
+            act(i, faults, onset, now, voltage, current, cell_t.value);
+        }
+        passes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint32_t faults(size_t cell) const { return cells[cell].faults.load(std::memory_order_relaxed); }
+    uint64_t trips() const { return trip_count.load(std::memory_order_relaxed); }
+    uint64_t late() const { return late_count.load(std::memory_order_relaxed); }
+    const Histogram& reaction() const { return reaction_us; }
+
+    static std::string faultNames(uint32_t faults) {
+        static const char* names[] = { "over voltage", "under voltage", "over current", "cell over temperature",
+                                       "resistor over temperature", "INA219 dropout", "cell sensor dropout", "resistor sensor dropout" };
+        std::string out;
+        for (int b = 0; b < 8; b++) {
+            if (faults & (1u << b)) out += (out.empty() ? "" : ", ") + std::string(names[b]);
+        }
+        return out;
+    }
+
+    //one line: trips, reaction latency p50/p99/max, late reactions, cells inhibited now (charge or relay)
+    void report(FILE* out) const {
+        HistogramSnapshot h;
+        reaction_us.snapshot(h);
+        std::string inhibited_cells;
+        for (size_t i = 0; i < cells.size(); i++) {
+            if (inhibited(i) || relayInhibited(i)) inhibited_cells += (inhibited_cells.empty() ? "" : ",") + std::to_string(i + 1);
+        }
+        fprintf(out, "safety   passes %8llu  trips %llu  reaction us p50 %llu p99 %llu max %llu  late %llu (> %llu ms)  inhibited [%s]\n",
+                (unsigned long long)passes.load(std::memory_order_relaxed), (unsigned long long)trips(), (unsigned long long)h.percentile(0.5),
+                (unsigned long long)h.percentile(0.99), (unsigned long long)h.max, (unsigned long long)late(),
+                (unsigned long long)(limits.deadline_us / 1000), inhibited_cells.c_str());
+    }
+
+    //"safety": {...} member, us
+    void json(std::string& out) const {
+        HistogramSnapshot h;
+        reaction_us.snapshot(h);
+        char text[256];
+        snprintf(text, sizeof(text), "\"safety\": {\"trips\": %llu, \"late\": %llu, \"deadline_us\": %llu, \"reaction_p50_us\": %llu, "
+                 "\"reaction_p99_us\": %llu, \"reaction_max_us\": %llu, \"faults\": [",
+                 (unsigned long long)trips(), (unsigned long long)late(), (unsigned long long)limits.deadline_us,
+                 (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99), (unsigned long long)h.max);
+        out += text;
+        for (size_t i = 0; i < cells.size(); i++) out += (i ? ", " : "") + std::to_string(faults(i));
+        out += "]}";
+    }
+
+private:
+    struct Cell {
+        std::atomic<float> voltage{NAN};
+        std::atomic<float> current{NAN};
+        std::atomic<uint64_t> sample_us{0};     //of the last good sample, 0 = none yet
+        std::atomic<uint8_t> inhibit{0};
+        std::atomic<uint8_t> relay_inhibit{0};
+        std::atomic<uint32_t> faults{0};        //found by the last pass
+        uint64_t charge_fault_us = 0;           //last pass with a charge fault; supervisor thread only
+        uint64_t discharge_fault_us = 0;        //with a discharge fault
+    };
+
+    Hal& hal;
+    std::vector<CellPorts> ports;
+    TempService& temps;
+    SafetyLimits limits;
+    std::vector<Cell> cells;
+    std::function<int(size_t)> relay_state;
+    std::function<bool(size_t)> open_relay;
+    uint64_t armed_us = 0;
+    Histogram reaction_us;
+    std::atomic<uint64_t> passes{0}, trip_count{0}, late_count{0};
+
+    void act(size_t i, uint32_t faults, uint64_t onset, uint64_t now, float voltage, float current, float celsius) {
+        Cell& c = cells[i];
+        c.faults.store(faults, std::memory_order_relaxed);
+        bool held_before = c.inhibit.load(std::memory_order_relaxed) || c.relay_inhibit.load(std::memory_order_relaxed);
+        if (faults & SAFETY_CHARGE_FAULTS) {
+            bool trip = !c.inhibit.exchange(1, std::memory_order_acq_rel);
+            hal.pwmWrite(ports[i].pwm_pin, 0);  //every pass: a duty written just before the inhibit is undone
+            c.charge_fault_us = now;
+            if (trip) {
+                reacted(onset);
+                std::cerr << "Safety: cell " << i + 1 << " charging cut, " << faultNames(faults & SAFETY_CHARGE_FAULTS)
+                          << " (" << voltage << " V, " << current << " mA, " << celsius << " C)" << std::endl;
+            }
+        }
+        else if (c.inhibit.load(std::memory_order_relaxed) && now - c.charge_fault_us >= limits.hold_us) {
+            c.inhibit.store(0, std::memory_order_release);
+            std::cout << "Safety: cell " << i + 1 << " may charge again" << std::endl;
+        }
+        uint32_t discharge = faults & SAFETY_DISCHARGE_FAULTS;
+        if (discharge) {
+            c.relay_inhibit.store(1, std::memory_order_release);   //before the relay is opened: every later on is refused
+            c.discharge_fault_us = now;
+        }
+        else if (c.relay_inhibit.load(std::memory_order_relaxed) && now - c.discharge_fault_us >= limits.hold_us) {
+            c.relay_inhibit.store(0, std::memory_order_release);
+            std::cout << "Safety: cell " << i + 1 << " may discharge again" << std::endl;
+        }
+        if (c.relay_inhibit.load(std::memory_order_relaxed) && open_relay && open_relay(i)) {    //every pass of the hold
+            if (discharge) reacted(onset);
+            std::cerr << "Safety: cell " << i + 1 << " discharge relay opened, " << (discharge ? faultNames(discharge) : "held") << std::endl;
+        }
+        bool held = c.inhibit.load(std::memory_order_relaxed) || c.relay_inhibit.load(std::memory_order_relaxed);
+        if (held_before && !held) std::cout << "Safety: cell " << i + 1 << " back within limits" << std::endl;    //every fault holds one
+    }
+
+    void reacted(uint64_t onset) {
+        uint64_t latency = hal.nowUs() - std::min(onset, hal.nowUs());
+        reaction_us.record(latency);
+        trip_count.fetch_add(1, std::memory_order_relaxed);
+        if (latency > limits.deadline_us) late_count.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+#endif
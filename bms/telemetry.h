@@ -0,0 +1,165 @@
+/*
+* brief : versioned telemetry snapshot shared by the control threads and their readers
+*
+* Each producer owns one section: cells (charging thread), thermal (fan thread)
+* and relays (command handling). A section is guarded by a sequence lock. The
+* producer makes the sequence odd, stores the whole frame and makes it even
+* again; a reader copies the section and retries if the sequence moved while it
+* was copying. Readers therefore always get a complete frame and never make a
+* producer wait. Payload words are relaxed atomics so the concurrent copy is
+* well defined; on ARM and x86 they compile to plain loads and stores.
+*
+* With a Readiness set, the first publish of the cells and of the thermal
+* section each raise a signal, for the tasks that send what they hold.
+*/
+#ifndef BMS_TELEMETRY_H
+#define BMS_TELEMETRY_H
+
+#include "pack.h"
+#include "readiness.h"
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+
+class Seqlock {     //one writer at a time, any number of readers
+public:
+    void writeBegin() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void writeEnd() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //runs copy() until it saw a stable frame; returns the frame version (0 = never written)
+    template <typename F>
+    uint64_t read(F&& copy) const {
+        while (true) {
+            uint64_t before = seq.load(std::memory_order_acquire);
+            if (before & 1) {   //write in progress
+                std::this_thread::yield();
+                continue;
+            }
+            copy();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == before) return before >> 1;
+        }
+    }
+
+private:
+    std::atomic<uint64_t> seq{0};
+};
+
+template <typename T>
+static inline void store_all(std::vector<std::atomic<T>>& dst, const T* src) {
+    for (size_t i = 0; i < dst.size(); i++) dst[i].store(src[i], std::memory_order_relaxed);
+}
+
+template <typename T>
+static inline void load_all(const std::vector<std::atomic<T>>& src, std::vector<T>& dst) {
+    dst.resize(src.size());
+    for (size_t i = 0; i < src.size(); i++) dst[i] = src[i].load(std::memory_order_relaxed);
+}
+
+struct TelemetryFrame {     //reader side copy, same layouts as the producers' arrays
+    std::vector<float> bat_data;        //BAT_DATA_STRIDE per cell
+    std::vector<float> temperature;     //[0..n) cells, [n..2n) resistors, NaN when stale
+    std::vector<int> fan_pwm;           //[0..n) cell fans, [n] resistor fan
+    std::vector<int> relay_state;       //per cell
+
+    uint64_t cells_version = 0, thermal_version = 0, relays_version = 0;
+    uint64_t cells_us = 0, thermal_us = 0, relays_us = 0;   //when each section was published
+
+    size_t cells() const { return relay_state.size(); }
+};
+
+class Telemetry {
+public:
+    explicit Telemetry(size_t cells)
+        : cell_count(cells), bat_data(BAT_DATA_STRIDE * cells), temperature(2 * cells), fan_pwm(cells), relay_state(cells) {}
+
+    size_t cells() const { return cell_count; }
+
+    //set before the producers start
+    void setReadiness(Readiness* r, size_t cells_signal, size_t thermal_signal) {
+        readiness = r;
+        cells_ready = cells_signal;
+        thermal_ready = thermal_signal;
+    }
+
+    //charging thread: bat_data[BAT_DATA_STRIDE * cells]
+    void publishCells(uint64_t now_us, const float data[]) {
+        cells_lock.writeBegin();
+        store_all(bat_data, data);
+        cells_us.store(now_us, std::memory_order_relaxed);
+        cells_lock.writeEnd();
+        if (readiness && !cells_published) readiness->signal(cells_ready);
+        cells_published = true;
+    }
+
+    //fan thread: temperature[2 * cells], fan_pwm[cells + 1]
+    void publishThermal(uint64_t now_us, const float temps[], const int fans[]) {
+        thermal_lock.writeBegin();
+        store_all(temperature, temps);
+        store_all(fan_pwm, fans);
+        resistor_fan_pwm.store(fans[cell_count], std::memory_order_relaxed);
+        thermal_us.store(now_us, std::memory_order_relaxed);
+        thermal_lock.writeEnd();
+        if (readiness && !thermal_published) readiness->signal(thermal_ready);
+        thermal_published = true;
+    }
+
+    //relays may be switched from several threads; writers queue on relay_mtx, readers never do
+    void setRelay(uint64_t now_us, size_t cell, int state) {
+        std::lock_guard<std::mutex> lock(relay_mtx);
+        relays_lock.writeBegin();
+        relay_state[cell].store(state, std::memory_order_relaxed);
+        relays_us.store(now_us, std::memory_order_relaxed);
+        relays_lock.writeEnd();
+    }
+
+    int relay(size_t cell) const { return relay_state[cell].load(std::memory_order_relaxed); }
+
+    void relays(std::vector<int>& out) const {
+        relays_lock.read([&] { load_all(relay_state, out); });
+    }
+
+    void snapshot(TelemetryFrame& frame) const {
+        frame.cells_version = cells_lock.read([&] {
+            load_all(bat_data, frame.bat_data);
+            frame.cells_us = cells_us.load(std::memory_order_relaxed);
+        });
+        frame.thermal_version = thermal_lock.read([&] {
+            load_all(temperature, frame.temperature);
+            load_all(fan_pwm, frame.fan_pwm);
+            frame.fan_pwm.push_back(resistor_fan_pwm.load(std::memory_order_relaxed));
+            frame.thermal_us = thermal_us.load(std::memory_order_relaxed);
+        });
+        frame.relays_version = relays_lock.read([&] {
+            load_all(relay_state, frame.relay_state);
+            frame.relays_us = relays_us.load(std::memory_order_relaxed);
+        });
+    }
+
+private:
+    size_t cell_count;
+    Seqlock cells_lock, thermal_lock, relays_lock;
+    std::vector<std::atomic<float>> bat_data;
+    std::vector<std::atomic<float>> temperature;
+    std::vector<std::atomic<int>> fan_pwm;    //cell fans
+    std::atomic<int> resistor_fan_pwm{0};
+    std::vector<std::atomic<int>> relay_state;
+    std::atomic<uint64_t> cells_us{0}, thermal_us{0}, relays_us{0};
+    std::mutex relay_mtx;
+    Readiness* readiness = nullptr;
+    size_t cells_ready = 0, thermal_ready = 0;
+    bool cells_published = false;   //by the producer of each section only
+    bool thermal_published = false;
+};
+
+#endif
@@ -0,0 +1,227 @@
+/*
+* brief : asynchronous DS18B20 acquisition with cached, timestamped readings
+*
+* A sweep starts one bulk conversion on the whole 1-Wire bus when the kernel
+* supports it (therm_bulk_read), then a small pool of workers reads every
+* sensor in parallel through handles opened once at startup. Without bulk
+* support each read waits for its own conversion, still in parallel. Readers
+* never touch the bus: they copy the latest value and its timestamp, and can
+* reject a reading older than they are willing to act on.
+*
+* Every read, failed ones included, goes through store(): a TraceWriter set
+* there logs it, and a replay calls it directly instead of start().
+*
+* remap() points a sensor at another device while the service runs (a
+* replaced DS18B20): the coordinator swaps the handle between two sweeps, when
+* no worker holds it, and the sensor reads NaN until the new device answers
+* (its timestamp stays that of the old device's last good reading).
+*
+* With a Readiness set, a sensor's signal goes up with its first good reading.
+*/
+#ifndef BMS_TEMP_SERVICE_H
+#define BMS_TEMP_SERVICE_H
+
+#include "hal.h"
+#include "trace.h"
+#include "readiness.h"
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#define TEMP_SWEEP_MS 1000      //sweep period
+#define TEMP_WORKERS 4          //parallel readers
+#define TEMP_MAX_AGE_MS 5000    //older readings are stale
+
+struct TempReading {
+    float value = NAN;          //'C, last good reading
+    uint64_t timestamp_us = 0;  //when it was taken, 0 = never
+    uint32_t failures = 0;      //consecutive failed reads
+};
+
+class TempService {
+public:
+    TempService(Hal& hal, const std::vector<std::string>& paths, int sweep_ms = TEMP_SWEEP_MS, int workers = TEMP_WORKERS)
+        : hal(hal), sweep_ms(sweep_ms), paths(paths), handles(paths.size()), readings(paths.size()),
+          worker_count(std::max(1, std::min(workers, static_cast<int>(paths.size())))) {
+        for (size_t i = 0; i < paths.size(); i++) handles[i] = hal.w1Open(paths[i]);
+    }
+
+    ~TempService() { stop(); }
+
+    void start() {
+        running = true;
+        for (int w = 0; w < worker_count; w++) workers.emplace_back(&TempService::worker, this, w);
+        coordinator = std::thread(&TempService::run, this);
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        {
+            std::lock_guard<std::mutex> lock(sweep_mtx);
+            generation++;
+        }
+        sweep_cv.notify_all();
+        done_cv.notify_all();
+        if (coordinator.joinable()) coordinator.join();
+        for (std::thread& t : workers) t.join();
+        workers.clear();
+    }
+
+    size_t size() const { return readings.size(); }
+
+    TempReading reading(size_t sensor) const {
+        std::lock_guard<std::mutex> lock(readings_mtx);
+        return readings[sensor];
+    }
+
+    //latest value if it is younger than max_age_us, NaN otherwise
+    float fresh(size_t sensor, uint64_t max_age_us = TEMP_MAX_AGE_MS * 1000ULL) const {
+        TempReading r = reading(sensor);
+        if (r.timestamp_us == 0 || hal.nowUs() - r.timestamp_us > max_age_us) return NAN;
+        return r.value;
+    }
+
+    //block until a sweep newer than `seen` has been published; returns its number
+    uint64_t waitSweep(uint64_t seen) {
+        std::unique_lock<std::mutex> lock(sweep_mtx);
+        done_cv.wait(lock, [&] { return completed > seen || !running; });
+        return completed;
+    }
+
+    bool bulk() const { return bulk_supported; }
+
+    std::string path(size_t sensor) const {
+        std::lock_guard<std::mutex> lock(sweep_mtx);
+        return paths[sensor];
+    }
+
+    //takes effect before the next sweep, at once when the service is not running
+    void remap(size_t sensor, const std::string& path) {
+        {
+            std::lock_guard<std::mutex> lock(sweep_mtx);
+            remaps.push_back({ sensor, path });
+        }
+        if (!running) applyRemaps();
+    }
+
+    void setTrace(TraceWriter* writer) { trace = writer; }
+
+    //signals[i] goes up with the first good reading of sensor i; set before start()
+    void setReadiness(Readiness* r, const std::vector<size_t>& signals) {
+        readiness = r;
+        ready_signals = signals;
+    }
+
+    //one read of sensor taken at now_us, NaN when it failed
+    void store(size_t sensor, double value, uint64_t now_us) {
+        if (trace) trace->temperature(now_us, sensor, value);
+        bool first = false;
+        {
+            std::lock_guard<std::mutex> lock(readings_mtx);
+            if (std::isnan(value)) {
+                readings[sensor].failures++;
+            }
+            else {
+                first = readings[sensor].timestamp_us == 0;
+                readings[sensor].value = static_cast<float>(value);
+                readings[sensor].timestamp_us = now_us;
+                readings[sensor].failures = 0;
+            }
+        }
+        if (first && readiness) readiness->signal(ready_signals[sensor]);
+    }
+
+private:
+    Hal& hal;
+    int sweep_ms;
+    std::vector<std::string> paths;     //guarded by sweep_mtx
+    std::vector<int> handles;           //written only between sweeps
+    std::vector<TempReading> readings;
+    mutable std::mutex readings_mtx;
+
+    int worker_count;
+    std::vector<std::thread> workers;
+    std::thread coordinator;
+    std::atomic<bool> running{false};
+    std::atomic<bool> bulk_supported{false};
+    TraceWriter* trace = nullptr;
+    Readiness* readiness = nullptr;
+    std::vector<size_t> ready_signals;
+
+    mutable std::mutex sweep_mtx;
+    std::condition_variable sweep_cv;   //coordinator -> workers: new sweep
+    std::condition_variable done_cv;    //workers -> coordinator, readers: sweep finished
+    uint64_t generation = 0;
+    uint64_t completed = 0;
+    int pending = 0;
+    std::vector<std::pair<size_t, std::string>> remaps;    //sensor, new path
+
+    void run() {
+        while (running) {
+            uint64_t start = hal.nowUs();
+            applyRemaps();
+            bulk_supported = hal.w1BulkConvert();
+            std::unique_lock<std::mutex> lock(sweep_mtx);
+            pending = worker_count;
+            generation++;
+            sweep_cv.notify_all();
+            done_cv.wait(lock, [&] { return pending == 0 || !running; });
+            completed = generation;
+            lock.unlock();
+            done_cv.notify_all();
+
+            uint64_t elapsed_ms = (hal.nowUs() - start) / 1000;
+            if (elapsed_ms < static_cast<uint64_t>(sweep_ms)) hal.sleepMs(sweep_ms - static_cast<int>(elapsed_ms));
+        }
+    }
+
+    void applyRemaps() {   //no sweep in flight
+        std::vector<std::pair<size_t, std::string>> todo;
+        {
+            std::lock_guard<std::mutex> lock(sweep_mtx);
+            todo.swap(remaps);
+        }
+        for (const auto& r : todo) {
+            int handle = hal.w1Open(r.second);
+            hal.w1Close(handles[r.first]);
+            handles[r.first] = handle;
+            {
+                std::lock_guard<std::mutex> lock(sweep_mtx);
+                paths[r.first] = r.second;
+            }
+            std::lock_guard<std::mutex> lock(readings_mtx);
+            readings[r.first].value = NAN;      //missing, not stale: the timestamp still tells how long
+            readings[r.first].failures = 0;
+        }
+    }
+
+    void worker(int id) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sweep_mtx);
+                sweep_cv.wait(lock, [&] { return generation != seen || !running; });
+                if (!running) return;
+                seen = generation;
+            }
+            for (size_t i = id; i < handles.size(); i += worker_count) {
+                double value = hal.w1Read(handles[i]);
+                store(i, value, hal.nowUs());
+            }
+            {
+                std::lock_guard<std::mutex> lock(sweep_mtx);
+                pending--;
+            }
+            done_cv.notify_all();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+/*
+* brief : fan control - per-fan curves with hysteresis, dT/dt lead, slew limits, write on change
+*
+* Every fan maps one temperature (a cell, or the hottest discharge resistor)
+* to a speed through its own FanCurve, in four steps:
+*   - lead: the temperature is taken lead_s ahead along its rising slope
+*     (dT/dt, low pass filtered over slope_tau_s), so the fan spins up
+*     before the peak instead of after it; a falling slope adds nothing
+*   - hysteresis: the curve input follows a rising temperature at once but
+*     only follows it down once it has dropped hysteresis_c below, so sensor
+*     noise around a breakpoint does not move the fan
+*   - curve: 0 % up to start_c, then linear from min_percent to 100 % at full_c
+*   - slew: the speed moves at most slew_up / slew_down % per second
+* A missing or stale temperature drives the fan to failsafe_percent at once.
+* The PWM channel is only written, and update() only reports a change, when
+* the whole-percent command differs from the one last written.
+*/
+#ifndef BMS_THERMAL_H
+#define BMS_THERMAL_H
+
+#include "hal.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#define FAN_CELL_START_C 20.0f
+#define FAN_CELL_FULL_C 40.0f
+#define FAN_RESISTOR_START_C 20.0f
+#define FAN_RESISTOR_FULL_C 50.0f
+#define FAN_HYSTERESIS_C 1.0f
+#define FAN_LEAD_S 20.0f            //look ahead along a rising slope
+#define FAN_SLOPE_TAU_S 10.0f       //dT/dt low pass; DS18B20 steps are 1/16 'C
+#define FAN_SLEW_UP 25.0f           //%/s
+#define FAN_SLEW_DOWN 5.0f          //%/s
+
+struct FanCurve {
+    float start_c = FAN_CELL_START_C;
+    float full_c = FAN_CELL_FULL_C;
+    float min_percent = 0.0f;       //at start_c, for fans that stall below it
+    float hysteresis_c = FAN_HYSTERESIS_C;
+    float lead_s = FAN_LEAD_S;
+    float slope_tau_s = FAN_SLOPE_TAU_S;
+    float slew_up = FAN_SLEW_UP;
+    float slew_down = FAN_SLEW_DOWN;
+    float failsafe_percent = 100.0f;
+
+    float percent(float celsius) const {
+        if (!(celsius > start_c)) return 0.0f;
+        if (!(celsius < full_c)) return 100.0f;
+        return min_percent + (celsius - start_c) / (full_c - start_c) * (100.0f - min_percent);
+    }
+};
+
+class ThermalController {
+public:
+    int pwm_range = PWM_RANGE;  //fan pwm channel steps; commands (%) are scaled to it
+
+    explicit ThermalController(Hal& hal) : hal(hal) {}
+
+    //returns the fan index
+    size_t addFan(int pin, const FanCurve& curve) {
+        fans.push_back(Fan());
+        fans.back().pin = pin;
+        fans.back().curve = curve;
+        return fans.size() - 1;
+    }
+
+    void setCurve(size_t fan, const FanCurve& curve) { fans[fan].curve = curve; }
+    const FanCurve& curve(size_t fan) const { return fans[fan].curve; }
+
+    //one reading (NaN = missing or stale); true when the fan was written
+    bool update(size_t index, float celsius, uint64_t now_us) {
+        Fan& fan = fans[index];
+        const FanCurve& c = fan.curve;
+        float dt = fan.last_us ? (now_us - fan.last_us) / 1e6f : 0.0f;
+        fan.last_us = now_us;
+
+        float target;
+        if (std::isnan(celsius)) {
+            fan.last_c = fan.held_c = NAN;
+            fan.slope = 0.0f;
+            fan.speed = std::max(fan.speed, c.failsafe_percent);    //no slew on the way to the failsafe
+            target = fan.speed;
+        }
+        else {
+            if (!std::isnan(fan.last_c) && dt > 0.0f) {
+                float raw = (celsius - fan.last_c) / dt;
+                fan.slope += (raw - fan.slope) * dt / (c.slope_tau_s + dt);
+            }
+            fan.last_c = celsius;
+            float ahead = celsius + c.lead_s * std::max(0.0f, fan.slope);
+            if (std::isnan(fan.held_c) || ahead > fan.held_c) fan.held_c = ahead;
+            else if (ahead < fan.held_c - c.hysteresis_c) fan.held_c = ahead + c.hysteresis_c;
+            target = c.percent(fan.held_c);
+            if (dt > 0.0f && fan.command >= 0) {
+                fan.speed = std::min(fan.speed + c.slew_up * dt, std::max(fan.speed - c.slew_down * dt, target));
+            }
+            else {
+                fan.speed = target;     //first reading
+            }
+        }
+
+        int command = static_cast<int>(std::lround(fan.speed));
+        if (command == fan.command) return false;
+        fan.command = command;
+        hal.pwmWrite(fan.pin, command * pwm_range / 100);
+        writes++;
+        return true;
+    }
+
+    size_t size() const { return fans.size(); }
+    int command(size_t fan) const { return std::max(0, fans[fan].command); }    //% last written
+    float slope(size_t fan) const { return fans[fan].slope; }                  //'C/s, filtered
+    uint64_t writeCount() const { return writes; }
+
+private:
+    struct Fan {
+        int pin = -1;
+        FanCurve curve;
+        uint64_t last_us = 0;
+        float last_c = NAN;
+        float slope = 0.0f;
+        float held_c = NAN;     //curve input after hysteresis
+        float speed = 0.0f;     //%, after slew
+        int command = -1;       //last written, -1 = never
+    };
+
+    Hal& hal;
+    std::vector<Fan> fans;
+    uint64_t writes = 0;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+* brief : pack topology from a config file, DS18B20 discovery on the 1-Wire bus
+*
+* One line per setting, '#' starts a comment:
+*   server_ip 192.168.0.155
+*   resistor_fan 13
+*   w1_dir /sys/bus/w1/devices
+*   cell mux=0x70 channel=5 ina=0x40 bus=1 pwm=1 fan=4 relay=0 temp=28-3ce1d44372ac resistor=28-031660efe1ff
+* Cells are numbered in file order. A sensor is a 1-Wire device id, looked up
+* as w1_dir/<id>/w1_slave, or a full path. mux, ina and bus default to
+* TCA_ADDR, INA219_ADDR and I2C_BUS; the rest of a cell line is required. Two
+* cells sharing a pin or a sensor is an error, so a copy-paste slip never
+* drives one fan from two cells.
+*
+* w1_scan() lists the temperature sensors the kernel has enumerated, so a
+* sensor the config names but the bus does not have (unplugged, replaced) and
+* a sensor on the bus that no cell uses (the replacement) can be reported by id.
+*/
+#ifndef BMS_TOPOLOGY_H
+#define BMS_TOPOLOGY_H
+
+#include "hal.h"
+#include "ina219.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+
+#define W1_DEVICES_DIR "/sys/bus/w1/devices"
+
+struct Topology {
+    std::vector<CellPorts> cells;
+    int resistor_fan_pin = -1;      //-1 = not set
+    std::string server_ip;          //empty = not set
+    std::string w1_dir = W1_DEVICES_DIR;
+};
+
+//sysfs path of a 1-Wire device id; a path is taken as it is
+inline std::string w1_sensor_path(const std::string& dir, const std::string& sensor) {
+    if (sensor.find('/') != std::string::npos) return sensor;
+    return dir + "/" + sensor + "/w1_slave";
+}
+
+//device id of a sysfs path (".../28-3ce1d44372ac/w1_slave" -> "28-3ce1d44372ac"), the path itself otherwise
+inline std::string w1_sensor_id(const std::string& path) {
+    size_t end = path.rfind("/w1_slave");
+    if (end == std::string::npos || end == 0) return path;
+    size_t start = path.rfind('/', end - 1);
+    return path.substr(start == std::string::npos ? 0 : start + 1, end - (start == std::string::npos ? 0 : start + 1));
+}
+
+//DS18B20 / DS18S20 / DS1822 / DS1825 / MAX31850 ids under dir, sorted; empty when dir is missing
+inline std::vector<std::string> w1_scan(const std::string& dir = W1_DEVICES_DIR) {
+    static const char* families[] = { "28-", "10-", "22-", "3b-", "42-" };
+    std::vector<std::string> ids;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return ids;
+    while (dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        for (const char* family : families) {
+            if (name.compare(0, 3, family) == 0) ids.push_back(name);
+        }
+    }
+    closedir(d);
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+//false with error set ("line N: ...") on a malformed file; a missing file is errno ENOENT and an empty error
+inline bool load_topology(const std::string& path, Topology& topology, std::string& error) {
+    std::ifstream file(path);
+    error.clear();
+    if (!file.is_open()) {
+        if (errno != ENOENT) error = path + ": " + strerror(errno);
+        return false;
+    }
+    Topology t;
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string key;
+        if (!(words >> key)) continue;
+        std::string where = "line " + std::to_string(number) + ": ";
+        if (key == "server_ip" || key == "w1_dir") {
+            std::string value;
+            if (!(words >> value)) {
+                error = where + key + " needs a value";
+                return false;
+            }
+            (key == "server_ip" ? t.server_ip : t.w1_dir) = value;
+        }
+        else if (key == "resistor_fan") {
+            if (!(words >> t.resistor_fan_pin) || t.resistor_fan_pin < 0) {
+                error = where + "resistor_fan needs a pin";
+                return false;
+            }
+        }
+        else if (key == "cell") {
+            CellPorts port{ TCA_ADDR, -1, INA219_ADDR, -1, -1, -1, "", "" };
+            std::string field;
+            while (words >> field) {
+                size_t eq = field.find('=');
+                std::string name = field.substr(0, eq);
+                std::string value = eq == std::string::npos ? "" : field.substr(eq + 1);
+                char* end = nullptr;
+                long number_value = strtol(value.c_str(), &end, 0);
+                bool numeric = !value.empty() && *end == 0 && number_value >= 0;
+                int* target = name == "mux" ? &port.mux_addr : name == "channel" ? &port.mux_channel : name == "ina" ? &port.ina_addr :
+                              name == "bus" ? &port.i2c_bus : name == "pwm" ? &port.pwm_pin : name == "fan" ? &port.fan_pin :
+                              name == "relay" ? &port.relay_pin : nullptr;
+                if (target && numeric) *target = static_cast<int>(number_value);
+                else if (name == "temp" && !value.empty()) port.temp_path = value;
+                else if (name == "resistor" && !value.empty()) port.resistor_temp_path = value;
+                else {
+                    error = where + "bad field '" + field + "'";
+                    return false;
+                }
+            }
+            if (port.mux_channel < 0 || port.mux_channel > 7 || port.pwm_pin < 0 || port.fan_pin < 0 || port.relay_pin < 0 ||
+                port.temp_path.empty() || port.resistor_temp_path.empty()) {
+                error = where + "a cell needs channel (0..7), pwm, fan, relay, temp and resistor";
+                return false;
+            }
+            t.cells.push_back(port);
+        }
+        else {
+            error = where + "unknown setting '" + key + "'";
+            return false;
+        }
+    }
+    if (t.cells.empty()) {
+        error = "no cells";
+        return false;
+    }
+
+    std::vector<int> pins;
+    std::vector<std::string> paths;
+    for (CellPorts& p : t.cells) {     //w1_dir may come after the cells
+        p.temp_path = w1_sensor_path(t.w1_dir, p.temp_path);
+        p.resistor_temp_path = w1_sensor_path(t.w1_dir, p.resistor_temp_path);
+    }
+    if (t.resistor_fan_pin >= 0) pins.push_back(t.resistor_fan_pin);
+    for (size_t i = 0; i < t.cells.size(); i++) {
+        const CellPorts& p = t.cells[i];
+        for (int pin : { p.pwm_pin, p.fan_pin, p.relay_pin }) {
+            if (std::find(pins.begin(), pins.end(), pin) != pins.end()) {
+                error = "cell " + std::to_string(i + 1) + ": pin " + std::to_string(pin) + " used twice";
+                return false;
+            }
+            pins.push_back(pin);
+        }
+        for (const std::string* sensor : { &p.temp_path, &p.resistor_temp_path }) {
+            if (std::find(paths.begin(), paths.end(), *sensor) != paths.end()) {
+                error = "cell " + std::to_string(i + 1) + ": sensor " + w1_sensor_id(*sensor) + " used twice";
+                return false;
+            }
+            paths.push_back(*sensor);
+        }
+    }
+    topology = t;
+    return true;
+}
+
+#endif
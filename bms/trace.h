@@ -0,0 +1,307 @@
+/*
+* brief : sensor trace recording and replay - raw INA219 / 1-Wire readings in, control decisions out
+*
+* TraceWriter logs every raw reading the control code consumes, as it is
+* taken: each cell sample of an acquisition sweep (before any filtering),
+* each DS18B20 read (NaN for a failed one), and each remote command. A
+* TRACE_SWEEP record closes every sweep with the time the control step ran.
+* Records go through one stdio buffer under a mutex, so a control loop only
+* pays a copy; flush() pushes them to the file (the status task does it once
+* a second, so a crash loses at most that much).
+*
+* TraceReader walks a trace back in file order. The replay mode of the main
+* program feeds it through the same Pack, TempService, ThermalController and
+* Balancer code on ReplayHal: a virtual clock that the replay sets to each
+* record's timestamp, nothing sleeps, and every duty, fan and relay change
+* the control code makes is written out as one line. The header keeps the
+* recording's settings that change decisions (TRACE_BALANCE), so a replay
+* takes them from the trace, not from its own environment; a version 1 trace
+* has none.
+*
+* file   : "BMSTRACE" | version u32 | cells u32 | sensors u32 | settings u32 (version 2)
+* record : kind u8 | timestamp u64 (us, the recording Hal's clock) | payload, little-endian
+*   TRACE_CELL    cell u16 | voltage f32 | current f32 | power f32 | flags u8 (TRACE_READY, TRACE_OVERFLOW)
+*   TRACE_SWEEP   cells u16 (the TRACE_CELL records just before it)
+*   TRACE_W1      sensor u16 | celsius f32 (TempService order: cells, then resistors)
+*   TRACE_COMMAND cell u16 | type u8 | value i32
+*/
+#ifndef BMS_TRACE_H
+#define BMS_TRACE_H
+
+#include "hal.h"
+#include "bytes.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#define TRACE_MAGIC "BMSTRACE"
+#define TRACE_VERSION 2
+#define TRACE_HEADER_SIZE 24
+#define TRACE_V1_HEADER_SIZE 20
+#define TRACE_BUFFER (1 << 20)  //stdio buffer, ~1 min of a 3-cell pack at 50 Hz
+
+enum TraceKind {
+    TRACE_CELL = 1,
+    TRACE_SWEEP,
+    TRACE_W1,
+    TRACE_COMMAND
+};
+
+#define TRACE_READY 0x01
+#define TRACE_OVERFLOW 0x02
+
+#define TRACE_BALANCE 0x01      //settings: the balancer was running
+
+static inline size_t trace_payload_size(uint8_t kind) {
+    switch (kind) {
+    case TRACE_CELL: return 15;
+    case TRACE_SWEEP: return 2;
+    case TRACE_W1: return 6;
+    case TRACE_COMMAND: return 7;
+    default: return 0;
+    }
+}
+
+struct TraceRecord {
+    uint8_t kind = 0;
+    uint64_t timestamp_us = 0;
+    uint16_t index = 0;     //cell, sensor, or the cell count of a sweep
+    float voltage = NAN;    //TRACE_CELL
+    float current = NAN;
+    float power = NAN;
+    uint8_t flags = 0;
+    float celsius = NAN;    //TRACE_W1
+    uint8_t type = 0;       //TRACE_COMMAND
+    int32_t value = 0;
+};
+
+class TraceWriter {     //any thread
+public:
+    ~TraceWriter() { close(); }
+
+    bool open(const std::string& path, size_t cells, size_t sensors, uint32_t settings) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        setvbuf(file, nullptr, _IOFBF, TRACE_BUFFER);
+        uint8_t header[TRACE_HEADER_SIZE];
+        memcpy(header, TRACE_MAGIC, 8);
+        uint8_t* p = put_u32(header + 8, TRACE_VERSION);
+        p = put_u32(p, static_cast<uint32_t>(cells));
+        p = put_u32(p, static_cast<uint32_t>(sensors));
+        put_u32(p, settings);
+        return fwrite(header, sizeof(header), 1, file) == 1;
+    }
+
+    void cell(uint64_t now_us, size_t cell, float voltage, float current, float power, bool ready, bool overflow) {
+        uint8_t payload[15];
+        uint8_t* p = put_u16(payload, static_cast<uint16_t>(cell));
+        p = put_f32(p, voltage);
+        p = put_f32(p, current);
+        p = put_f32(p, power);
+        put_u8(p, (ready ? TRACE_READY : 0) | (overflow ? TRACE_OVERFLOW : 0));
+        write(TRACE_CELL, now_us, payload);
+    }
+
+    void sweep(uint64_t now_us, size_t cells) {
+        uint8_t payload[2];
+        put_u16(payload, static_cast<uint16_t>(cells));
+        write(TRACE_SWEEP, now_us, payload);
+    }
+
+    void temperature(uint64_t now_us, size_t sensor, double celsius) {
+        uint8_t payload[6];
+        put_f32(put_u16(payload, static_cast<uint16_t>(sensor)), static_cast<float>(celsius));
+        write(TRACE_W1, now_us, payload);
+    }
+
+    void command(uint64_t now_us, uint16_t cell, uint8_t type, int32_t value) {     //protocol.h Command fields
+        uint8_t payload[7];
+        uint8_t* p = put_u16(payload, cell);
+        p = put_u8(p, type);
+        put_u32(p, static_cast<uint32_t>(value));
+        write(TRACE_COMMAND, now_us, payload);
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (file) fflush(file);
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+    uint64_t records() const { return count.load(std::memory_order_relaxed); }
+
+private:
+    FILE* file = nullptr;
+    std::mutex mtx;
+    std::atomic<uint64_t> count{0};
+
+    void write(uint8_t kind, uint64_t now_us, const uint8_t* payload) {
+        uint8_t record[9 + 15];
+        put_u64(put_u8(record, kind), now_us);
+        size_t size = trace_payload_size(kind);
+        memcpy(record + 9, payload, size);
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!file) return;
+        fwrite(record, 9 + size, 1, file);
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+class TraceReader {
+public:
+    ~TraceReader() {
+        if (file) fclose(file);
+    }
+
+    //false when the file is missing or not a trace
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        uint8_t header[TRACE_HEADER_SIZE];
+        bool valid = fread(header, TRACE_V1_HEADER_SIZE, 1, file) == 1 && memcmp(header, TRACE_MAGIC, 8) == 0;
+        version = valid ? get_u32(header + 8) : 0;
+        if (version == TRACE_VERSION) valid = fread(header + TRACE_V1_HEADER_SIZE, TRACE_HEADER_SIZE - TRACE_V1_HEADER_SIZE, 1, file) == 1;
+        else valid = version == 1;
+        if (!valid) {
+            fclose(file);
+            file = nullptr;
+            return false;
+        }
+        cell_count = get_u32(header + 12);
+        sensor_count = get_u32(header + 16);
+        setting_bits = version == TRACE_VERSION ? get_u32(header + 20) : 0;
+        return true;
+    }
+
+    size_t cells() const { return cell_count; }
+    size_t sensors() const { return sensor_count; }
+    bool hasSettings() const { return version >= 2; }
+    uint32_t settings() const { return setting_bits; }
+
+    //false at the end of the trace, or at a torn or unknown record
+    bool next(TraceRecord& r) {
+        uint8_t record[9 + 15];
+        if (!file || fread(record, 9, 1, file) != 1) return false;
+        size_t size = trace_payload_size(record[0]);
+        if (size == 0 || fread(record + 9, size, 1, file) != 1) return false;
+        const uint8_t* p = record + 9;
+        r = TraceRecord();
+        r.kind = record[0];
+        r.timestamp_us = get_u64(record + 1);
+        r.index = get_u16(p);
+        switch (r.kind) {
+        case TRACE_CELL:
+            r.voltage = get_f32(p + 2);
+            r.current = get_f32(p + 6);
+            r.power = get_f32(p + 10);
+            r.flags = p[14];
+            break;
+        case TRACE_W1:
+            r.celsius = get_f32(p + 2);
+            break;
+        case TRACE_COMMAND:
+            r.type = p[2];
+            r.value = static_cast<int32_t>(get_u32(p + 3));
+            break;
+        }
+        return true;
+    }
+
+private:
+    FILE* file = nullptr;
+    size_t cell_count = 0;
+    size_t sensor_count = 0;
+    uint32_t version = 0;
+    uint32_t setting_bits = 0;
+};
+
+//Hal of a replay: the buses are never read, the clock is set by the replay, and
+//every change of a charge duty, fan or relay output becomes one line of out
+//(time_s,output,index,value; duty and fans in %, relays 0/1)
+class ReplayHal : public Hal {
+public:
+    ReplayHal(const std::vector<CellPorts>& ports, int resistor_fan_pin, FILE* out) : out(out) {
+        for (size_t i = 0; i < ports.size(); i++) {
+            int cell = static_cast<int>(i) + 1;
+            outputs[ports[i].pwm_pin] = { "duty", cell };
+            outputs[ports[i].fan_pin] = { "fan", cell };
+            outputs[ports[i].relay_pin] = { "relay", cell };
+        }
+        outputs[resistor_fan_pin] = { "resistor_fan", 0 };
+        fprintf(out, "time_s,output,index,value\n");
+    }
+
+    void setNow(uint64_t now_us) {
+        if (now_us > now) now = now_us;     //records of different threads may interleave slightly out of order
+    }
+
+    uint64_t changes() const { return change_count; }
+
+    int setup() override { return 0; }
+
+    int i2cSetup(int bus, int address) override { return (bus << 8) + address; }
+    int i2cWrite(int /*fd*/, int /*data*/) override { return 0; }
+    int i2cReadReg16(int /*fd*/, int /*reg*/) override { return -1; }   //samples come from the trace
+    int i2cWriteReg16(int /*fd*/, int /*reg*/, int /*data*/) override { return 0; }
+
+    void pinMode(int /*pin*/, int /*mode*/) override {}
+    void digitalWrite(int pin, int value) override { change(pin, value == HIGH ? 1.0 : 0.0); }
+    int pwmCreate(int pin, int initial, int range, int /*frequency_hz*/) override {
+        ranges[pin] = range;
+        last[pin] = std::min(range, std::max(0, initial)) * 100.0 / range;
+        return 0;
+    }
+    void pwmWrite(int pin, int value) override {
+        auto it = ranges.find(pin);
+        int range = it == ranges.end() ? PWM_RANGE : it->second;
+        change(pin, std::min(range, std::max(0, value)) * 100.0 / range);
+    }
+
+    double readTemperature(const std::string& /*sensorPath*/) override { return NAN; }
+    int w1Open(const std::string& /*sensorPath*/) override { return handles++; }
+    double w1Read(int /*handle*/) override { return NAN; }
+    void w1Close(int /*handle*/) override {}
+    bool w1BulkConvert() override { return false; }
+
+    void sleepMs(int ms) override { now += static_cast<uint64_t>(std::max(0, ms)) * 1000; }
+    void sleepUntilUs(uint64_t deadline_us) override { setNow(deadline_us); }
+    uint64_t nowUs() override { return now; }
+
+private:
+    struct Output {
+        const char* name;
+        int index;      //cell, from 1; 0 for the resistor fan
+    };
+
+    FILE* out;
+    uint64_t now = 0;
+    uint64_t change_count = 0;
+    int handles = 0;
+    std::unordered_map<int, Output> outputs;
+    std::unordered_map<int, int> ranges;
+    std::unordered_map<int, double> last;   //pin -> value last written
+
+    void change(int pin, double value) {
+        auto it = last.find(pin);
+        if (it != last.end() && it->second == value) return;
+        last[pin] = value;
+        auto o = outputs.find(pin);
+        if (o == outputs.end()) return;
+        change_count++;
+        fprintf(out, "%.3f,%s,%d,%g\n", now / 1e6, o->second.name, o->second.index, value);
+    }
+};
+
+#endif
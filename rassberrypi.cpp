@@ -17,26 +17,50 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <wiringPiI2C.h>
-#include <wiringPi.h>
 #include <unistd.h>
 #include <cstdint>
-#include <dirent.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <algorithm>
 #include <chrono>
-#include <softPwm.h>
 #include <cstring>
 #include <cmath>
+#include <cstdlib>
+#include <csignal>
+
+#include "bms/hal.h"
+#include "bms/pack.h"
+#include "bms/temp_service.h"
+#include "bms/telemetry.h"
+#include "bms/capture.h"
+#include "bms/protocol.h"
+#include "bms/net_engine.h"
+#include "bms/journal.h"
+#include "bms/scheduler.h"
+#include "bms/stats.h"
+#include "bms/thermal.h"
+#include "bms/balancer.h"
+#include "bms/trace.h"
+#include "bms/topology.h"
+#include "bms/readiness.h"
+#include "bms/supervisor.h"
+#include "bms/relays.h"
+#ifdef BMS_SIMULATION
+#include "bms/sim_hal.h"
+#endif
 
 #define SERVER_PORT 9000
 #define SERVER_IP "192.168.0.155"
-
-#define TCA_ADDR 0x70   //TCA9548A ina219 default address
+#define TELEMETRY_PERIOD_MS 1000
+#define FAN_PERIOD_MS TEMP_SWEEP_MS
+#define STATUS_PERIOD_MS 1000
+#define JOURNAL_PATH "bms_telemetry.journal"
+#define REPLAY_OUT "replay.csv"
+#define CONFIG_PATH "bms.conf"
 
 #define RELAY_PIN1 0    //discharge relay
 #define RELAY_PIN2 2
@@ -51,10 +75,6 @@
 #define BATTERY2_PWM_PIN 23
 #define BATTERY3_PWM_PIN 16
 
-#define MAX_CRITICAL_TEMPERATURE 60
-#define MAX_SAFE_TEMPERATURE 50
-#define TARGET_VOLTAGE 4.2
-
 #define BAT1_TEMP_ADDR "/sys/bus/w1/devices/28-3ce1d44372ac/w1_slave"
 #define BAT2_TEMP_ADDR "/sys/bus/w1/devices/28-3ce1d4431bf2/w1_slave"
 #define BAT3_TEMP_ADDR "/sys/bus/w1/devices/28-0316611a16ff/w1_slave"
@@ -63,862 +83,892 @@
 #define RESISTER2_TEMP_ADDR "/sys/bus/w1/devices/28-0316612a37ff/w1_slave"
 #define RESISTER3_TEMP_ADDR "/sys/bus/w1/devices/28-031661131fff/w1_slave"
 
-//charging mode
-enum ChargingMode {
-    STOP_CHARGING,
-    STANDARD_CHARGING,
-    FAST_CHARGING
-};
-
-int relay_state[4];
-std::mutex mtx;
-
-class TCA9548A {  //tca9548a ina219 structure
-public:
-    TCA9548A(int address) : address(address) {
-        fd = wiringPiI2CSetup(address);
-        if (fd == -1) {
-            std::cerr << "Failed to initialize I2C communication.\n";
-            exit(1);
-        }
-        wiringPiI2CWriteReg16(fd, 0x00, 0x399F); // Initialize INA219
-    }
-
-    float readBusVoltage() {
-        int16_t value = readRegister(0x02);
-        return value * 0.0005;
-    }
-
-    float readShuntVoltage() {
-        int16_t value = readRegister(0x01);
-        return value * 0.01;
-    }
-
-    float readCurrent() {
-        int16_t value = readRegister(0x04);
-        return value * 0.1;
-    }
-
-private:
-    int fd;
-    int address;
-
-    int16_t readRegister(uint8_t reg) {
-        int16_t value = wiringPiI2CReadReg16(fd, reg);
-        // Swap bytes to correct endianness
-        value = (value << 8) | ((value >> 8) & 0xFF);
-        return value;
-    }
-};
+std::vector<CellPorts> cell_ports;  //pack topology, one entry per cell
+Hal* hal = nullptr;    //WiringPiHal on the rig, SimHal with -DBMS_SIMULATION
+Telemetry* telemetry = nullptr;     //latest frame of every producer, relay state
+SampleCapture* capture = nullptr;   //every control loop sample, null when capture is off
+Journal* journal = nullptr;         //telemetry frames kept until the server acks them, null when off
+StageStats* stage_stats = nullptr;  //hot path timing, null when BMS_STATS=0
+PwmConfig charge_pwm;   //frequency and steps of the charge channels
+PwmConfig fan_pwm;      //of the cell and resistor fans
+TraceWriter* trace = nullptr;       //raw readings and commands, null when BMS_TRACE is unset
+bool verbose = true;    //console lines per control step, off in a replay
+int resistor_fan_pin = RESISTER_FAN_PIN;    //the config file's, or the bench rig's
+RelayBank* relays = nullptr;        //discharge relays, switched by the operator, the balancer and the supervisor
+std::atomic<bool> reload_requested{false};  //SIGHUP, handled by the status task
+
+void request_reload(int) { reload_requested = true; }
+
+std::vector<CellPorts> rig_ports() {   //3-cell bench rig, when there is no config file
+    return {
+        { TCA_ADDR, 5, INA219_ADDR, BATTERY1_PWM_PIN, BATTERY1_FAN_PIN, RELAY_PIN1, BAT1_TEMP_ADDR, RESISTER1_TEMP_ADDR },
+        { TCA_ADDR, 6, INA219_ADDR, BATTERY2_PWM_PIN, BATTERY2_FAN_PIN, RELAY_PIN2, BAT2_TEMP_ADDR, RESISTER2_TEMP_ADDR },
+        { TCA_ADDR, 7, INA219_ADDR, BATTERY3_PWM_PIN, BATTERY3_FAN_PIN, RELAY_PIN3, BAT3_TEMP_ADDR, RESISTER3_TEMP_ADDR },
+    };
+}
 
-void selectTCA9548AChannel(int fd, int channel) {
-    if (channel > 7) {
-        std::cerr << "Invalid channel number.\n";
-        exit(1);
+#ifdef BMS_SIMULATION
+//synthetic n-cell pack dealt round robin over buses 1..n, each with 8 muxes x 8 channels x 16 INA219 addresses
+std::vector<CellPorts> sim_ports(int cells, int buses = 1) {
+    std::vector<CellPorts> ports;
+    for (int i = 0; i < cells; i++) {
+        std::string id = std::to_string(i + 1);
+        int j = i / buses;  //position on its bus
+        ports.push_back({ TCA_ADDR + (j / 8) % 8, j % 8, INA219_ADDR + j / 64,
+                          100 + i, 300 + i, 500 + i, "/sim/w1/cell-" + id, "/sim/w1/resister-" + id, I2C_BUS + i % buses });
     }
-    wiringPiI2CWrite(fd, 1 << channel);
+    return ports;
 }
+#endif
 
 void setup() {
     // Initialize wiringPi
-    if (wiringPiSetup() == -1) {
+    if (hal->setup() == -1) {
         std::cerr << "Failed to initialize wiringPi!" << std::endl;
         exit(1);
     }
 
-    // Set the relay pin as an output
-    pinMode(RELAY_PIN1, OUTPUT);
-    pinMode(RELAY_PIN2, OUTPUT);
-    pinMode(RELAY_PIN3, OUTPUT);
-
-    pinMode(BATTERY1_FAN_PIN, OUTPUT);
-    pinMode(BATTERY2_FAN_PIN, OUTPUT);
-    pinMode(BATTERY3_FAN_PIN, OUTPUT);
-
-    pinMode(RESISTER_FAN_PIN, OUTPUT);
+    for (const CellPorts& port : cell_ports) {
+        // Set the relay pin as an output
+        hal->pinMode(port.relay_pin, OUTPUT);
+        hal->pinMode(port.fan_pin, OUTPUT);
+        hal->pinMode(port.pwm_pin, OUTPUT);
 
-    pinMode(BATTERY1_PWM_PIN, OUTPUT);
-    pinMode(BATTERY2_PWM_PIN, OUTPUT);
-    pinMode(BATTERY3_PWM_PIN, OUTPUT);
-
-    // Set the initial state of the relay to off (LOW)
-    digitalWrite(RELAY_PIN1, LOW);
-    digitalWrite(RELAY_PIN2, LOW);
-    digitalWrite(RELAY_PIN3, LOW);
+        // Set the initial state of the relay to off (LOW)
+        hal->digitalWrite(port.relay_pin, LOW);
+    }
+    hal->pinMode(resistor_fan_pin, OUTPUT);
     std::cout << "Relay initialized to off state." << std::endl;
 
-    wiringPiSetup();
-
-    softPwmCreate(BATTERY1_FAN_PIN, 0, 100);   //battery1 fan
-    softPwmCreate(BATTERY2_FAN_PIN, 0, 100);   //battery2 fan
-    softPwmCreate(BATTERY3_FAN_PIN, 0, 100);  //battery3 fan
-
-    softPwmCreate(RESISTER_FAN_PIN, 0, 100);  //resister fan
-
-    softPwmCreate(BATTERY1_PWM_PIN, 0, 100);   //battery1 charge control
-    softPwmCreate(BATTERY2_PWM_PIN, 0, 100);  //battery2 charge control
-    softPwmCreate(BATTERY3_PWM_PIN, 0, 100);  //battery3 charge control
-}
-
-double readTemperature(const std::string& sensorPath) { //read temperature data from file
-    std::ifstream file(sensorPath);
-    std::string line;
-    double temperature = 0.0;
-
-    if (file.is_open()) {
-        while (std::getline(file, line)) {
-            if (line.find(" t=") != std::string::npos) {
-                std::string tempStr = line.substr(line.find(" t=") + 3);
-                temperature = std::stod(tempStr) / 1000.0;
-                break;
-            }
-        }
-        file.close();
+    bool pwm_ok = true;
+    for (const CellPorts& port : cell_ports) {
+        pwm_ok &= hal->pwmCreate(port.fan_pin, 0, fan_pwm.range, fan_pwm.frequency_hz) == 0;    //battery fan
+        pwm_ok &= hal->pwmCreate(port.pwm_pin, 0, charge_pwm.range, charge_pwm.frequency_hz) == 0;  //battery charge control
     }
-    else {
-        std::cerr << "Could not open sensor file: " << sensorPath << "\n";
+    pwm_ok &= hal->pwmCreate(resistor_fan_pin, 0, fan_pwm.range, fan_pwm.frequency_hz) == 0;   //resister fan
+    if (!pwm_ok) {
+        std::cerr << "Failed to initialize PWM!" << std::endl;
+        exit(1);
     }
-
-    return temperature;
 }
 
-void controlRelay(char command, int relay_num) {
+//false when the relay was left as it is
+bool controlRelay(char command, int relay_num) {
+    if (relay_num < 1 || relay_num > (int)cell_ports.size()) {
+        std::cout << "Invalid relay order" << std::endl;
+        return false;
+    }
     if (command == '1') {
-        if(relay_num == 1) {
-            std::cout << "Turning the relay_1 ON" << std::endl;
-            digitalWrite(RELAY_PIN1, HIGH); // Turn the relay ON
-            relay_state[RELAY_PIN1] = 1;
-        } else if(relay_num == 2) {
-            std::cout << "Turning the relay_2 ON" << std::endl;
-            digitalWrite(RELAY_PIN2, HIGH); // Turn the relay ON
-            relay_state[RELAY_PIN2] = 1;
-        } else if(relay_num == 3) {
-            std::cout << "Turning the relay_3 ON" << std::endl;
-            digitalWrite(RELAY_PIN3, HIGH); // Turn the relay ON
-            relay_state[RELAY_PIN3] = 1;
-        } else std::cout << "Invalid relay order" << std::endl;
+        if (!relays->set(relay_num - 1, true)) {
+            std::cerr << "Relay_" << relay_num << " stays OFF: held open by the safety supervisor" << std::endl;
+            return false;
+        }
+        std::cout << "Turning the relay_" << relay_num << " ON" << std::endl;
     }
     else if (command == '0') {
-        if(relay_num == 1) {
-            std::cout << "Turning the relay_1 OFF" << std::endl;
-            digitalWrite(RELAY_PIN1, LOW); // Turn the relay OFF
-            relay_state[RELAY_PIN1] = 0;
-        } else if(relay_num == 2) {
-            std::cout << "Turning the relay_2 OFF" << std::endl;
-            digitalWrite(RELAY_PIN2, LOW); // Turn the relay OFF
-            relay_state[RELAY_PIN2] = 0;
-        } else if(relay_num == 3) {
-            std::cout << "Turning the relay_3 OFF" << std::endl;
-            digitalWrite(RELAY_PIN3, LOW); // Turn the relay OFF
-            relay_state[RELAY_PIN3] = 0;
-        } else std::cout << "Invalid relay order" << std::endl;
+        relays->set(relay_num - 1, false);
+        std::cout << "Turning the relay_" << relay_num << " OFF" << std::endl;
     }
     else {
         std::cerr << "Invalid command!" << std::endl;
+        return false;
     }
+    return true;
+}
+
+std::vector<std::string> temperature_paths(const std::vector<CellPorts>& ports) {    //TempService sensor order = temperature[] layout
+    std::vector<std::string> paths;
+    for (const CellPorts& port : ports) paths.push_back(port.temp_path);
+    for (const CellPorts& port : ports) paths.push_back(port.resistor_temp_path);
+    return paths;
+}
+
+std::string sensor_name(size_t sensor, size_t cells) {
+    return (sensor < cells ? "cell " + std::to_string(sensor + 1) : "resistor " + std::to_string(sensor - cells + 1));
 }
 
-float calculate_SoC(float voltage, int relay_state) {    //estimate SoC by voltage
-    if(relay_state == 1) voltage += (voltage - 2.9) * 1.3;
-    if (voltage >= 4.20) return 100.0;
-    else if (voltage >= 4.08) {
-        if (voltage >= 4.16) return 98.0;
-        else if (voltage >= 4.14) return 96.0;
-        else if (voltage >= 4.12) return 94.0;
-        else if (voltage >= 4.10) return 92.0;
-        else return 90.0;
-    }
-    else if (voltage >= 3.96) {
-        if (voltage >= 4.06) return 88.0;
-        else if (voltage >= 4.04) return 86.0;
-        else if (voltage >= 4.02) return 84.0;
-        else if (voltage >= 3.99) return 82.0;
-        else return 80.0;
-    }
-    else if (voltage >= 3.85) {
-        if (voltage >= 3.94) return 78.0;
-        else if (voltage >= 3.91) return 76.0;
-        else if (voltage >= 3.89) return 74.0;
-        else if (voltage >= 3.87) return 72.0;
-        else return 70.0;
-    }
-    else if (voltage >= 3.75) {
-        if (voltage >= 3.83) return 68.0;
-        else if (voltage >= 3.81) return 66.0;
-        else if (voltage >= 3.79) return 64.0;
-        else if (voltage >= 3.77) return 62.0;
-        else return 60.0;
-    }
-    else if (voltage >= 3.65) {
-        if (voltage >= 3.73) return 58.0;
-        else if (voltage >= 3.71) return 56.0;
-        else if (voltage >= 3.69) return 54.0;
-        else if (voltage >= 3.67) return 52.0;
-        else return 50.0;
-    }
-    else if (voltage >= 3.6) {
-        if (voltage >= 3.64) return 48.0;
-        else if (voltage >= 3.63) return 46.0;
-        else if (voltage >= 3.62) return 44.0;
-        else if (voltage >= 3.61) return 42.0;
-        else return 40.0;
-    }
-    else if (voltage >= 3.55) {
-        if (voltage >= 3.59) return 38.0;
-        else if (voltage >= 3.58) return 36.0;
-        else if (voltage >= 3.57) return 34.0;
-        else if (voltage >= 3.56) return 32.0;
-        else return 30.0;
-    }
-    else if (voltage >= 3.5) {
-        if (voltage >= 3.54) return 28.0;
-        else if (voltage >= 3.53) return 26.0;
-        else if (voltage >= 3.52) return 24.0;
-        else if (voltage >= 3.51) return 22.0;
-        else return 20.0;
-    }
-    else if (voltage >= 3.43) {
-        if (voltage >= 3.48) return 18.0;
-        else if (voltage >= 3.46) return 16.0;
-        else if (voltage >= 3.44) return 14.0;
-        else if (voltage >= 3.42) return 12.0;
-        else return 10.0;
+//names the sensors the pack uses that the bus does not have, and the ones on the bus nothing uses
+void report_sensors(const std::vector<std::string>& paths, const std::string& w1_dir) {
+    if (access(w1_dir.c_str(), F_OK) != 0) {
+#ifndef BMS_SIMULATION
+        std::cerr << "1-Wire: no " << w1_dir << ", is the w1-gpio overlay loaded?" << std::endl;
+#endif
+        return;
     }
-    else {
-        if (voltage >= 3.4) return 8.0;
-        else if (voltage >= 3.3) return 6.0;
-        else if (voltage >= 3.1) return 4.0;
-        else if (voltage >= 3.0) return 2.0;
-        else return 0.0;
+    std::vector<std::string> found = w1_scan(w1_dir);
+    std::vector<std::string> used;
+    for (size_t i = 0; i < paths.size(); i++) {
+        used.push_back(w1_sensor_id(paths[i]));
+        if (std::find(found.begin(), found.end(), used.back()) == found.end()) {
+            std::cerr << "1-Wire: sensor " << used.back() << " (" << sensor_name(i, paths.size() / 2) << ") is not on the bus" << std::endl;
+        }
+    }
+    for (const std::string& id : found) {
+        if (std::find(used.begin(), used.end(), id) == used.end()) std::cout << "1-Wire: sensor " << id << " is on the bus but in no cell" << std::endl;
     }
 }
 
-void control_fan_speed(float temperature[], int fan_pwm[]) { //pwm fan control by temperature
-    while (true) {
-        mtx.lock();
-        temperature[0] = readTemperature(BAT1_TEMP_ADDR);
-      temperature[1] = readTemperature(BAT2_TEMP_ADDR);
-      temperature[2] = readTemperature(BAT3_TEMP_ADDR);
-      temperature[3] = readTemperature(RESISTER1_TEMP_ADDR);
-      temperature[4] = readTemperature(RESISTER2_TEMP_ADDR);
-      temperature[5] = readTemperature(RESISTER3_TEMP_ADDR);
-        mtx.unlock();
-        
-        int fan_speed = 0;
-
-        //bat1
-        if (temperature[0] <= 20.0) {   //all 3 batteries each 20'C->0%, 40'C->100%
-            fan_speed = 0;
-        }
-        else if (temperature[0] >= 40.0) {
-            fan_speed = 100;
-        }
-        else {
-            fan_speed = static_cast<int>((temperature[0] - 20.0) / 20.0 * 100);
-        }
+//holds a starting task until its inputs have a first valid sample or deadline_us passes;
+//on a timeout it names the inputs still missing and the task starts without them
+void await_inputs(Readiness& readiness, const char* task, const std::vector<size_t>& inputs, uint64_t since_us, uint64_t deadline_us) {
+    if (readiness.wait(inputs, deadline_us)) {
+        std::cout << "Starting " << task << ": inputs ready after " << (readiness.upUs(inputs) - since_us) / 1000 << " ms" << std::endl;
+        return;
+    }
+    std::string names;
+    for (const std::string& name : readiness.missing(inputs)) names += (names.empty() ? "" : ", ") + name;
+    std::cerr << "Starting " << task << " without " << names << ": no valid sample after " << (hal->nowUs() - since_us) / 1000 << " ms" << std::endl;
+}
 
-        softPwmWrite(BATTERY1_FAN_PIN, fan_speed);
-        fan_pwm[0]=fan_speed;
-        printf("battery-1 Temperature: %.2f C, Fan Speed: %d\n", temperature[0], fan_speed);
+//SIGHUP: re-reads the config and points every sensor that changed at its new device. Cells, pins,
+//i2c addresses and the server are only taken at startup; a change to them is reported, not applied
+void reload_topology(const std::string& path, const std::string& server_ip, TempService& temps) {
+    Topology topology;
+    std::string error;
+    if (!load_topology(path, topology, error)) {
+        std::cerr << "Config " << path << ": " << (error.empty() ? "missing" : error) << ", mapping unchanged" << std::endl;
+        return;
+    }
+    size_t cells = cell_ports.size();
+    if (topology.cells.size() != cells) {
+        std::cerr << "Config " << path << ": " << topology.cells.size() << " cells, the pack runs " << cells << ", restart to apply" << std::endl;
+        return;
+    }
+    std::vector<std::string> paths = temperature_paths(topology.cells);
+    size_t remapped = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::string old_path = temps.path(i);
+        if (paths[i] == old_path) continue;
+        std::cout << "Sensor of " << sensor_name(i, cells) << ": " << w1_sensor_id(old_path) << " -> " << w1_sensor_id(paths[i]) << std::endl;
+        temps.remap(i, paths[i]);
+        remapped++;
+    }
+    bool rewired = (topology.resistor_fan_pin >= 0 && topology.resistor_fan_pin != resistor_fan_pin) ||
+                   (!topology.server_ip.empty() && topology.server_ip != server_ip);
+    for (size_t i = 0; i < cells; i++) {
+        const CellPorts& a = topology.cells[i];
+        const CellPorts& b = cell_ports[i];
+        rewired |= a.mux_addr != b.mux_addr || a.mux_channel != b.mux_channel || a.ina_addr != b.ina_addr || a.i2c_bus != b.i2c_bus ||
+                   a.pwm_pin != b.pwm_pin || a.fan_pin != b.fan_pin || a.relay_pin != b.relay_pin;
+    }
+    if (rewired) std::cerr << "Config " << path << ": pin, i2c or server changes need a restart" << std::endl;
+    std::cout << "Config " << path << " reloaded, " << remapped << " sensor(s) remapped" << std::endl;
+    report_sensors(paths, topology.w1_dir);
+}
 
-        //bat2
-        if (temperature[1] <= 20.0) {
-            fan_speed = 0;
-        }
-        else if (temperature[1] >= 40.0) {
-            fan_speed = 100;
-        }
-        else {
-            fan_speed = static_cast<int>((temperature[1] - 20.0) / 20.0 * 100);
-        }
+struct FanLoop {     //control_fan_speed state
+    explicit FanLoop(size_t cells) : temperature(2 * cells), fan_speed(cells + 1) {}
+    std::vector<float> temperature; //[0..n) cells, [n..2n) discharge resistors, NaN when stale
+    std::vector<int> fan_speed;     //[0..n) cell fans, [n] resistor fan, as the controller's fans
+};
 
-        softPwmWrite(BATTERY2_FAN_PIN, fan_speed);
-        fan_pwm[1]=fan_speed;
-        printf("battery-2 Temperature: %.2f C, Fan Speed: %d\n", temperature[1], fan_speed);
+//one fan period
+void fan_step(TempService& temps, ThermalController& thermal, FanLoop& loop) {
+    size_t cells = cell_ports.size();
+    std::vector<float>& temperature = loop.temperature;
+    std::vector<int>& fan_speed = loop.fan_speed;
+    uint64_t now = hal->nowUs();
+    for (size_t i = 0; i < 2 * cells; i++) {
+        temperature[i] = temps.fresh(i);
+    }
 
-        //bat3
-        if (temperature[2] <= 20.0) {
-            fan_speed = 0;
-        }
-        else if (temperature[2] >= 40.0) {
-            fan_speed = 100;
+    for (size_t i = 0; i < cells; i++) {    //stale or missing sensor: fan flat out
+        if (thermal.update(i, temperature[i], now) && verbose) {
+            printf("battery-%d Temperature: %.2f C, Fan Speed: %d\n", (int)i + 1, temperature[i], thermal.command(i));
         }
-        else {
-            fan_speed = static_cast<int>((temperature[2] - 20.0) / 20.0 * 100);
+        fan_speed[i] = thermal.command(i);
+    }
+
+    float max_temp = -INFINITY;
+    for (size_t i = 0; i < cells; i++) {
+        if (std::isnan(temperature[cells + i])) {   //missing sensor: run the fan flat out
+            max_temp = NAN;
+            break;
         }
+        if (temperature[cells + i] > max_temp) max_temp = temperature[cells + i];
+    }
 
-        softPwmWrite(BATTERY3_FAN_PIN, fan_speed);
-        fan_pwm[2]=fan_speed;
-        printf("battery-3 Temperature: %.2f C, Fan Speed: %d\n", temperature[2], fan_speed);
+    if (thermal.update(cells, max_temp, now) && verbose) {
+        printf("Discharge Resistor Max Temperature: %.2f C, Fan Speed: %d\n", max_temp, thermal.command(cells));
+    }
+    fan_speed[cells] = thermal.command(cells);
+    telemetry->publishThermal(now, temperature.data(), fan_speed.data());
+}
 
-        float max_temp = temperature[3];
+void control_fan_speed(TempService& temps, ThermalController& thermal, PeriodicTask& task) { //pwm fan control by temperature
+    FanLoop loop(cell_ports.size());
+    task.enter();
+    while (true) {
+        fan_step(temps, thermal, loop);
+        task.wait();
+    }
+}
 
-        if (temperature[4] > max_temp) max_temp = temperature[4];
-        if (temperature[5] > max_temp) max_temp = temperature[5];
+//one balancing pass every BALANCE_PERIOD_MS, on the charging task so it sees the pack as regulated
+void balance(Pack& pack, TempService& temps, Balancer& balancer, uint64_t now, const std::vector<int>& relay_state, const float bat_data[]) {
+    size_t cells = pack.size();
+    std::vector<float> soc(cells), voltage(cells), resistor(cells);
+    std::vector<int> relay_out(cells);
+    for (size_t i = 0; i < cells; i++) {
+        soc[i] = pack.estimator[i].valid() ? pack.estimator[i].percent() : NAN;
+        voltage[i] = bat_data[i * BAT_DATA_STRIDE + BAT_VOLTAGE];
+        resistor[i] = temps.fresh(cells + i);
+    }
+    if (!balancer.update(now, soc.data(), voltage.data(), resistor.data(), relay_state.data(), relay_out.data())) return;
+    for (size_t i = 0; i < cells; i++) {
+        if (relay_out[i] == relay_state[i]) continue;
+        std::cout << "Balancing cell " << i + 1 << ": " << Balancer::reasonName(balancer.reason(i)) << std::endl;
+        controlRelay(relay_out[i] ? '1' : '0', static_cast<int>(i) + 1);
+    }
+}
 
-        if (max_temp <= 20.0) { //20~50 20'C->0%, 50'C->100%
-            fan_speed = 0;
-        }
-        else if (max_temp >= 50.0) {
-            fan_speed = 100;
-        }
-        else {
-            fan_speed = static_cast<int>((max_temp - 20.0) / 30.0 * 100);
-        }
+struct ChargingLoop {    //control_charging state
+    explicit ChargingLoop(size_t cells) : cell_temp(cells), relay_state(cells), bat_data(BAT_DATA_STRIDE * cells) {}
+    std::vector<float> cell_temp;
+    std::vector<int> relay_state;
+    std::vector<float> bat_data;
+    uint64_t last_balance_us = 0;
+};
 
-        softPwmWrite(RESISTER_FAN_PIN, fan_speed);
-        fan_pwm[3]=fan_speed;
-        printf("Discharge Resistor Max Temperature: %.2f C, Fan Speed: %d\n", max_temp, fan_speed);
-        //std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+//one charging period: regulate, publish, balance, capture
+void charging_step(Pack& pack, TempService& temps, Balancer* balancer, ChargingLoop& loop) {
+    for (size_t i = 0; i < loop.cell_temp.size(); i++) {
+        loop.cell_temp[i] = temps.fresh(i);  //NaN when stale: the cell stops charging
+    }
+    telemetry->relays(loop.relay_state);
+    pack.controlStep(loop.cell_temp.data(), loop.relay_state.data(), loop.bat_data.data());
+    uint64_t now = pack.stepUs();
+    telemetry->publishCells(now, loop.bat_data.data());
+    if (balancer && now - loop.last_balance_us >= BALANCE_PERIOD_MS * 1000ULL) {
+        balance(pack, temps, *balancer, now, loop.relay_state, loop.bat_data.data());
+        loop.last_balance_us = now;
+    }
+    if (capture) {
+        for (size_t i = 0; i < pack.size(); i++) {
+            capture->record({ pack.sample_us[i], pack.sample_voltage[i], pack.sample_current[i], static_cast<uint16_t>(i),
+                              static_cast<uint8_t>(pack.duty_cycle[i]), static_cast<uint8_t>(pack.charge_mode[i]),
+                              static_cast<uint8_t>(pack.soc[i]), static_cast<uint8_t>(loop.relay_state[i]) });
+        }
     }
 }
 
-void control_charging(TCA9548A& sensor, float temperature[], float bat_data[]) {
-    int tca_fd = wiringPiI2CSetup(TCA_ADDR);
-    int duty_cycle1 = 0;
-    int duty_cycle2 = 0;
-    int duty_cycle3 = 0;
-    int counter = 0;
-    std::vector<float> current1;
-    std::vector<float> voltage1;
-    std::vector<float> current2;
-    std::vector<float> voltage2;
-    std::vector<float> current3;
-    std::vector<float> voltage3;
-
-    std::vector<int> SoC_array_1;
-    std::vector<int> SoC_array_2;
-    std::vector<int> SoC_array_3;
-    
-    int soc_1 = 0;
-    int soc_2 = 0;
-    int soc_3 = 0;
+void control_charging(Pack& pack, TempService& temps, Balancer* balancer, PeriodicTask& task) {
+    ChargingLoop loop(pack.size());
+    task.enter();
     while (true) {
+        charging_step(pack, temps, balancer, loop);
+        task.wait();
+    }
+}
 
-        //mtx.lock();
-
-        //bat1
-        selectTCA9548AChannel(tca_fd, 5);
-
-        int charge_mode[3];
-        int count = 0;
-        
-        
+//hard limits at a fixed rate, above the charging task
+void supervise(SafetySupervisor& supervisor, PeriodicTask& task) {
+    task.enter();
+    while (true) {
+        supervisor.check();
+        task.wait();
+    }
+}
 
-        if (relay_state[RELAY_PIN1] == 1) {    //stop charging while discharging
-            charge_mode[0] = STOP_CHARGING;
-            duty_cycle1 = 0;
-            softPwmWrite(BATTERY1_PWM_PIN, duty_cycle1);
-            
-            float shuntVoltage = sensor.readShuntVoltage();
+void send_data(NetEngine& net, TelemetryFormat format, PeriodicTask& task){
+    size_t cells = telemetry->cells();
+    std::vector<char> buffer(256 * (cells + 1));    //~180 bytes per cell as JSON, 16 as binary
+    TelemetryFrame frame;
+    uint32_t seq = 0;
+    task.enter();
+    while(1){
+        telemetry->snapshot(frame);
+        size_t length;
+        {
+            StageTimer timer(stage_stats, STAGE_ENCODE);
+            length = (format == TELEMETRY_BINARY)
+                ? encode_telemetry(frame, seq++, hal->nowUs(), reinterpret_cast<uint8_t*>(buffer.data()), buffer.size())
+                : encode_json(frame, buffer.data(), buffer.size());
+        }
 
-            current1.push_back(sensor.readCurrent());
-            if (current1.size() > 10) {
-                current1.erase(current1.begin());
-            }
-            float avg_current = 0.0;
-            count = 0;
-            for (float amph : current1) {
-                if(abs(amph) >= duty_cycle1){
-                    avg_current += amph;
-                    count++;
-                }
-            }
-            avg_current /= count;
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-            voltage1.push_back(sensor.readBusVoltage());
-            if (voltage1.size() > 10) voltage1.erase(voltage1.begin());
-
-            float avg_voltage = 0.0;
-            count = 0;
-            for (float volt : voltage1) {
-                if(volt >= 0.1){
-                    avg_voltage += volt;
-                    count++;
-                }
-            }
-            avg_voltage /= count;
-
-            //calculate SoC
-            SoC_array_1.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN1]));
-            if(SoC_array_1.size() > 5) SoC_array_1.erase(SoC_array_1.begin());
-                
-            soc_1 = 0;
-            for(int soc : SoC_array_1) {
-                soc_1 += soc;
-            }
-            soc_1 /= SoC_array_1.size();
-                
-            std::cout << std::fixed;
-            std::cout.precision(2);
-            std::cout << "Battery(1) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_1 << "%, duty cycle: " << duty_cycle1 << "%" << std::endl;
-            bat_data[0] = avg_voltage;
-            bat_data[1] = avg_current;
-            bat_data[2] = soc_1;
-            bat_data[3] = duty_cycle1;
-        }
-        else {  //set charging mode by temperature
-            if (temperature[0] > MAX_CRITICAL_TEMPERATURE) {   //over 60'C stop charging
-                charge_mode[0] = STOP_CHARGING;
-                duty_cycle1 = 0;
-                softPwmWrite(BATTERY1_PWM_PIN, duty_cycle1);
-            }
-            else if (soc_1 == 100) { charge_mode[0] = STOP_CHARGING; duty_cycle1 = 0; softPwmWrite(BATTERY1_PWM_PIN, duty_cycle1); }
-            else if (temperature[0] > MAX_SAFE_TEMPERATURE) {  //over 50'C slow down charging
-                charge_mode[0] = STANDARD_CHARGING;
+        if(length == 0){
+            std::cerr << "error: buffer size in insufficient" << std::endl;
+        } else {
+            if (format == TELEMETRY_JSON) std::cout << "json generated" << buffer.data() << std::endl;
+            if (journal) {
+                if (!journal->append(reinterpret_cast<uint8_t*>(buffer.data()), length)) std::cerr << "journal: frame too large" << std::endl;
             }
             else {
-                charge_mode[0] = FAST_CHARGING;
-            }
-            bat_data[4] = charge_mode[0];
-
-            if (charge_mode[0] != STOP_CHARGING) {
-                float target_current = (charge_mode[0] == FAST_CHARGING) ? 1000.0 : 500.0;
-                float shuntVoltage = sensor.readShuntVoltage();
-
-                current1.push_back(sensor.readCurrent());
-                if (current1.size() > 10) {
-                    current1.erase(current1.begin());
-                }
-                float avg_current = 0.0;
-                count = 0;
-                for (float amph : current1) {
-                    if(abs(amph) >= duty_cycle1){
-                        avg_current += amph;
-                        count++;
-                    }
-                }
-                avg_current /= count;
-
-                softPwmWrite(BATTERY1_PWM_PIN, 0);   //shut charging for measure voltage for SoC
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-                voltage1.push_back(sensor.readBusVoltage());
-                if (voltage1.size() > 10) voltage1.erase(voltage1.begin());
-
-                float avg_voltage = 0.0;
-                count = 0;
-                for (float volt : voltage1) {
-                    if(volt >= 0.1){
-                        avg_voltage += volt;
-                        count++;
-                    }
-                }
-                avg_voltage /= count;
-
-                //calculate SoC
-                SoC_array_1.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN1]));
-                if(SoC_array_1.size() > 5) SoC_array_1.erase(SoC_array_1.begin());
-                
-                soc_1 = 0;
-                for(int soc : SoC_array_1) {
-                    soc_1 += soc;
-                }
-                soc_1 /= SoC_array_1.size();
-                
-                std::cout << std::fixed;
-                std::cout.precision(2);
-                std::cout << "Battery(1) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_1 << "%, duty cycle: " << duty_cycle1 << "%" << std::endl;
-                bat_data[0] = avg_voltage;
-                bat_data[1] = avg_current;
-                bat_data[2] = soc_1;
-                bat_data[3] = duty_cycle1;
-
-                softPwmWrite(BATTERY1_PWM_PIN, duty_cycle1);  //charging continue
-
-                if (avg_voltage < TARGET_VOLTAGE) {
-                    //CC charging
-                    if (avg_current < target_current) {
-                        duty_cycle1 = std::min(100, (duty_cycle1 + 1) + counter); //increase duty-cycle
-                    }
-                    else {
-                        duty_cycle1 = std::max(0, (duty_cycle1 - 1) - counter);   //decrease duty-cycle
-                    }
-                }
-                else {
-                    //CV charging
-                    duty_cycle1 = std::max(0, (duty_cycle1 - 1) + counter);   //decrease duty-cycle
-                }
-                counter = std::max(0, counter - 1);
-                softPwmWrite(BATTERY1_PWM_PIN, duty_cycle1);
+                net.post(buffer.data(), length, NET_COALESCE, FRAME_TELEMETRY);   //only the newest snapshot waits for a slow link
+                std::cout << "Data queued for the server" << std::endl;
             }
         }
+        task.wait();
+    }
+}
 
-        //bat2
-        selectTCA9548AChannel(tca_fd, 6);
-
-        if (relay_state[RELAY_PIN2] == 1) {    //stop charging while discharging
-            charge_mode[1] = STOP_CHARGING;
-            duty_cycle2 = 0;
-            softPwmWrite(BATTERY2_PWM_PIN, duty_cycle2);
-            
-            float shuntVoltage = sensor.readShuntVoltage();
-
-            current2.push_back(sensor.readCurrent());
-            if (current2.size() > 10) {
-                current2.erase(current2.begin());
-            }
-            float avg_current = 0.0;
-            count = 0;
-            for (float amph : current2) {
-                if(abs(amph) >= duty_cycle2){
-                    avg_current += amph;
-                    count++;
-                }
-            }
-            avg_current /= count;
+//ships the captured samples every task period, at most batch samples per frame
+void upload_samples(NetEngine& net, size_t batch, PeriodicTask& task) {
+    std::vector<Sample> samples(batch);
+    std::vector<uint8_t> buffer(samples_frame_size(batch));
+    uint32_t seq = 0;
+    uint64_t reported_drops = 0;
+    task.enter();
+    while (true) {
+        task.wait();
+        size_t n;
+        while ((n = capture->drain(samples.data(), batch)) > 0) {
+            size_t length = encode_samples(samples.data(), n, seq++, buffer.data(), buffer.size());
+            if (length) net.post(buffer.data(), length, NET_QUEUE, FRAME_SAMPLES);
+            if (n < batch) break;
+        }
+        if (capture->drops() != reported_drops) {
+            reported_drops = capture->drops();
+            std::cerr << "capture: " << reported_drops << " samples dropped, upload is falling behind" << std::endl;
+        }
+    }
+}
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+struct JournalStream {      //replay position, restarted at every connection
+    std::mutex mtx;         //a record is never posted across a reconnect
+    std::atomic<bool> rewind{true};
+};
 
-            voltage2.push_back(sensor.readBusVoltage());
-            if (voltage2.size() > 10) voltage2.erase(voltage2.begin());
+//runs on the network loop before anything is sent on a new connection
+void journal_connected(NetEngine& net, JournalStream& stream) {
+    std::lock_guard<std::mutex> lock(stream.mtx);
+    net.discard(FRAME_RECORD);  //queued for the old connection, resent from the oldest unacked record
+    stream.rewind = true;
+}
 
-            float avg_voltage = 0.0;
-            count=0;
-            for (float volt : voltage2) {
-                if(volt >= 0.1){
-                    avg_voltage += volt;
-                    count++;
-                }
-            }
-            avg_voltage /= count;
-
-            //calculate SoC
-            SoC_array_2.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN2]));
-            if(SoC_array_2.size() > 5) SoC_array_2.erase(SoC_array_2.begin());
-                
-            soc_2 = 0;
-            for(int soc : SoC_array_2) {
-                soc_2 += soc;
-            }
-            soc_2 /= SoC_array_2.size();
-                
-            std::cout << std::fixed;
-            std::cout.precision(2);
-            std::cout << "Battery(2) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_2 << "%, duty cycle: " << duty_cycle2 << "%" << std::endl;
-            bat_data[5] = avg_voltage;
-            bat_data[6] = avg_current;
-            bat_data[7] = soc_2;
-            bat_data[8] = duty_cycle2;
-        }
-        else {  //set charging mode by temperature
-            if (temperature[1] > MAX_CRITICAL_TEMPERATURE) {   //over 60'C stop charging
-                charge_mode[1] = STOP_CHARGING;
-                duty_cycle2 = 0;
-                softPwmWrite(BATTERY2_PWM_PIN, duty_cycle2);
-            }
-            else if (soc_2 == 100) { charge_mode[1] = STOP_CHARGING; duty_cycle2 = 0; softPwmWrite(BATTERY2_PWM_PIN, duty_cycle2); }
-            else if (temperature[1] > MAX_SAFE_TEMPERATURE) {  //over 50'C slow down charging
-                charge_mode[1] = STANDARD_CHARGING;
-            }
-            else {
-                charge_mode[1] = FAST_CHARGING;
-            }
-            bat_data[9] = charge_mode[1];
-
-            if (charge_mode[1] != STOP_CHARGING) {
-                float target_current = (charge_mode[1] == FAST_CHARGING) ? 1000.0 : 500.0;
-                float shuntVoltage = sensor.readShuntVoltage();
-
-                current2.push_back(sensor.readCurrent());
-                if (current2.size() > 10) {
-                    current2.erase(current2.begin());
-                }
-                float avg_current = 0.0;
-                count = 0;
-                for (float amph : current2) {
-                    if(abs(amph) >= duty_cycle2){
-                        avg_current += amph;
-                        count++;
-                    }
-                }
-                avg_current /= count;
-
-                softPwmWrite(BATTERY2_PWM_PIN, 0);   //shut charging for measure voltage for SoC
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-                voltage2.push_back(sensor.readBusVoltage());
-                if (voltage2.size() > 10) voltage2.erase(voltage2.begin());
-
-                float avg_voltage = 0.0;
-                count=0;
-                for (float volt : voltage2) {
-                    if(volt >= 0.1){
-                        avg_voltage += volt;
-                        count++;
-                    }
-                }
-                avg_voltage /= count;
-
-                //calculate SoC
-                SoC_array_2.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN2]));
-                if(SoC_array_2.size() > 5) SoC_array_2.erase(SoC_array_2.begin());
-                
-                soc_2 = 0;
-                for(int soc : SoC_array_2) {
-                    soc_2 += soc;
-                }
-                soc_2 /= SoC_array_2.size();
-                
-                std::cout << std::fixed;
-                std::cout.precision(2);
-                std::cout << "Battery(2) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_2 << "%, duty cycle: " << duty_cycle2 << "%" << std::endl;
-                bat_data[5] = avg_voltage;
-                bat_data[6] = avg_current;
-                bat_data[7] = soc_2;
-                bat_data[8] = duty_cycle2;
-
-                softPwmWrite(BATTERY2_PWM_PIN, duty_cycle2);  //charging continue
-
-                if (avg_voltage < TARGET_VOLTAGE) {
-                    //CC charging
-                    if (avg_current < target_current) {
-                        duty_cycle2 = std::min(100, (duty_cycle2 + 1) + counter); //increase duty-cycle
-                    }
-                    else {
-                        duty_cycle2 = std::max(0, (duty_cycle2 - 1) - counter);   //decrease duty-cycle
-                    }
-                }
-                else {
-                    //CV charging
-                    duty_cycle2 = std::max(0, (duty_cycle2 - 1) + counter);   //decrease duty-cycle
-                }
-                counter = std::max(0, counter - 1);
-                softPwmWrite(BATTERY2_PWM_PIN, duty_cycle2);
+//sends the journal in order from the oldest record the server has not acknowledged;
+//live frames go out as they are appended, a backlog at JOURNAL_REPLAY_RATE frames per second
+void stream_journal(NetEngine& net, JournalStream& stream) {
+    std::vector<uint8_t> record(PROTO_HEADER_SIZE + RECORD_HEADER_SIZE + telemetry_frame_size(cell_ports.size()));
+    const int replay_ms = std::max(1, 1000 / JOURNAL_REPLAY_RATE);
+    uint64_t cursor = 0;
+    uint64_t last_sync_us = hal->nowUs();
+    uint64_t reported_lost = 0;
+    while (true) {
+        if (hal->nowUs() - last_sync_us >= JOURNAL_SYNC_MS * 1000ULL) {
+            journal->sync();
+            last_sync_us = hal->nowUs();
+        }
+        if (journal->lost() != reported_lost) {
+            reported_lost = journal->lost();
+            std::cerr << "journal: " << reported_lost << " unacknowledged frames overwritten, outage longer than the journal" << std::endl;
+        }
+        if (!net.connected() || net.queuedBytes() > JOURNAL_INFLIGHT_BYTES) {
+            hal->sleepMs(replay_ms);
+            continue;
+        }
+        if (!stream.rewind && !journal->waitFor(cursor, JOURNAL_SYNC_MS)) continue;
+        bool backlog;
+        {
+            std::lock_guard<std::mutex> lock(stream.mtx);
+            if (stream.rewind) {
+                cursor = journal->firstUnacked();
+                stream.rewind = false;
             }
+            size_t length = journal->read(cursor, record.data(), record.size());
+            if (length) net.post(record.data(), length, NET_QUEUE, FRAME_RECORD);
+            backlog = journal->pending(cursor);
         }
+        if (backlog) hal->sleepMs(replay_ms);
+    }
+}
 
-        //bat3
-        selectTCA9548AChannel(tca_fd, 7);
+//applies one command to one cell; the ack carries the setting in force afterwards
+Command apply_command(Pack& pack, const Command& command, size_t cell) {
+    Command ack = command;
+    ack.cell = static_cast<uint16_t>(cell);
+    ack.status = ACK_OK;
+    switch (command.type) {
+    case CMD_RELAY:
+        if (command.value != 0 && command.value != 1) ack.status = ACK_BAD_VALUE;
+        else if (!controlRelay(command.value ? '1' : '0', cell + 1)) ack.status = ACK_REFUSED;
+        ack.value = telemetry->relay(cell);
+        break;
+    case CMD_CHARGE_MODE:
+        if (!pack.overrideMode(cell, command.value)) ack.status = ACK_BAD_VALUE;
+        ack.value = pack.modeOverride(cell);
+        break;
+    case CMD_CURRENT_SETPOINT:
+        if (!pack.setCurrentSetpoint(cell, static_cast<float>(command.value))) ack.status = ACK_BAD_VALUE;
+        ack.value = static_cast<int32_t>(std::lround(pack.currentSetpoint(cell)));
+        break;
+    case CMD_VOLTAGE_SETPOINT:
+        if (!pack.setVoltageSetpoint(cell, command.value / 1000.0f)) ack.status = ACK_BAD_VALUE;
+        ack.value = static_cast<int32_t>(std::lround(pack.voltageSetpoint(cell) * 1000.0f));
+        break;
+    default:
+        ack.status = ACK_BAD_TYPE;
+        break;
+    }
+    return ack;
+}
 
-        if (relay_state[RELAY_PIN3] == 1) {    //stop charging while discharging
-            charge_mode[2] = STOP_CHARGING;
-            duty_cycle3 = 0;
-            softPwmWrite(BATTERY3_PWM_PIN, duty_cycle3);
-            
-            float shuntVoltage = sensor.readShuntVoltage();
+//every command on its cells; one ack per command and cell
+std::vector<Command> apply_commands(Pack& pack, const std::vector<Command>& commands) {
+    std::vector<Command> acks;
+    for (const Command& command : commands) {
+        if (trace) trace->command(hal->nowUs(), command.cell, command.type, command.value);
+        if (command.cell == CELL_ALL) {
+            for (size_t i = 0; i < pack.size(); i++) acks.push_back(apply_command(pack, command, i));
+        }
+        else if (command.cell >= pack.size()) {
+            Command ack = command;
+            ack.status = ACK_BAD_CELL;
+            acks.push_back(ack);
+        }
+        else {
+            acks.push_back(apply_command(pack, command, command.cell));
+        }
+    }
+    return acks;
+}
 
-            current3.push_back(sensor.readCurrent());
-            if (current3.size() > 10) {
-                current3.erase(current3.begin());
-            }
-            float avg_current = 0.0;
-            count = 0;
-            for (float amph : current3) {
-                if(abs(amph) >= duty_cycle3){
-                    avg_current += amph;
-                    count++;
-                }
-            }
-            avg_current /= count;
+//a batch of commands in, one ack frame (or more for huge batches) out
+void handle_commands(Pack& pack, NetEngine& net, const std::vector<Command>& commands) {
+    std::vector<Command> acks = apply_commands(pack, commands);
+    const size_t per_frame = 4096;
+    std::vector<uint8_t> buffer(command_frame_size(per_frame));
+    for (size_t first = 0; first < acks.size(); first += per_frame) {
+        size_t count = std::min(per_frame, acks.size() - first);
+        size_t length = encode_commands(FRAME_ACK, acks.data() + first, count, buffer.data(), buffer.size());
+        net.post(buffer.data(), length, NET_QUEUE, FRAME_ACK);
+    }
+}
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+struct CommandChannel {     //per connection receive state
+    FrameReader reader;
+    int framed = -1;        //-1 until the first byte: framed commands or legacy relay bytes
+};
 
-            voltage3.push_back(sensor.readBusVoltage());
-            if (voltage3.size() > 10) voltage3.erase(voltage3.begin());
+//runs on the network loop
+void receive_data(Pack& pack, NetEngine& net, CommandChannel& channel, const uint8_t* data, size_t length) {
+    if (length == 0) return;
+    if (channel.framed == -1) channel.framed = (data[0] == PROTO_MAGIC0);
 
-            float avg_voltage = 0.0;
-            count = 0;
-            for (float volt : voltage3) {
-                if(volt >= 0.1){
-                    avg_voltage += volt;
-                    count++;
-                }
-            }
-            avg_voltage /= count;
-
-            //calculate SoC
-            SoC_array_3.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN3]));
-            if(SoC_array_3.size() > 5) SoC_array_3.erase(SoC_array_3.begin());
-            
-            soc_3 = 0;
-            for(int soc : SoC_array_3) {
-                soc_3 += soc;
-            }
-            soc_3 /= SoC_array_3.size();
-                
-            std::cout << std::fixed;
-            std::cout.precision(2);
-            std::cout << "Battery(3) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_3 << "%, duty cycle: " << duty_cycle3 << "%" << std::endl;
-            bat_data[10] = avg_voltage;
-            bat_data[11] = avg_current;
-            bat_data[12] = soc_3;
-            bat_data[13] = duty_cycle3;
-        }
-        else {  //set charging mode by temperature
-            if (temperature[2] > MAX_CRITICAL_TEMPERATURE) {   //over 60'C stop charging
-                charge_mode[2] = STOP_CHARGING;
-                duty_cycle3 = 0;
-                softPwmWrite(BATTERY3_PWM_PIN, duty_cycle3);
-            }
-            else if (soc_3 == 100) { charge_mode[2] = STOP_CHARGING; duty_cycle3 = 0; softPwmWrite(BATTERY3_PWM_PIN, duty_cycle3); }
-            else if (temperature[2] > MAX_SAFE_TEMPERATURE) {  //over 50'C slow down charging
-                charge_mode[2] = STANDARD_CHARGING;
-            }
-            else {
-                charge_mode[2] = FAST_CHARGING;
-            }
-            bat_data[14] = charge_mode[2];
-
-            if (charge_mode[2] != STOP_CHARGING) {
-                float target_current = (charge_mode[2] == FAST_CHARGING) ? 1000.0 : 500.0;
-                float shuntVoltage = sensor.readShuntVoltage();
-
-                current3.push_back(sensor.readCurrent());
-                if (current3.size() > 10) {
-                    current3.erase(current3.begin());
-                }
-                float avg_current = 0.0;
-                count = 0;
-                for (float amph : current3) {
-                    if(abs(amph) >= duty_cycle3){
-                        avg_current += amph;
-                        count++;
-                    }
-                }
-                avg_current /= count;
-
-                softPwmWrite(BATTERY3_PWM_PIN, 0);   //shut charging for measure voltage for SoC
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-                voltage3.push_back(sensor.readBusVoltage());
-                if (voltage3.size() > 10) voltage3.erase(voltage3.begin());
-
-                float avg_voltage = 0.0;
-                count = 0;
-                for (float volt : voltage3) {
-                    if(volt >= 0.1){
-                        avg_voltage += volt;
-                        count++;
-                    }
-                }
-                avg_voltage /= count;
-
-                //calculate SoC
-                SoC_array_3.push_back(calculate_SoC(avg_voltage, relay_state[RELAY_PIN3]));
-                if(SoC_array_3.size() > 5) SoC_array_3.erase(SoC_array_3.begin());
-                
-                soc_3 = 0;
-                for(int soc : SoC_array_3) {
-                    soc_3 += soc;
-                }
-                soc_3 /= SoC_array_3.size();
-                
-                std::cout << std::fixed;
-                std::cout.precision(2);
-                std::cout << "Battery(3) Voltage: " << avg_voltage << " V, Current: " << avg_current << " mA, SoC: " << soc_3 << "%, duty cycle: " << duty_cycle3 << "%" << std::endl;
-                bat_data[10] = avg_voltage;
-                bat_data[11] = avg_current;
-                bat_data[12] = soc_3;
-                bat_data[13] = duty_cycle3;
-
-                softPwmWrite(BATTERY3_PWM_PIN, duty_cycle3);  //charging continue
-
-                if (avg_voltage < TARGET_VOLTAGE) {
-                    //CC charging
-                    if (avg_current < target_current) {
-                        duty_cycle3 = std::min(100, (duty_cycle3 + 1) + counter); //increase duty-cycle
-                    }
-                    else {
-                        duty_cycle3 = std::max(0, (duty_cycle3 - 1) - counter);   //decrease duty-cycle
-                    }
-                }
-                else {
-                    //CV charging
-                    duty_cycle3 = std::max(0, (duty_cycle3 - 1) + counter);   //decrease duty-cycle
-                }
-                counter = std::max(0, counter - 1);
-                softPwmWrite(BATTERY3_PWM_PIN, duty_cycle3);
-            }
+    if (!channel.framed) {  //legacy: one relay command byte per cell
+        std::cout << "Data received from the server: " << std::string(reinterpret_cast<const char*>(data), length) << std::endl;
+        for (size_t i = 0; i < length && i < cell_ports.size(); i++) {
+            if (trace && (data[i] == '0' || data[i] == '1')) trace->command(hal->nowUs(), i, CMD_RELAY, data[i] - '0');
+            controlRelay(data[i], i + 1);
         }
-        //mtx.unlock();
+        return;
     }
-}
 
-void send_data(float bat_data[], float temperature[], int fan_pwm[], int relay_state[], int sock){
-    while(1){
-        char buffer[1024];
-        int length = snprintf(buffer, sizeof(buffer), "{\"voltage_1\": %.2f, \"current_1\": %.2f, \"soc_1\": %d, \"temperature_1\": %.2f, \"charge_mode_1\": %d, \"relay_state_1\": %d, \"fan_pwm_1\": %d, \"duty_cycle1\": %d, "
-        "\"voltage_2\": %.2f, \"current_2\": %.2f, \"soc_2\": %d, \"temperature_2\": %.2f, \"charge_mode_2\": %d, \"relay_state_2\": %d, \"fan_pwm_2\": %d, \"duty_cycle2\": %d, "
-        "\"voltage_3\": %.2f, \"current_3\": %.2f, \"soc_3\": %d, \"temperature_3\": %.2f, \"charge_mode_3\": %d, \"relay_state_3\": %d, \"fan_pwm_3\": %d, \"duty_cycle3\": %d, "
-        "\"resister_temp_1\": %.2f, \"resister_temp_2\": %.2f, \"resister_temp_3\": %.2f, \"resister_fan_pwm\": %d}",
-        bat_data[0], bat_data[1], (int)bat_data[2], temperature[0], (int)bat_data[4], relay_state[0], fan_pwm[0], (int)bat_data[3],
-        bat_data[5], bat_data[6], (int)bat_data[7], temperature[1], (int)bat_data[9], relay_state[2], fan_pwm[1], (int)bat_data[8],
-        bat_data[10], bat_data[11], (int)bat_data[12], temperature[2], (int)bat_data[14], relay_state[3], fan_pwm[2], (int)bat_data[13],
-        temperature[3], temperature[4], temperature[5], fan_pwm[3]);
-        
-        if(length < 0 || length >= sizeof(buffer)){
-            std::cerr << "error: buffer size in insufficient" << std::endl;
-        } else {
-            std::cout << "json generated" << buffer << std::endl;
-            send(sock, buffer, strlen(buffer), 0);
-            std::cout << "Data sent to the server" << std::endl;
+    channel.reader.feed(data, length);
+    uint8_t type;
+    std::vector<uint8_t> payload;
+    std::vector<Command> commands;
+    while (channel.reader.next(type, payload)) {
+        if (type == FRAME_RECORD_ACK) {
+            if (journal && payload.size() >= 8) journal->ack(get_u64(payload.data()));
+            continue;
+        }
+        if (type != FRAME_COMMAND) continue;
+        if (!decode_commands(payload.data(), payload.size(), commands)) {
+            std::cerr << "Malformed command frame" << std::endl;
+            continue;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        handle_commands(pack, net, commands);
+    }
+    if (channel.reader.bad()) {
+        std::cerr << "Command stream out of sync, dropping buffered bytes" << std::endl;
+        channel.reader.reset();
+        channel.framed = -1;
     }
 }
 
-void receive_data(int sock) {
-    char buffer[4] = {0};
-
-    while (true) {
-        int buffLength = read(sock, buffer, sizeof(buffer) - 1);
-        if (buffLength > 0) {
-            std::cout << "Data received from the server: " << buffer[0] << "-" << buffer[1] << "-" << buffer[2] << std::endl;
-            for(int i = 0;i < 3;i++) {
-                controlRelay(buffer[i], i + 1);
+//runs a recorded trace through the control steps on the replay clock: a charging
+//step at every recorded sweep, a fan step every FAN_PERIOD_MS and a safety pass
+//every safety_period_us of trace time
+void replay(TraceReader& reader, ReplayHal& clock, Pack& pack, TempService& temps, ThermalController& thermal,
+            SafetySupervisor& supervisor, uint64_t safety_period_us, Balancer* balancer) {
+    ChargingLoop charging(pack.size());
+    FanLoop fans(pack.size());
+    TraceRecord r;
+    uint64_t records = 0, steps = 0, first_us = 0, last_us = 0, next_fan_us = 0, next_safety_us = 0;
+    uint64_t start = monotonic_us();
+    while (reader.next(r)) {
+        if (records++ == 0) {
+            first_us = next_fan_us = next_safety_us = r.timestamp_us;
+            clock.setNow(first_us);
+            supervisor.arm();
+        }
+        while (next_fan_us <= r.timestamp_us || next_safety_us <= r.timestamp_us) {     //in time order
+            if (next_safety_us <= next_fan_us) {
+                clock.setNow(next_safety_us);
+                supervisor.check();
+                next_safety_us += safety_period_us;
             }
+            else {
+                clock.setNow(next_fan_us);
+                fan_step(temps, thermal, fans);
+                next_fan_us += FAN_PERIOD_MS * 1000ULL;
+            }
+        }
+        clock.setNow(r.timestamp_us);
+        last_us = std::max(last_us, r.timestamp_us);
+        if (r.kind == TRACE_CELL && r.index < pack.size()) {
+            CellSample sample;
+            sample.reading.voltage = r.voltage;
+            sample.reading.current = r.current;
+            sample.reading.power = r.power;
+            sample.reading.ready = r.flags & TRACE_READY;
+            sample.reading.overflow = r.flags & TRACE_OVERFLOW;
+            sample.timestamp_us = r.timestamp_us;
+            pack.inject(r.index, sample);
+        }
+        else if (r.kind == TRACE_SWEEP) {
+            charging_step(pack, temps, balancer, charging);
+            steps++;
+        }
+        else if (r.kind == TRACE_W1 && r.index < temps.size()) {
+            temps.store(r.index, r.celsius, r.timestamp_us);
+        }
+        else if (r.kind == TRACE_COMMAND) {
+            Command command{};
+            command.cell = r.index;
+            command.type = r.type;
+            command.value = r.value;
+            apply_commands(pack, { command });
         }
     }
+    double wall_s = (monotonic_us() - start) / 1e6;
+    double span_s = (last_us - first_us) / 1e6;
+    printf("replay: %llu records, %llu control steps, %.1f s of trace in %.3f s (%.0fx real time, %.0f steps/s), %llu output changes, %llu safety trips\n",
+           (unsigned long long)records, (unsigned long long)steps, span_s, wall_s, wall_s > 0 ? span_s / wall_s : 0.0,
+           wall_s > 0 ? steps / wall_s : 0.0, (unsigned long long)clock.changes(), (unsigned long long)supervisor.trips());
 }
 
-int main() {
-    setup();    //rasp sensor, pin setup;
-
-    float temperature[6];
-    float bat_data[15];
-    int fan_pwm[4];
-    int sock = 0;
-    struct sockaddr_in server_addr;
-    
-    TCA9548A ina219(0x40);
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        std::cerr << "Socket creation error" << std::endl;
+int main(int argc, char* argv[]) {
+    //BMS_CONFIG=path sets the pack topology file (default bms.conf; without one, the bench rig);
+    //kill -HUP re-reads its sensor mapping
+    const char* config_env = getenv("BMS_CONFIG");
+    std::string config_path = config_env ? config_env : CONFIG_PATH;
+    Topology topology;
+    std::string config_error;
+    bool configured = load_topology(config_path, topology, config_error);
+    if (!configured && (config_env || !config_error.empty())) {
+        std::cerr << "Config " << config_path << ": " << (config_error.empty() ? "missing" : config_error) << std::endl;
         return 1;
     }
-    
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-        std::cerr << "Invalid address/ Address not supported" << std::endl;
-        return 1;
+    std::string server_ip = (argc > 1) ? argv[1] : !topology.server_ip.empty() ? topology.server_ip : SERVER_IP;
+    if (topology.resistor_fan_pin >= 0) resistor_fan_pin = topology.resistor_fan_pin;
+    //BMS_TELEMETRY=json keeps the legacy unframed JSON, BMS_TELEMETRY_PERIOD_MS sets the send rate
+    const char* format = getenv("BMS_TELEMETRY");
+    const char* period = getenv("BMS_TELEMETRY_PERIOD_MS");
+    TelemetryFormat telemetry_format = (format && strcmp(format, "json") == 0) ? TELEMETRY_JSON : TELEMETRY_BINARY;
+    int telemetry_period_ms = (period && atoi(period) > 0) ? atoi(period) : TELEMETRY_PERIOD_MS;
+    //BMS_CAPTURE=1 also uploads every control loop sample (binary format only)
+    const char* capture_on = getenv("BMS_CAPTURE");
+    const char* flush = getenv("BMS_CAPTURE_FLUSH_MS");
+    const char* batch = getenv("BMS_CAPTURE_BATCH");
+    bool capture_enabled = capture_on && atoi(capture_on) > 0 && telemetry_format == TELEMETRY_BINARY;
+    int capture_flush_ms = (flush && atoi(flush) > 0) ? atoi(flush) : CAPTURE_FLUSH_MS;
+    size_t capture_batch = (batch && atoi(batch) > 0) ? atoi(batch) : CAPTURE_BATCH;
+    //BMS_TCP_NODELAY=0 / BMS_TCP_KEEPALIVE=0 turn the socket options off
+    const char* nodelay = getenv("BMS_TCP_NODELAY");
+    const char* keepalive = getenv("BMS_TCP_KEEPALIVE");
+    NetOptions net_options;
+    net_options.nodelay = !(nodelay && atoi(nodelay) == 0);
+    net_options.keepalive = !(keepalive && atoi(keepalive) == 0);
+    //BMS_JOURNAL=path moves the telemetry journal, BMS_JOURNAL=0 turns it off (binary format only)
+    const char* journal_path = getenv("BMS_JOURNAL");
+    bool journal_enabled = !(journal_path && strcmp(journal_path, "0") == 0) && telemetry_format == TELEMETRY_BINARY;
+    if (!journal_path) journal_path = JOURNAL_PATH;
+    //BMS_STATS=0 turns the stage timers off, BMS_STATS_SOCKET moves the stats endpoint
+    const char* stats_on = getenv("BMS_STATS");
+    const char* stats_socket = getenv("BMS_STATS_SOCKET");
+    bool stats_enabled = !(stats_on && atoi(stats_on) == 0);
+    //BMS_INA219_ADC=9..12 (bits) or avg2..avg128 (averaged samples), BMS_INA219_READY=1 skips repeated conversions
+    const char* ina_adc = getenv("BMS_INA219_ADC");
+    const char* ina_ready = getenv("BMS_INA219_READY");
+    Ina219Config sensor_config;
+    if (ina_adc && strncmp(ina_adc, "avg", 3) == 0 && atoi(ina_adc + 3) >= 2) sensor_config.adc = INA219_ADC_AVG(std::min(128, atoi(ina_adc + 3)));
+    else if (ina_adc && atoi(ina_adc) >= 9 && atoi(ina_adc) <= 12) sensor_config.adc = INA219_ADC_9BIT + atoi(ina_adc) - 9;
+    sensor_config.track_ready = ina_ready && atoi(ina_ready) > 0;
+    //BMS_PWM_CHARGE / BMS_PWM_FAN=hz[:steps] set the pwm channels (default 100 Hz x 100)
+    const char* pwm_settings[2] = { getenv("BMS_PWM_CHARGE"), getenv("BMS_PWM_FAN") };
+    PwmConfig* pwm_configs[2] = { &charge_pwm, &fan_pwm };
+    for (int k = 0; k < 2; k++) {
+        int hz = 0, steps = 0;
+        int fields = pwm_settings[k] ? sscanf(pwm_settings[k], "%d:%d", &hz, &steps) : 0;
+        if (fields >= 1 && hz > 0) pwm_configs[k]->frequency_hz = hz;
+        if (fields == 2 && steps > 0) pwm_configs[k]->range = steps;
     }
-    
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Connection Failed" << std::endl;
+    //BMS_BALANCE=1 hands the discharge relays to the balancer, otherwise they are the operator's;
+    //BMS_BALANCE_SOC=start[:stop] (% above the lowest cell), BMS_BALANCE_TOP_SOC (% the lowest cell
+    //reaches before any bleed) and BMS_BALANCE_DWELL_S (minimum time in each relay state) tune it
+    const char* balance_on = getenv("BMS_BALANCE");
+    const char* balance_soc = getenv("BMS_BALANCE_SOC");
+    const char* balance_top = getenv("BMS_BALANCE_TOP_SOC");
+    const char* balance_dwell = getenv("BMS_BALANCE_DWELL_S");
+    bool balance_enabled = balance_on && atoi(balance_on) > 0;
+    BalanceConfig balance_config;
+    float soc_start = 0, soc_stop = 0;
+    int soc_fields = balance_soc ? sscanf(balance_soc, "%f:%f", &soc_start, &soc_stop) : 0;
+    if (soc_fields >= 1 && soc_start > 0) balance_config.start_soc = soc_start;
+    balance_config.stop_soc = std::min(balance_config.start_soc, soc_fields == 2 && soc_stop >= 0 ? soc_stop : balance_config.stop_soc);
+    if (balance_top && atof(balance_top) >= 0 && atof(balance_top) <= 100) balance_config.top_soc = static_cast<float>(atof(balance_top));
+    if (balance_dwell && atof(balance_dwell) >= 0) balance_config.min_on_us = balance_config.min_off_us = static_cast<uint64_t>(atof(balance_dwell) * 1e6);
+    //BMS_FAN_CURVE / BMS_RESISTOR_FAN_CURVE=start:full[:hysteresis[:lead_s]] ('C, s) set the fan curves
+    const char* curve_settings[2] = { getenv("BMS_FAN_CURVE"), getenv("BMS_RESISTOR_FAN_CURVE") };
+    FanCurve cell_curve, resistor_curve;
+    resistor_curve.start_c = FAN_RESISTOR_START_C;
+    resistor_curve.full_c = FAN_RESISTOR_FULL_C;
+    FanCurve* curves[2] = { &cell_curve, &resistor_curve };
+    for (int k = 0; k < 2; k++) {
+        float start = 0, full = 0, hysteresis = 0, lead = 0;
+        int fields = curve_settings[k] ? sscanf(curve_settings[k], "%f:%f:%f:%f", &start, &full, &hysteresis, &lead) : 0;
+        if (fields >= 2 && full > start) {
+            curves[k]->start_c = start;
+            curves[k]->full_c = full;
+        }
+        if (fields >= 3 && hysteresis >= 0) curves[k]->hysteresis_c = hysteresis;
+        if (fields >= 4 && lead >= 0) curves[k]->lead_s = lead;
+    }
+    //BMS_CHARGE_PERIOD_MS sets the control period; BMS_RT_CPU pins the charging and fan
+    //tasks to one CPU, BMS_RT_PRIORITY runs them SCHED_FIFO (charging at it, fans one below)
+    const char* charge_period = getenv("BMS_CHARGE_PERIOD_MS");
+    const char* rt_cpu = getenv("BMS_RT_CPU");
+    const char* rt_priority = getenv("BMS_RT_PRIORITY");
+    int charge_period_ms = (charge_period && atoi(charge_period) > 0) ? atoi(charge_period) : CHARGE_PERIOD_MS;
+    TaskOptions control_options, fan_options;
+    control_options.cpu = fan_options.cpu = rt_cpu ? atoi(rt_cpu) : -1;
+    control_options.priority = rt_priority ? std::min(99, std::max(0, atoi(rt_priority))) : 0;
+    fan_options.priority = std::max(0, control_options.priority - 1);
+    //BMS_SAFETY_PERIOD_MS sets the supervisor rate (it runs one priority above charging), BMS_SAFETY_CELL_V=min:max
+    //its cell voltage limits (min while discharging)
+    const char* safety_period = getenv("BMS_SAFETY_PERIOD_MS");
+    const char* safety_cell_v = getenv("BMS_SAFETY_CELL_V");
+    int safety_period_ms = (safety_period && atoi(safety_period) > 0) ? atoi(safety_period) : SAFETY_PERIOD_MS;
+    TaskOptions safety_options = control_options;
+    if (control_options.priority > 0) safety_options.priority = std::min(99, control_options.priority + 1);
+    SafetyLimits safety_limits;
+    float safety_min_v = 0, safety_max_v = 0;
+    if (safety_cell_v && sscanf(safety_cell_v, "%f:%f", &safety_min_v, &safety_max_v) == 2 && safety_max_v > safety_min_v && safety_min_v > 0) {
+        safety_limits.min_cell_v = safety_min_v;
+        safety_limits.max_cell_v = safety_max_v;
+    }
+    //BMS_TRACE=path records every raw INA219 and DS18B20 reading and every command; BMS_REPLAY=path
+    //runs such a trace through the control code instead of the rig, as fast as it goes, and writes
+    //every duty, fan and relay change to BMS_REPLAY_OUT (default replay.csv); the replay runs the safety
+    //supervisor on the trace clock and balances when the recording did
+    const char* trace_path = getenv("BMS_TRACE");
+    const char* replay_path = getenv("BMS_REPLAY");
+    const char* replay_out = getenv("BMS_REPLAY_OUT");
+    //BMS_READY_TIMEOUT_MS bounds how long a task waits at startup for the first samples it needs
+    const char* ready_timeout = getenv("BMS_READY_TIMEOUT_MS");
+    uint64_t ready_timeout_us = ((ready_timeout && atoi(ready_timeout) > 0) ? atoi(ready_timeout) : READY_TIMEOUT_MS) * 1000ULL;
+#ifdef BMS_SIMULATION
+    //off-Pi run against the cell model; BMS_SIM_SPEEDUP=0 runs without sleeping,
+    //BMS_SIM_CELLS=n simulates an n-cell pack instead of the bench rig, spread over
+    //BMS_SIM_BUSES i2c buses; BMS_SIM_I2C_US models the bus time of one transaction
+    const char* speedup = getenv("BMS_SIM_SPEEDUP");
+    const char* sim_cells = getenv("BMS_SIM_CELLS");
+    const char* sim_buses = getenv("BMS_SIM_BUSES");
+    const char* sim_i2c_us = getenv("BMS_SIM_I2C_US");
+    int bus_count = (sim_buses && atoi(sim_buses) > 0) ? atoi(sim_buses) : 1;
+    cell_ports = (sim_cells && atoi(sim_cells) > 0) ? sim_ports(atoi(sim_cells), bus_count) : configured ? topology.cells : rig_ports();
+    static SimHal sim_hal(cell_ports, resistor_fan_pin, speedup ? atof(speedup) : 1.0);
+    if (sim_i2c_us) sim_hal.i2c_transaction_us = atof(sim_i2c_us);
+    hal = &sim_hal;
+#else
+    cell_ports = configured ? topology.cells : rig_ports();
+    static WiringPiHal wiringpi_hal;
+    hal = &wiringpi_hal;
+#endif
+    static TraceReader reader;
+    ReplayHal* replay_clock = nullptr;
+    if (replay_path) {
+        if (!reader.open(replay_path)) {
+            std::cerr << "Could not read trace " << replay_path << std::endl;
+            return 1;
+        }
+        if (reader.cells() != cell_ports.size()) {
+            std::cerr << "Trace of " << reader.cells() << " cells, the pack has " << cell_ports.size() << std::endl;
+            return 1;
+        }
+        if (reader.hasSettings()) balance_enabled = reader.settings() & TRACE_BALANCE;     //as recorded, whatever BMS_BALANCE says now
+        if (!replay_out) replay_out = REPLAY_OUT;
+        FILE* decisions = fopen(replay_out, "w");
+        if (!decisions) {
+            std::cerr << "Could not open " << replay_out << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        static ReplayHal replay_hal(cell_ports, resistor_fan_pin, decisions);
+        replay_clock = &replay_hal;
+        hal = replay_clock;
+        stats_enabled = journal_enabled = capture_enabled = false;
+        trace_path = nullptr;
+    }
+    static StageStats shared_stats;
+    static InstrumentedHal instrumented_hal(*hal, shared_stats);
+    if (stats_enabled) {
+        stage_stats = &shared_stats;
+        hal = &instrumented_hal;
+        std::cout << "Stage timers on, " << stage_stats->calibrate() << " ns per timed call" << std::endl;
+    }
+    static Telemetry shared_telemetry(cell_ports.size());
+    telemetry = &shared_telemetry;
+    static RelayBank relay_bank(*hal, cell_ports, shared_telemetry);
+    relays = &relay_bank;
+    static SampleCapture shared_capture(capture_enabled ? cell_ports.size() : 0);
+    if (capture_enabled) capture = &shared_capture;
+    static Journal shared_journal;
+    if (journal_enabled) {
+        if (shared_journal.open(journal_path)) {
+            journal = &shared_journal;
+            std::cout << "Journal " << journal_path << ": " << (journal->nextSeq() - 1 - journal->acked()) << " frames waiting for the server" << std::endl;
+        }
+        else {
+            std::cerr << "Could not open journal " << journal_path << ": " << strerror(errno) << ", sending without it" << std::endl;
+        }
+    }
+    static TraceWriter trace_writer;
+    if (trace_path) {
+        if (trace_writer.open(trace_path, cell_ports.size(), 2 * cell_ports.size(), balance_enabled ? TRACE_BALANCE : 0)) {
+            trace = &trace_writer;
+            std::cout << "Tracing raw readings to " << trace_path << std::endl;
+        }
+        else {
+            std::cerr << "Could not open trace " << trace_path << ": " << strerror(errno) << std::endl;
+        }
+    }
+    setup();    //rasp sensor, pin setup;
+    if (control_options.priority > 0) lock_memory();
+
+    if (configured) std::cout << "Config " << config_path << ": " << cell_ports.size() << " cells" << std::endl;
+    if (!replay_clock) report_sensors(temperature_paths(cell_ports), topology.w1_dir);
+    Pack pack(*hal, cell_ports, CURRENT_WINDOW, VOLTAGE_WINDOW, sensor_config);
+    pack.pwm_range = charge_pwm.range;
+    Balancer balancer(pack.size(), balance_config);
+    std::cout << "Pack: " << pack.size() << " cells on " << pack.busCount() << " i2c bus(es)" << std::endl;
+    TempService temps(*hal, temperature_paths(cell_ports));
+    ThermalController thermal(*hal);
+    thermal.pwm_range = fan_pwm.range;
+    for (const CellPorts& port : cell_ports) thermal.addFan(port.fan_pin, cell_curve);
+    thermal.addFan(resistor_fan_pin, resistor_curve);
+    SafetySupervisor supervisor(*hal, cell_ports, temps, safety_limits);
+    supervisor.setRelays([](size_t i) { return relays->state(i); }, [](size_t i) { return relays->open(i); });
+    pack.setSupervisor(&supervisor);
+    relays->setSupervisor(&supervisor);
+    if (replay_clock) {
+        pack.replayMode();
+        pack.verbose = verbose = false;
+        std::cout << "Replay: balancing " << (balance_enabled ? "on" : "off") << (reader.hasSettings() ? " (as recorded)" : " (BMS_BALANCE, the trace predates its settings)") << std::endl;
+        replay(reader, *replay_clock, pack, temps, thermal, supervisor, safety_period_ms * 1000ULL, balance_enabled ? &balancer : nullptr);
+        std::cout << "Decisions written to " << replay_out << std::endl;
+        return 0;
+    }
+    pack.setTrace(trace);
+    temps.setTrace(trace);
+
+    //every input a task waits for at startup
+    size_t cells = cell_ports.size();
+    Readiness readiness(*hal);
+    std::vector<size_t> sensor_signals, ina_signals;
+    std::vector<std::string> sensor_paths = temperature_paths(cell_ports);
+    for (size_t i = 0; i < sensor_paths.size(); i++) sensor_signals.push_back(readiness.add(sensor_name(i, cells) + " sensor " + w1_sensor_id(sensor_paths[i])));
+    for (size_t i = 0; i < cells; i++) ina_signals.push_back(readiness.add("cell " + std::to_string(i + 1) + " INA219"));
+    size_t cells_signal = readiness.add("first charging step");
+    size_t thermal_signal = readiness.add("first fan step");
+    temps.setReadiness(&readiness, sensor_signals);
+    pack.setReadiness(&readiness, ina_signals);
+    telemetry->setReadiness(&readiness, cells_signal, thermal_signal);
+    uint64_t boot_us = hal->nowUs();
+    temps.start();
+    signal(SIGHUP, request_reload);
+
+    //the network loop connects, and reconnects, on its own; charging does not wait for it
+    NetEngine net(server_ip, SERVER_PORT, net_options);
+    if (!net.valid()) {
+        std::cerr << "Invalid address/ Address not supported" << std::endl;
         return 1;
     }
-    std::cout << "1" << std::endl;
-    std::thread ctrlFanThread(control_fan_speed, temperature, fan_pwm);
-    std::this_thread::sleep_for(std::chrono::milliseconds(10000));
-    std::cout << "read done" << std::endl;
-    
-    std::thread ctrlChargingBatThread(control_charging, std::ref(ina219), temperature, bat_data);
-    std::thread sendThread(send_data, bat_data, temperature, fan_pwm, relay_state, sock);
-    std::thread receiveThread(receive_data, sock);
+    CommandChannel channel;
+    JournalStream stream;
+    net.onConnect([&] {
+        channel = CommandChannel();
+        if (journal) journal_connected(net, stream);
+    });
+    net.onReceive([&](const uint8_t* data, size_t length) { receive_data(pack, net, channel, data, length); });
+    if (stage_stats) net.timeSends(&stage_stats->stage(STAGE_SEND));
+    std::thread netThread(&NetEngine::run, &net);
+
+    PeriodicTask fan_task(*hal, "fan", FAN_PERIOD_MS * 1000ULL, fan_options);
+    PeriodicTask charging_task(*hal, "charging", charge_period_ms * 1000ULL, control_options);
+    PeriodicTask send_task(*hal, "send", telemetry_period_ms * 1000ULL);
+    PeriodicTask upload_task(*hal, "upload", capture_flush_ms * 1000ULL);
+    PeriodicTask status_task(*hal, "status", STATUS_PERIOD_MS * 1000ULL);
+    PeriodicTask safety_task(*hal, "safety", safety_period_ms * 1000ULL, safety_options);
+    std::vector<const PeriodicTask*> tasks = { &safety_task, &charging_task, &fan_task, &send_task, &status_task };
+    if (capture) tasks.push_back(&upload_task);
+
+    StatsServer stats_server;
+    std::string stats_path = stats_socket ? stats_socket : STATS_SOCKET;
+    auto render_stats = [&] {
+        std::string out = "{";
+        if (stage_stats) {
+            stage_stats->json(out);
+            out += ", ";
+        }
+        out += "\"tasks\": {";
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (i) out += ", ";
+            tasks[i]->json(out);
+        }
+        out += "}, ";
+        supervisor.json(out);
+        out += ", \"net\": {\"connected\": " + std::to_string(net.connected()) + ", \"reconnects\": " + std::to_string(net.reconnects()) +
+               ", \"drops\": " + std::to_string(net.drops()) + ", \"coalesced\": " + std::to_string(net.coalesces()) + "}}";
+        return out;
+    };
+    if (!stats_server.start(stats_path, render_stats)) std::cerr << "Could not open stats socket " << stats_path << ": " << strerror(errno) << std::endl;
+
+    //each task starts as soon as its inputs have a first sample: charging on the cell temperatures,
+    //the fans on every temperature, sending on both control tasks' first frames and every INA219
+    std::vector<size_t> cell_temps(sensor_signals.begin(), sensor_signals.begin() + cells);
+    await_inputs(readiness, "charging", cell_temps, boot_us, boot_us + ready_timeout_us);
+    supervisor.arm();
+    std::thread safetyThread(supervise, std::ref(supervisor), std::ref(safety_task));
+    std::thread ctrlChargingBatThread(control_charging, std::ref(pack), std::ref(temps), balance_enabled ? &balancer : nullptr, std::ref(charging_task));
+    await_inputs(readiness, "fan control", sensor_signals, boot_us, boot_us + ready_timeout_us);
+    std::thread ctrlFanThread(control_fan_speed, std::ref(temps), std::ref(thermal), std::ref(fan_task));
+    std::vector<size_t> send_inputs = ina_signals;
+    send_inputs.push_back(cells_signal);
+    send_inputs.push_back(thermal_signal);
+    await_inputs(readiness, "telemetry", send_inputs, boot_us, hal->nowUs() + ready_timeout_us);
+    std::thread sendThread(send_data, std::ref(net), telemetry_format, std::ref(send_task));
+    std::thread uploadThread;
+    if (capture) uploadThread = std::thread(upload_samples, std::ref(net), capture_batch, std::ref(upload_task));
+    std::thread journalThread;
+    if (journal) journalThread = std::thread(stream_journal, std::ref(net), std::ref(stream));
     
+    TelemetryFrame frame;
+    uint64_t last_report_us = hal->nowUs();
+    status_task.enter();
     while (1) {
+        telemetry->snapshot(frame);
+        const float* bat_data = frame.bat_data.data();
         printf("----------------\nsend data %.2f, %.2f, %d, %d, %d\n-----------------\n", bat_data[0], bat_data[1], (int)bat_data[2], (int)bat_data[3], (int)bat_data[4]);
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        if (hal->nowUs() - last_report_us >= SCHED_REPORT_MS * 1000ULL) {
+            for (const PeriodicTask* task : tasks) task->report(stdout);
+            supervisor.report(stdout);
+            if (stage_stats) stage_stats->report(stdout);
+            last_report_us = hal->nowUs();
+        }
+        if (trace) trace->flush();
+        if (reload_requested.exchange(false)) reload_topology(config_path, server_ip, temps);
+        status_task.wait();
     }
 
+    safetyThread.join();
     ctrlFanThread.join();
     ctrlChargingBatThread.join();
     sendThread.join();
-    receiveThread.join();
+    netThread.join();
+    if (uploadThread.joinable()) uploadThread.join();
+    if (journalThread.joinable()) journalThread.join();
     
     return 0;
 }
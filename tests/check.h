@@ -0,0 +1,29 @@
+/*
+* brief : minimal checks for the test programs - CHECK() reports a failed condition and keeps going,
+*         check_result() is the exit status
+*/
+#ifndef BMS_TESTS_CHECK_H
+#define BMS_TESTS_CHECK_H
+
+#include <cstdio>
+
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            check_failures()++; \
+        } \
+    } while (0)
+
+//prints the verdict of one test program; 0 when every check held
+inline int check_result(const char* name) {
+    if (check_failures()) fprintf(stderr, "%s: %d check(s) failed\n", name, check_failures());
+    else printf("%s: ok\n", name);
+    return check_failures() ? 1 : 0;
+}
+
+#endif
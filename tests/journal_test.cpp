@@ -0,0 +1,192 @@
+/*
+* brief : telemetry journal crash safety - wrap with pad records, reopen, a corrupted and a torn tail record,
+*         a lost header update
+*
+* build : g++ -std=c++17 -O2 tests/journal_test.cpp -o journal_test -lpthread
+* run   : ./journal_test
+*
+* The journal is a small ring in a temporary file. A model of the ring (record
+* offsets and sizes, the same eviction rule) says where head and tail must be
+* after every append; a crash is simulated by writing into the file behind the
+* journal's back while it is closed.
+*/
+#include <deque>
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdlib>
+
+#include "../bms/journal.h"
+#include "check.h"
+
+#define CAPACITY 4096
+
+struct Entry {
+    uint64_t start;
+    size_t size;
+    uint64_t seq;       //0: pad record
+};
+
+//the inner frame of record seq: the sequence number, then bytes derived from it
+static std::vector<uint8_t> frame_for(uint64_t seq) {
+    std::vector<uint8_t> f(60 + (seq % 5) * 13);
+    put_u64(f.data(), seq);
+    for (size_t k = 8; k < f.size(); k++) f[k] = static_cast<uint8_t>(seq * 7 + k);
+    return f;
+}
+
+static size_t record_size(uint64_t seq) {
+    size_t n = JOURNAL_RECORD_HEADER + PROTO_HEADER_SIZE + RECORD_HEADER_SIZE + frame_for(seq).size();
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+struct Model {     //where the journal must have put everything
+    std::deque<Entry> ring;
+    uint64_t head = 0, tail = 0;
+    int pads = 0;
+
+    void append(uint64_t seq) {
+        size_t need = record_size(seq);
+        if (head % CAPACITY + need > CAPACITY) {
+            size_t pad = CAPACITY - head % CAPACITY;
+            ring.push_back({ head, pad, 0 });
+            head += pad;
+            pads++;
+        }
+        ring.push_back({ head, need, seq });
+        head += need;
+        while (head - ring.front().start > CAPACITY) ring.pop_front();
+        tail = ring.front().start;
+    }
+
+    std::vector<uint64_t> seqs() const {
+        std::vector<uint64_t> s;
+        for (const Entry& e : ring) if (e.seq) s.push_back(e.seq);
+        return s;
+    }
+
+    const Entry& last() const { return ring.back(); }
+};
+
+//every surviving frame, oldest first, is the one that was appended under its sequence number
+static void check_frames(Journal& j, const std::vector<uint64_t>& expect) {
+    std::vector<uint64_t> seen;
+    j.forEach([&](uint64_t seq, const uint8_t* frame, size_t length) {
+        seen.push_back(seq);
+        std::vector<uint8_t> f = frame_for(seq);
+        CHECK(length == f.size() && memcmp(frame, f.data(), length) == 0);
+    });
+    CHECK(seen == expect);
+}
+
+static void check_state(Journal& j, const Model& m, uint64_t next_seq, uint64_t acked) {
+    CHECK(j.head() == m.head);
+    CHECK(j.tail() == m.tail);
+    CHECK(j.nextSeq() == next_seq);
+    CHECK(j.acked() == acked);
+    check_frames(j, m.seqs());
+}
+
+static void write_at(const std::string& path, off_t offset, const void* data, size_t length) {
+    int fd = ::open(path.c_str(), O_WRONLY);
+    CHECK(fd != -1 && pwrite(fd, data, length, offset) == static_cast<ssize_t>(length));
+    if (fd != -1) ::close(fd);
+}
+
+int main() {
+    char path_buf[] = "/tmp/journal_test_XXXXXX";
+    int tmp = mkstemp(path_buf);
+    if (tmp == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    ::close(tmp);
+    std::string path = path_buf;
+
+    Journal j;
+    Model m;
+    uint64_t seq = 1;
+    auto append = [&] {
+        std::vector<uint8_t> f = frame_for(seq);
+        CHECK(j.append(f.data(), f.size()) == seq);
+        m.append(seq);
+        seq++;
+    };
+
+    //fresh file, a few records, part of them acknowledged
+    CHECK(j.open(path, CAPACITY));
+    CHECK(j.capacity() == CAPACITY);
+    check_state(j, m, 1, 0);
+    for (int i = 0; i < 10; i++) append();
+    j.ack(4);
+    j.ack(3);       //acks never go backwards
+    check_state(j, m, seq, 4);
+    uint64_t cursor = j.firstUnacked();
+    CHECK(cursor == m.ring[4].start);
+    uint8_t out[1024];
+    size_t length = j.read(cursor, out, sizeof(out));
+    CHECK(length && out[3] == FRAME_RECORD && get_u64(out + PROTO_HEADER_SIZE) == 5);
+
+    j.close();
+    CHECK(j.open(path, CAPACITY));
+    check_state(j, m, seq, 4);
+
+    //wrap the ring three times: pad records at the end, the oldest records evicted
+    while (m.head < 3 * CAPACITY) append();
+    CHECK(m.pads > 0);
+    CHECK(m.seqs().front() > 10);
+    CHECK(j.lost() == m.seqs().front() - 1 - 4);     //evicted before the server had them
+    uint64_t acked = seq - 5;
+    j.ack(acked);
+    check_state(j, m, seq, acked);
+    j.close();
+    CHECK(j.open(path, CAPACITY));
+    check_state(j, m, seq, acked);
+    for (const Entry& e : m.ring) {
+        if (e.seq != acked + 1) continue;
+        CHECK(j.firstUnacked() == e.start);
+    }
+
+    //corrupted tail: a flipped payload byte fails the CRC, the journal ends before that record
+    Entry last = m.last();
+    j.close();
+    uint8_t flip = static_cast<uint8_t>(~frame_for(last.seq)[20]);
+    write_at(path, JOURNAL_HEADER_SIZE + last.start % CAPACITY + JOURNAL_RECORD_HEADER + PROTO_HEADER_SIZE + RECORD_HEADER_SIZE + 20,
+             &flip, 1);
+    CHECK(j.open(path, CAPACITY));
+    m.ring.pop_back();
+    m.head = last.start;
+    check_state(j, m, seq, acked);     //the lost sequence number is not handed out again
+    append();
+    check_state(j, m, seq, acked);
+
+    //torn tail: the head had moved past a record that never reached the file
+    last = m.last();
+    j.close();
+    std::vector<uint8_t> zeros(last.size, 0);
+    write_at(path, JOURNAL_HEADER_SIZE + last.start % CAPACITY, zeros.data(), zeros.size());
+    CHECK(j.open(path, CAPACITY));
+    m.ring.pop_back();
+    m.head = last.start;
+    check_state(j, m, seq, acked);
+
+    //the header page was not written back: next_seq is behind the records, recovery moves it past them
+    j.close();
+    uint64_t stale = 1;
+    write_at(path, offsetof(JournalHeader, next_seq), &stale, sizeof(stale));
+    CHECK(j.open(path, CAPACITY));
+    check_state(j, m, m.seqs().back() + 1, acked);
+    seq = m.seqs().back() + 1;
+    append();
+    check_state(j, m, seq, acked);
+
+    //read only: the same records, and nothing can be appended
+    j.close();
+    CHECK(j.open(path, CAPACITY, true));
+    check_state(j, m, seq, acked);
+    CHECK(j.append(out, 16) == 0);
+
+    j.close();
+    unlink(path.c_str());
+    return check_result("journal_test");
+}
@@ -0,0 +1,243 @@
+/*
+* brief : binary frame round trip - encoders against the checked-in golden frames, decoding,
+*         stream reassembly split at every byte, corrupt headers, invalid values
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION tests/protocol_test.cpp -o protocol_test -lpthread
+* run   : ./protocol_test [--update]     (from the repository root)
+*
+* tests/golden holds the frames encoded here; the backend decoder is tested
+* against the same files (backend/test/telemetryProtocol.test.js), so a change
+* to either side that breaks the other fails one of the two. --update rewrites
+* them after an intended format change.
+*/
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+
+#include "../bms/protocol.h"
+#include "check.h"
+
+#define GOLDEN_DIR "tests/golden/"
+
+typedef std::vector<uint8_t> Bytes;
+
+static bool update = false;
+
+//the frame equals the golden file (or replaces it with --update)
+static void check_golden(const char* name, const Bytes& frame) {
+    std::string path = std::string(GOLDEN_DIR) + name;
+    if (update) {
+        std::ofstream out(path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+        CHECK(out.good());
+        return;
+    }
+    std::ifstream in(path, std::ios::binary);
+    Bytes golden((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (golden != frame) fprintf(stderr, "%s differs from the encoder output (run from the repository root)\n", path.c_str());
+    CHECK(golden == frame);
+}
+
+static bool near(float a, float b) { return std::fabs(a - b) < 1e-4f * std::max(1.0f, std::fabs(b)); }
+
+//three cells: plain values, every invalid case, a discharge; the backend test expects the same numbers
+static TelemetryFrame telemetry_frame() {
+    TelemetryFrame f;
+    f.bat_data = {
+        3.712f, 1250.25f, 63, 40, 1,
+        NAN, 21474838.0f, 100, 0, 0,        //current * 100 overflows i32
+        4.2f, -1500.5f, 90, 12, 2,
+    };
+    f.temperature = { 27.5f, NAN, -5.25f, 31.25f, 400.0f, 45.0f };     //400 'C * 100 overflows i16
+    f.fan_pwm = { 20, 100, 0, 55 };
+    f.relay_state = { 0, 1, 1 };
+    f.cells_version = 1;
+    return f;
+}
+
+static Bytes encode(const TelemetryFrame& f, uint32_t seq, uint64_t now_us) {
+    Bytes out(telemetry_frame_size(f.cells()));
+    CHECK(encode_telemetry(f, seq, now_us, out.data(), out.size()) == out.size());
+    CHECK(encode_telemetry(f, seq, now_us, out.data(), out.size() - 1) == 0);
+    return out;
+}
+
+static void check_telemetry(const Bytes& payload) {
+    TelemetryMessage m;
+    CHECK(decode_telemetry(payload.data(), payload.size(), m));
+    CHECK(m.seq == 42 && m.timestamp_us == 1234567890123ULL && m.resister_fan_pwm == 55 && m.cells.size() == 3);
+    if (m.cells.size() != 3) return;
+
+    const CellRecord& a = m.cells[0];
+    CHECK(a.flags == 0);
+    CHECK(near(a.voltage, 3.712f) && near(a.current, 1250.25f) && near(a.temperature, 27.5f) && near(a.resister_temp, 31.25f));
+    CHECK(a.soc == 63 && a.duty_cycle == 40 && a.charge_mode == 1 && a.fan_pwm == 20 && a.relay_state == 0);
+
+    const CellRecord& b = m.cells[1];
+    CHECK(b.flags == (CELL_RELAY_ON | CELL_VOLTAGE_INVALID | CELL_CURRENT_INVALID | CELL_TEMP_INVALID | CELL_RESISTER_TEMP_INVALID));
+    CHECK(std::isnan(b.voltage) && std::isnan(b.current) && std::isnan(b.temperature) && std::isnan(b.resister_temp));
+    CHECK(b.soc == 100 && b.fan_pwm == 100 && b.relay_state == 1);
+
+    const CellRecord& c = m.cells[2];
+    CHECK(c.flags == CELL_RELAY_ON);
+    CHECK(near(c.voltage, 4.2f) && near(c.current, -1500.5f) && near(c.temperature, -5.25f) && near(c.resister_temp, 45.0f));
+    CHECK(c.soc == 90 && c.duty_cycle == 12 && c.charge_mode == 2 && c.fan_pwm == 0);
+
+    CHECK(!decode_telemetry(payload.data(), payload.size() - 1, m));    //a record cut short
+}
+
+static std::vector<Sample> samples() {
+    return {
+        { 5000000, 3.801f, 500.0f, 0, 40, 1, 60, 0 },
+        { 5000250, 3.802f, NAN, 1, 41, 1, 61, 1 },
+        { 5001000, 70.0f, -250.75f, 2, 0, 0, 99, 1 },     //70 V does not fit u16 mV
+        { 5001250, 3.803f, 21474836.0f, 0, 40, 1, 60, 0 },  //* 100 fits i32, but is 2^31 when scaled in float
+    };
+}
+
+static void check_samples(const Bytes& payload) {
+    uint32_t seq = 0;
+    std::vector<Sample> s;
+    CHECK(decode_samples(payload.data(), payload.size(), seq, s));
+    CHECK(seq == 7 && s.size() == 4);
+    if (s.size() != 4) return;
+    CHECK(s[0].timestamp_us == 5000000 && s[0].cell == 0 && near(s[0].voltage, 3.801f) && near(s[0].current, 500.0f));
+    CHECK(s[0].duty_cycle == 40 && s[0].charge_mode == 1 && s[0].soc == 60 && s[0].relay_state == 0);
+    CHECK(s[1].timestamp_us == 5000250 && std::isnan(s[1].current) && s[1].relay_state == 1);
+    CHECK(s[2].timestamp_us == 5001000 && std::isnan(s[2].voltage) && near(s[2].current, -250.75f) && s[2].soc == 99);
+    CHECK(near(s[3].current, 21474836.0f));
+}
+
+static std::vector<Command> commands() {
+    return {
+        { 7, 0, CMD_RELAY, 0, 1 },
+        { 8, CELL_ALL, CMD_CHARGE_MODE, 0, -1 },
+        { 9, 2, CMD_CURRENT_SETPOINT, 0, 1500 },
+    };
+}
+
+static std::vector<Command> acks() {
+    return {
+        { 7, 0, CMD_RELAY, ACK_REFUSED, 0 },
+        { 8, 0, CMD_CHARGE_MODE, ACK_OK, -1 },
+        { 9, 5, CMD_CURRENT_SETPOINT, ACK_BAD_CELL, 1500 },
+    };
+}
+
+static Bytes encode(uint8_t type, const std::vector<Command>& c) {
+    Bytes out(command_frame_size(c.size()));
+    CHECK(encode_commands(type, c.data(), c.size(), out.data(), out.size()) == out.size());
+    return out;
+}
+
+static void check_commands(const Bytes& payload, const std::vector<Command>& expect, bool ack) {
+    std::vector<Command> c;
+    CHECK(decode_commands(payload.data(), payload.size(), c));
+    CHECK(c.size() == expect.size());
+    for (size_t i = 0; i < c.size() && i < expect.size(); i++) {
+        CHECK(c[i].seq == expect[i].seq && c[i].cell == expect[i].cell && c[i].type == expect[i].type);
+        CHECK(c[i].value == expect[i].value && c[i].status == (ack ? expect[i].status : 0));
+    }
+}
+
+//every frame of the stream, checked by type
+static int check_frames(FrameReader& reader) {
+    uint8_t type;
+    Bytes payload;
+    int frames = 0;
+    while (reader.next(type, payload)) {
+        switch (type) {
+        case FRAME_TELEMETRY: check_telemetry(payload); break;
+        case FRAME_SAMPLES: check_samples(payload); break;
+        case FRAME_COMMAND: check_commands(payload, commands(), false); break;
+        case FRAME_ACK: check_commands(payload, acks(), true); break;
+        default: CHECK(!"unknown frame type");
+        }
+        frames++;
+    }
+    CHECK(!reader.bad());
+    return frames;
+}
+
+int main(int argc, char** argv) {
+    update = argc > 1 && strcmp(argv[1], "--update") == 0;
+
+    TelemetryFrame f = telemetry_frame();
+    Bytes telemetry = encode(f, 42, 1234567890123ULL);
+    CHECK(telemetry.size() == 72);
+
+    std::vector<Sample> s = samples();
+    Bytes sampled(samples_frame_size(s.size()));
+    CHECK(encode_samples(s.data(), s.size(), 7, sampled.data(), sampled.size()) == sampled.size());
+
+    Bytes command = encode(FRAME_COMMAND, commands());
+    Bytes ack = encode(FRAME_ACK, acks());
+
+    check_golden("telemetry_3cell.bin", telemetry);
+    check_golden("samples.bin", sampled);
+    check_golden("command.bin", command);
+    check_golden("ack.bin", ack);
+
+    //before the charging loop has published, every cell says so
+    f.cells_version = 0;
+    Bytes empty = encode(f, 1, 0);
+    for (size_t i = 0; i < f.cells(); i++) CHECK(empty[PROTO_HEADER_SIZE + TELEMETRY_HEADER_SIZE + i * TELEMETRY_RECORD_SIZE + 14] & CELL_NO_DATA);
+
+    Bytes stream;
+    for (const Bytes* b : { &telemetry, &sampled, &command, &ack }) stream.insert(stream.end(), b->begin(), b->end());
+
+    //in one read, one byte per read, and split in two at every offset
+    FrameReader reader;
+    reader.feed(stream.data(), stream.size());
+    CHECK(check_frames(reader) == 4);
+    int frames = 0;
+    for (uint8_t byte : stream) {
+        reader.feed(&byte, 1);
+        frames += check_frames(reader);
+    }
+    CHECK(frames == 4);
+    for (size_t split = 0; split <= stream.size(); split++) {
+        FrameReader r;
+        r.feed(stream.data(), split);
+        uint8_t type;
+        Bytes payload;
+        int got = 0;
+        while (r.next(type, payload)) got++;
+        r.feed(stream.data() + split, stream.size() - split);
+        while (r.next(type, payload)) got++;
+        CHECK(got == 4 && !r.bad());
+    }
+
+    //corrupt headers stop the stream until reset()
+    uint8_t type;
+    Bytes payload;
+    Bytes bad_magic = telemetry;
+    bad_magic[1] = 'X';
+    reader.reset();
+    reader.feed(bad_magic.data(), bad_magic.size());
+    CHECK(!reader.next(type, payload) && reader.bad());
+    reader.feed(telemetry.data(), telemetry.size());
+    CHECK(!reader.next(type, payload) && reader.bad());
+
+    Bytes bad_version = telemetry;
+    bad_version[2] = PROTO_VERSION + 1;
+    reader.reset();
+    reader.feed(bad_version.data(), bad_version.size());
+    CHECK(!reader.next(type, payload) && reader.bad());
+
+    uint8_t oversized[PROTO_HEADER_SIZE];   //rejected from the header alone, before the payload arrives
+    put_frame_header(oversized, FRAME_TELEMETRY, PROTO_MAX_PAYLOAD + 1);
+    reader.reset();
+    reader.feed(oversized, sizeof(oversized));
+    CHECK(!reader.next(type, payload) && reader.bad());
+
+    reader.reset();
+    reader.feed(telemetry.data(), telemetry.size());
+    CHECK(reader.next(type, payload) && !reader.bad());
+
+    return check_result("protocol_test");
+}
@@ -0,0 +1,169 @@
+/*
+* brief : safety supervisor behaviour - every hard-limit fault on a simulated cell, the reaction
+*         within one supervisor period, the hold after the last violation and the refused relay
+*
+* build : g++ -std=c++17 -O2 -DBMS_SIMULATION tests/supervisor_test.cpp -o supervisor_test -lpthread
+* run   : ./supervisor_test
+*
+* The cell's samples and temperatures are handed to the supervisor directly on
+* the SimHal clock (free-running, speedup 0), one supervisor pass at a time, so
+* every time below is exact.
+*/
+#include <iostream>
+#include <functional>
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include "../bms/sim_hal.h"
+#include "../bms/temp_service.h"
+#include "../bms/telemetry.h"
+#include "../bms/supervisor.h"
+#include "../bms/relays.h"
+#include "check.h"
+
+#define PERIOD_US (SAFETY_PERIOD_MS * 1000ULL)
+#define DUTY 50     //% of the charge PWM before a fault
+
+static std::vector<CellPorts> one_cell() {
+    return { { TCA_ADDR, 0, INA219_ADDR, 1, 4, 0, "/sim/cell/w1_slave", "/sim/resistor/w1_slave" } };
+}
+
+struct Rig {    //one cell, what the charging task and the DS18B20 sweep would hand the supervisor
+    std::vector<CellPorts> ports = one_cell();
+    SimHal hal{ports, 13, 0.0};
+    TempService temps{hal, { ports[0].temp_path, ports[0].resistor_temp_path }};
+    Telemetry telemetry{1};
+    RelayBank relays{hal, ports, telemetry};
+    SafetySupervisor supervisor{hal, ports, temps};
+
+    float voltage = 3.8f, current = 500.0f, cell_c = 30.0f, resistor_c = 30.0f;
+    bool sampling = true;   //false: the INA219 stopped answering
+
+    Rig() {
+        supervisor.setRelays([this](size_t i) { return relays.state(i); }, [this](size_t i) { return relays.open(i); });
+        relays.setSupervisor(&supervisor);
+        hal.pwmCreate(ports[0].pwm_pin, 0, 100, 100);
+        feed();
+        supervisor.arm();
+    }
+
+    void feed() {
+        uint64_t now = hal.nowUs();
+        if (sampling) supervisor.sample(0, voltage, current, now);
+        temps.store(0, cell_c, now);
+        temps.store(1, resistor_c, now);
+    }
+
+    //one supervisor period; returns its time
+    uint64_t pass() {
+        hal.sleepMs(SAFETY_PERIOD_MS);
+        feed();
+        supervisor.check();
+        return hal.nowUs();
+    }
+
+    double duty() { return hal.cell(0).duty; }
+    bool relayOn() { return hal.cell(0).relay; }
+    bool held() { return supervisor.inhibited(0) || supervisor.relayInhibited(0); }
+};
+
+struct Fault {
+    const char* name;
+    bool cuts_charge;
+    bool opens_relay;
+    uint64_t onset_us;      //after the injection, when the violation exists (a dropout has to age first)
+    std::function<void(Rig&)> inject;
+    std::function<void(Rig&)> clear;
+};
+
+static void run(const Fault& f) {
+    std::cout << f.name << std::endl;
+    Rig r;
+    CHECK(r.relays.set(0, true));   //discharging, and charging at DUTY
+    r.hal.pwmWrite(r.ports[0].pwm_pin, DUTY);
+    for (int k = 0; k < 20; k++) r.pass();
+    CHECK(r.supervisor.faults(0) == 0);
+    CHECK(!r.held());
+    CHECK(r.duty() == DUTY);
+    CHECK(r.relayOn());
+
+    //trips on the first pass that sees the violation
+    f.inject(r);
+    uint64_t injected = r.hal.nowUs();
+    uint64_t tripped = 0;
+    while (!tripped && r.hal.nowUs() - injected <= f.onset_us + 10 * PERIOD_US) {
+        uint64_t now = r.pass();
+        if (r.supervisor.faults(0)) tripped = now;
+    }
+    CHECK(tripped);
+    CHECK(tripped - injected <= f.onset_us + PERIOD_US);
+    CHECK(r.supervisor.inhibited(0) == f.cuts_charge);
+    CHECK(r.duty() == (f.cuts_charge ? 0.0 : DUTY));
+    CHECK(r.supervisor.relayInhibited(0) == f.opens_relay);
+    CHECK(r.relayOn() == !f.opens_relay);
+    CHECK(r.telemetry.relay(0) == (f.opens_relay ? 0 : 1));
+    uint64_t reactions = (f.cuts_charge ? 1 : 0) + (f.opens_relay ? 1 : 0);  //one per output
+    CHECK(r.supervisor.trips() == reactions);
+    CHECK(r.supervisor.reaction().count() == reactions);
+    CHECK(r.supervisor.late() == 0);
+    HistogramSnapshot reaction;
+    r.supervisor.reaction().snapshot(reaction);
+    CHECK(reaction.max <= PERIOD_US);
+
+    //the violation lasts another 500 ms; outputs written meanwhile are undone on the next pass
+    uint64_t last_violation = tripped;
+    for (int k = 0; k < 50; k++) {
+        if (k == 10 && f.cuts_charge) r.hal.pwmWrite(r.ports[0].pwm_pin, DUTY);     //a duty written just before the inhibit
+        if (k == 20 && f.opens_relay) {     //an on that got past the check just before the hold went up
+            r.hal.digitalWrite(r.ports[0].relay_pin, HIGH);
+            r.telemetry.setRelay(r.hal.nowUs(), 0, 1);
+        }
+        if (k == 30 && f.opens_relay) CHECK(!r.relays.set(0, true));
+        uint64_t now = r.pass();
+        if (r.supervisor.faults(0)) last_violation = now;
+        if (f.cuts_charge) CHECK(r.duty() == 0.0);
+        if (f.opens_relay) CHECK(!r.relayOn() && r.telemetry.relay(0) == 0);
+    }
+
+    //held for hold_us after the last violation, the relay refused all along
+    f.clear(r);
+    SafetyLimits limits;
+    uint64_t released = 0;
+    while (!released && r.hal.nowUs() - last_violation <= limits.hold_us + 10 * PERIOD_US) {
+        uint64_t now = r.pass();
+        if (r.supervisor.faults(0)) last_violation = now;
+        if (!r.held()) released = now;
+        else if (f.opens_relay) CHECK(!r.relays.set(0, true) && !r.relayOn());
+    }
+    CHECK(released);
+    CHECK(released - last_violation >= limits.hold_us);
+    CHECK(released - last_violation <= limits.hold_us + PERIOD_US);
+    CHECK(r.supervisor.faults(0) == 0);
+    if (f.opens_relay) {
+        CHECK(r.relays.set(0, true));
+        CHECK(r.relayOn());
+    }
+}
+
+int main() {
+    SafetyLimits limits;
+    std::vector<Fault> faults = {
+        { "over voltage", true, false, 0,
+          [](Rig& r) { r.voltage = SAFETY_MAX_CELL_V + 0.05f; }, [](Rig& r) { r.voltage = 3.8f; } },
+        { "over current", true, true, 0,
+          [](Rig& r) { r.current = SAFETY_MAX_CURRENT_MA + 500.0f; }, [](Rig& r) { r.current = 500.0f; } },
+        { "NaN sample", true, true, limits.sample_max_age_us,
+          [](Rig& r) { r.voltage = NAN; }, [](Rig& r) { r.voltage = 3.8f; } },
+        { "stale sample", true, true, limits.sample_max_age_us,
+          [](Rig& r) { r.sampling = false; }, [](Rig& r) { r.sampling = true; } },
+        { "hot cell", true, true, 0,
+          [](Rig& r) { r.cell_c = SAFETY_MAX_CELL_C + 5.0f; }, [](Rig& r) { r.cell_c = 30.0f; } },
+        { "hot resistor while discharging", false, true, 0,
+          [](Rig& r) { r.resistor_c = SAFETY_MAX_RESISTOR_C + 5.0f; }, [](Rig& r) { r.resistor_c = 30.0f; } },
+        { "under voltage while discharging", false, true, 0,
+          [](Rig& r) { r.voltage = SAFETY_MIN_CELL_V - 0.1f; }, [](Rig& r) { r.voltage = 3.8f; } },
+    };
+    for (const Fault& f : faults) run(f);
+    return check_result("supervisor_test");
+}
@@ -0,0 +1,61 @@
+/*
+* brief : offline telemetry journal reader - prints every frame kept in a journal file
+*
+* build : g++ -std=c++17 -O2 tools/journal_dump.cpp -o journal_dump
+* run   : ./journal_dump [journal file] [--cells]
+*         --cells prints one line per cell instead of a summary per frame
+*/
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include "../bms/journal.h"
+
+int main(int argc, char* argv[]) {
+    const char* path = "bms_telemetry.journal";
+    bool per_cell = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cells") == 0) per_cell = true;
+        else path = argv[i];
+    }
+
+    Journal journal;
+    if (!journal.open(path, 0, true)) {
+        std::cerr << "Could not open journal " << path << ": " << (errno ? strerror(errno) : "not a journal") << std::endl;
+        return 1;
+    }
+    printf("journal %s: capacity %zu bytes, %llu bytes in use, next seq %llu, acked %llu\n",
+           path, journal.capacity(), (unsigned long long)(journal.head() - journal.tail()),
+           (unsigned long long)journal.nextSeq(), (unsigned long long)journal.acked());
+
+    size_t frames = 0, bad = 0;
+    TelemetryMessage msg;
+    journal.forEach([&](uint64_t seq, const uint8_t* frame, size_t length) {
+        frames++;
+        const char* state = seq <= journal.acked() ? "acked" : "pending";
+        if (length < PROTO_HEADER_SIZE || frame[3] != FRAME_TELEMETRY ||
+            !decode_telemetry(frame + PROTO_HEADER_SIZE, length - PROTO_HEADER_SIZE, msg)) {
+            bad++;
+            printf("%10llu %-7s frame type %d, %zu bytes\n", (unsigned long long)seq, state, length ? frame[3] : -1, length);
+            return;
+        }
+        float min_v = NAN, max_v = NAN;
+        for (const CellRecord& c : msg.cells) {
+            if (std::isnan(c.voltage)) continue;
+            if (!(c.voltage >= min_v)) min_v = c.voltage;
+            if (!(c.voltage <= max_v)) max_v = c.voltage;
+        }
+        printf("%10llu %-7s t=%.3f s  cells %zu  V %.3f..%.3f  resister fan %d%%\n", (unsigned long long)seq, state,
+               msg.timestamp_us / 1e6, msg.cells.size(), min_v, max_v, msg.resister_fan_pwm);
+        if (!per_cell) return;
+        for (size_t i = 0; i < msg.cells.size(); i++) {
+            const CellRecord& c = msg.cells[i];
+            printf("           cell %3zu  %.3f V  %8.2f mA  %6.2f C  soc %3d%%  duty %3d%%  mode %d  fan %3d%%  relay %d\n",
+                   i + 1, c.voltage, c.current, c.temperature, c.soc, c.duty_cycle, c.charge_mode, c.fan_pwm, c.relay_state);
+        }
+    });
+    printf("%zu frames, %zu not telemetry\n", frames, bad);
+    return 0;
+}